@@ -0,0 +1,169 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// Memory for the arena comes straight from mmap, so it is always page aligned, and since page
+// sizes are powers of 2 of at least 1KB, every page keystretch hashes is cache line aligned.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "arena.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_PAGE_2MB (1ULL << 21)
+#define HUGE_PAGE_1GB (1ULL << 30)
+
+static inline uint64 roundUp(uint64 size, uint64 alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Try to map size bytes from the hugetlb pool.  This fails right away if the pool does not
+// have enough free pages reserved.
+static void *mapHugetlb(uint64 size, int sizeFlag) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | sizeFlag,
+        -1, 0);
+    return mem == MAP_FAILED? NULL : mem;
+}
+
+// Return true unless transparent huge pages are turned off entirely.
+static bool transparentHugePagesEnabled(void) {
+    char buf[64];
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if(file == NULL) {
+        return false;
+    }
+    bool enabled = fgets(buf, sizeof(buf), file) != NULL && strstr(buf, "[never]") == NULL;
+    fclose(file);
+    return enabled;
+}
+
+// Map size bytes of normal pages aligned to alignment, by mapping extra and trimming the ends.
+static void *mapAligned(uint64 size, uint64 alignment) {
+    uint64 extendedSize = size + alignment;
+    uint8 *mem = mmap(NULL, extendedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) {
+        return NULL;
+    }
+    uint8 *aligned = (uint8 *)roundUp((uint64)mem, alignment);
+    if(aligned != mem) {
+        munmap(mem, aligned - mem);
+    }
+    uint64 tailSize = (mem + extendedSize) - (aligned + size);
+    if(tailSize != 0) {
+        munmap(aligned + size, tailSize);
+    }
+    return aligned;
+}
+
+// Map size bytes, using the best backing we can get.
+bool keystretchArenaAllocate(Arena arena, uint64 size) {
+    void *mem = NULL;
+    arena->size = size;
+    if(size >= HUGE_PAGE_1GB) {
+        arena->mappedSize = roundUp(size, HUGE_PAGE_1GB);
+        arena->backing = ARENA_HUGETLB_1GB;
+        mem = mapHugetlb(arena->mappedSize, MAP_HUGE_1GB);
+    }
+    if(mem == NULL && size >= HUGE_PAGE_2MB) {
+        arena->mappedSize = roundUp(size, HUGE_PAGE_2MB);
+        arena->backing = ARENA_HUGETLB_2MB;
+        mem = mapHugetlb(arena->mappedSize, MAP_HUGE_2MB);
+    }
+    if(mem == NULL && size >= HUGE_PAGE_2MB && transparentHugePagesEnabled()) {
+        arena->mappedSize = roundUp(size, HUGE_PAGE_2MB);
+        arena->backing = ARENA_TRANSPARENT;
+        mem = mapAligned(arena->mappedSize, HUGE_PAGE_2MB);
+        if(mem != NULL && madvise(mem, arena->mappedSize, MADV_HUGEPAGE) != 0) {
+            arena->backing = ARENA_NORMAL_PAGES;
+        }
+    }
+    if(mem == NULL) {
+        arena->mappedSize = roundUp(size, CACHE_LINE_SIZE);
+        arena->backing = ARENA_NORMAL_PAGES;
+        mem = mmap(NULL, arena->mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED) {
+            mem = NULL;
+        }
+    }
+    arena->mem = mem;
+    return mem != NULL;
+}
+
+// Touch every page of the arena from byte start up to end, so it is faulted in before we need
+// it.  The memory is still all 0's, so writing 0's changes nothing.  Threads can fault in
+// different ranges at once.
+void keystretchArenaPrefault(Arena arena, uint64 start, uint64 end) {
+    uint8 *mem = (uint8 *)arena->mem;
+    uint64 i;
+    if(end > arena->mappedSize) {
+        end = arena->mappedSize;
+    }
+    for(i = start; i < end; i += 4096) {
+        ((volatile uint8 *)mem)[i] = 0;
+    }
+}
+
+// Set the arena's memory from byte start up to end to 0's.  start and end must be multiples of
+// 64.  We use non-temporal stores, so wiping gigabytes does not flush the caches of whatever
+// runs next, and finish with a compiler barrier that claims to read the memory, so the stores
+// can never be removed as dead.  Threads can wipe different ranges at once.
+void keystretchArenaWipe(Arena arena, uint64 start, uint64 end) {
+    uint8 *mem = (uint8 *)arena->mem;
+    uint64 i;
+    if(end > arena->size) {
+        end = arena->size;
+    }
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    for(i = start; i < end; i += 64) {
+        __m128i *p = (__m128i *)(mem + i);
+        _mm_stream_si128(p, zero);
+        _mm_stream_si128(p + 1, zero);
+        _mm_stream_si128(p + 2, zero);
+        _mm_stream_si128(p + 3, zero);
+    }
+    _mm_sfence();
+#else
+    for(i = start; i < end; i++) {
+        ((volatile uint8 *)mem)[i] = 0;
+    }
+#endif
+    __asm__ __volatile__("" : : "r"(mem) : "memory");
+}
+
+// Release the arena's memory with MADV_DONTNEED, which for private anonymous memory drops the
+// pages, so they read as 0's after.  Hugetlb memory can't be released on older kernels.
+bool keystretchArenaRelease(Arena arena) {
+    return madvise(arena->mem, arena->mappedSize, MADV_DONTNEED) == 0;
+}
+
+// Unmap the arena's memory.
+void keystretchArenaFree(Arena arena) {
+    if(arena->mem != NULL) {
+        munmap(arena->mem, arena->mappedSize);
+        arena->mem = NULL;
+    }
+}
+
+// A short name for the backing, for reporting.
+char *keystretchArenaBackingName(ArenaBacking backing) {
+    switch(backing) {
+    case ARENA_HUGETLB_1GB: return "hugetlb-1GB";
+    case ARENA_HUGETLB_2MB: return "hugetlb-2MB";
+    case ARENA_TRANSPARENT: return "transparent-huge-pages";
+    case ARENA_NORMAL_PAGES: return "normal-pages";
+    }
+    return "unknown";
+}
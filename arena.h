@@ -0,0 +1,51 @@
+// The arena is the big block of memory keystretch hashes.  Pages are read at random from all
+// of it, so we try hard to back it with huge pages, which saves a TLB miss on nearly every
+// page we read.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "keystretch.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Ordered from most to least preferred.
+typedef enum {
+    ARENA_HUGETLB_1GB,    // Explicit 1GB pages from the hugetlb pool
+    ARENA_HUGETLB_2MB,    // Explicit 2MB pages from the hugetlb pool
+    ARENA_TRANSPARENT,    // Normal pages, 2MB aligned, with madvise(MADV_HUGEPAGE)
+    ARENA_NORMAL_PAGES    // Normal pages
+} ArenaBacking;
+
+typedef struct arenaStruct *Arena;
+
+struct arenaStruct {
+    uint64 *mem;       // At least CACHE_LINE_SIZE aligned, in fact page aligned
+    uint64 size;       // Bytes asked for
+    uint64 mappedSize; // Bytes actually mapped
+    ArenaBacking backing;
+};
+
+// Map size bytes, using the best backing we can get.  Returns false if even normal pages fail.
+bool keystretchArenaAllocate(Arena arena, uint64 size);
+
+// Touch every page of the arena from byte start up to end, so it is faulted in before we
+// need it.  Threads can fault in different ranges at once.
+void keystretchArenaPrefault(Arena arena, uint64 start, uint64 end);
+
+// Set the arena's memory from byte start up to end to 0's, with non-temporal stores the
+// compiler cannot remove.  start and end must be multiples of 64.
+void keystretchArenaWipe(Arena arena, uint64 start, uint64 end);
+
+// Hand the arena's memory back to the OS, or to the hugetlb pool, while keeping it mapped.  It
+// reads as 0's after, and is faulted in again when next touched.  Returns false if the kernel
+// won't release it.
+bool keystretchArenaRelease(Arena arena);
+
+// Unmap the arena's memory.
+void keystretchArenaFree(Arena arena);
+
+// A short name for the backing, for reporting.
+char *keystretchArenaBackingName(ArenaBacking backing);
+
+#endif
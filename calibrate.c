@@ -0,0 +1,300 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// keystretch-calibrate picks the parameters for a latency budget on the host it runs on.  It
+// sweeps page sizes from 1KB up to the L2 size, and thread counts up to the CPUs we have, and
+// for each it times keystretchHash at two memory sizes.  The difference gives the fill
+// bandwidth, and the rest is the fixed cost of the initial stretch and thread startup.  The
+// pair that fits the most memory in the budget wins, and its memory size is then checked with
+// real calls, shrinking until it fits.  The result is written as a profile that
+// keystretchLoadProfile and keystretch -p read.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "keystretch.h"
+
+#define SHA256_ROUNDS 4096
+#define MIN_PAGE_SIZE 1024 // keystretchHash needs 8 words per lane
+#define SWEEP_MEMORY_SIZE (64ULL << 20)
+#define SMALL_SWEEP_PAGES (2*MAX_THREADS)
+#define SWEEP_REPEATS 3
+#define MAX_FIT_TRIES 8
+#define DEFAULT_PROFILE "keystretch.profile"
+
+typedef struct resultStruct *Result;
+
+// What we measured for one page size and thread count.
+struct resultStruct {
+    uint32 pageSize;
+    uint32 numThreads;
+    uint64 fixedCost;     // Nanoseconds
+    double fillBandwidth; // Bytes per second
+    uint64 memorySize;    // The most memory we expect to fit in the budget
+};
+
+static uint64 getNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+// keystretchHash reports its parameters on stdout on every call, which would bury our own
+// report, so stdout goes to /dev/null while we hash.
+static int hideStdout(void) {
+    int saved;
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    if(devNull >= 0) {
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+    return saved;
+}
+
+static void showStdout(int saved) {
+    fflush(stdout);
+    if(saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+
+// Return the size in bytes of the level's data or unified cache, from sysfs, or 0 if unknown.
+static uint64 readCacheSize(uint32 level) {
+    char path[256], type[32];
+    uint32 index, cacheLevel;
+    uint64 size;
+    char unit;
+    for(index = 0; index < 16; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/level", index);
+        FILE *file = fopen(path, "r");
+        if(file == NULL) {
+            break;
+        }
+        bool readOk = fscanf(file, "%u", &cacheLevel) == 1;
+        fclose(file);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/type", index);
+        file = fopen(path, "r");
+        if(file == NULL) {
+            continue;
+        }
+        readOk = readOk && fscanf(file, "%31s", type) == 1;
+        fclose(file);
+        if(!readOk || cacheLevel != level || !strcmp(type, "Instruction")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%u/size", index);
+        file = fopen(path, "r");
+        if(file == NULL) {
+            continue;
+        }
+        unit = '\0';
+        readOk = fscanf(file, "%llu%c", &size, &unit) >= 1;
+        fclose(file);
+        if(readOk) {
+            return unit == 'K'? size << 10 : unit == 'M'? size << 20 : size;
+        }
+    }
+    return 0;
+}
+
+// Return the fastest of several keystretchHash calls in nanoseconds, or the slowest if slowest
+// is set, or 0 if hashing fails.
+static uint64 timeHash(KeystretchContext context, uint64 memorySize, uint32 pageSize, uint32 numThreads,
+        uint32 repeats, bool slowest) {
+    uint8 derivedKey[32];
+    uint8 salt[16];
+    char password[16];
+    uint64 best = 0;
+    uint32 i;
+    memset(salt, 0x5a, sizeof(salt));
+    for(i = 0; i < repeats; i++) {
+        strcpy(password, "calibration");
+        int saved = hideStdout();
+        uint64 start = getNanoseconds();
+        bool hashed = keystretchHash(context, SHA256_ROUNDS, 1, memorySize, pageSize, numThreads, derivedKey,
+            sizeof(derivedKey), salt, sizeof(salt), password, strlen(password), true, true);
+        uint64 elapsed = getNanoseconds() - start;
+        showStdout(saved);
+        if(!hashed) {
+            return 0;
+        }
+        if(best == 0 || (slowest? elapsed > best : elapsed < best)) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+// Time the page size and thread count at a small and a large memory size, and fit a line.
+// Returns false if hashing failed.
+static bool measure(Result result, uint32 pageSize, uint32 numThreads, uint64 latencyBudget,
+        uint64 maxMemorySize) {
+    uint64 smallMemory = (uint64)SMALL_SWEEP_PAGES*pageSize;
+    uint64 largeMemory = SWEEP_MEMORY_SIZE;
+    if(largeMemory < 8*smallMemory) {
+        largeMemory = 8*smallMemory;
+    }
+    if(largeMemory > maxMemorySize) {
+        largeMemory = maxMemorySize - maxMemorySize % pageSize;
+    }
+    if(largeMemory <= smallMemory) {
+        return false;
+    }
+    int saved = hideStdout();
+    KeystretchContext context = keystretchCreateContext(largeMemory, numThreads);
+    showStdout(saved);
+    if(context == NULL) {
+        return false;
+    }
+    uint64 smallTime = timeHash(context, smallMemory, pageSize, numThreads, SWEEP_REPEATS, false);
+    uint64 largeTime = timeHash(context, largeMemory, pageSize, numThreads, SWEEP_REPEATS, false);
+    keystretchDestroyContext(context);
+    if(smallTime == 0 || largeTime == 0) {
+        return false;
+    }
+    result->pageSize = pageSize;
+    result->numThreads = numThreads;
+    if(largeTime <= smallTime) {
+        largeTime = smallTime + 1; // Noise on a tiny sweep
+    }
+    result->fillBandwidth = (largeMemory - smallMemory)*1.0e9/(largeTime - smallTime);
+    uint64 perPage = (uint64)((double)pageSize*1.0e9/result->fillBandwidth);
+    result->fixedCost = smallTime > SMALL_SWEEP_PAGES*perPage? smallTime - SMALL_SWEEP_PAGES*perPage : 0;
+    result->memorySize = 0;
+    if(latencyBudget > result->fixedCost) {
+        result->memorySize = (uint64)((latencyBudget - result->fixedCost)*1.0e-9*result->fillBandwidth);
+    }
+    if(result->memorySize > maxMemorySize) {
+        result->memorySize = maxMemorySize;
+    }
+    return true;
+}
+
+// Round memorySize down to whole MB, and at least more than MAX_THREADS pages.
+static uint64 roundMemory(uint64 memorySize, uint32 pageSize) {
+    uint64 minMemory = (uint64)(MAX_THREADS + 1)*pageSize;
+    memorySize -= memorySize % (1 << 20);
+    if(memorySize < minMemory) {
+        memorySize = minMemory + (1 << 20) - 1;
+        memorySize -= memorySize % (1 << 20);
+    }
+    return memorySize;
+}
+
+// Check the winner's memory size with real calls, shrinking it until the slowest call fits in
+// the budget.  Returns the latency of the last call, or 0 if hashing failed.
+static uint64 fitMemory(Result best, uint64 latencyBudget) {
+    uint64 memorySize = roundMemory(best->memorySize, best->pageSize);
+    uint64 latency = 0;
+    uint32 tries;
+    for(tries = 0; tries < MAX_FIT_TRIES; tries++) {
+        int saved = hideStdout();
+        KeystretchContext context = keystretchCreateContext(memorySize, best->numThreads);
+        showStdout(saved);
+        if(context == NULL) {
+            return 0;
+        }
+        latency = timeHash(context, memorySize, best->pageSize, best->numThreads, SWEEP_REPEATS, true);
+        keystretchDestroyContext(context);
+        if(latency == 0) {
+            return 0;
+        }
+        printf("check: %lluMB in %.1fms\n", memorySize >> 20, latency*1.0e-6);
+        if(latency <= latencyBudget || memorySize <= roundMemory(0, best->pageSize)) {
+            break;
+        }
+        // Aim a little under, so we don't need many tries
+        memorySize = roundMemory((uint64)(memorySize*0.97*latencyBudget/latency), best->pageSize);
+    }
+    best->memorySize = memorySize;
+    return latency;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: keystretch-calibrate <latency budget in ms> [max memory in MB] [profile file]\n"
+        "    Writes the parameters that hash the most memory within the budget to the profile,\n"
+        "    " DEFAULT_PROFILE " by default.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *profilePath = DEFAULT_PROFILE;
+    uint64 maxMemorySize;
+    keystretchSetLog(keystretchLogStdio, NULL);
+    if(argc < 2 || argc > 4) {
+        usage();
+    }
+    uint64 latencyBudget = strtoull(argv[1], NULL, 0)*1000000ULL;
+    if(argc >= 3) {
+        maxMemorySize = strtoull(argv[2], NULL, 0) << 20;
+    } else {
+        // Half the RAM, so calibration doesn't push the host into swap
+        maxMemorySize = (uint64)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE)/2;
+    }
+    if(argc == 4) {
+        profilePath = argv[3];
+    }
+    if(latencyBudget == 0 || maxMemorySize < (1 << 20)) {
+        usage();
+    }
+    uint64 l1Size = readCacheSize(1);
+    uint64 l2Size = readCacheSize(2);
+    long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32 maxThreads = numCpus < 1? 1 : numCpus > MAX_THREADS? MAX_THREADS : numCpus;
+    uint64 maxPageSize = l2Size != 0? l2Size : 1 << 18;
+    printf("L1 data cache: %lluKB, L2 cache: %lluKB, CPUs: %ld\n", l1Size >> 10, l2Size >> 10, numCpus);
+
+    struct resultStruct best, result;
+    memset(&best, '\0', sizeof(best));
+    uint32 numThreads, pageSize;
+    for(numThreads = 1;; numThreads = 2*numThreads > maxThreads? maxThreads : 2*numThreads) {
+        for(pageSize = MIN_PAGE_SIZE; pageSize <= maxPageSize; pageSize <<= 1) {
+            if(!measure(&result, pageSize, numThreads, latencyBudget, maxMemorySize)) {
+                continue;
+            }
+            printf("pageSize %uKB%s threads %u: %.2f GB/s, fixed %.1fms, fits %lluMB\n", pageSize >> 10,
+                pageSize == l1Size? " (L1)" : pageSize == l2Size? " (L2)" : "", numThreads,
+                result.fillBandwidth*1.0e-9, result.fixedCost*1.0e-6, result.memorySize >> 20);
+            // Prefer fewer threads and smaller pages unless they fit clearly less
+            if(result.memorySize > best.memorySize + best.memorySize/50) {
+                best = result;
+            }
+        }
+        if(numThreads == maxThreads) {
+            break;
+        }
+    }
+    if(best.memorySize == 0) {
+        fprintf(stderr, "No parameters fit in %llums\n", latencyBudget/1000000);
+        return 1;
+    }
+    uint64 latency = fitMemory(&best, latencyBudget);
+    if(latency == 0) {
+        fprintf(stderr, "Hashing failed\n");
+        return 1;
+    }
+    if(latency > latencyBudget) {
+        fprintf(stderr, "Even the smallest memory takes %.1fms\n", latency*1.0e-6);
+        return 1;
+    }
+    KeystretchProfile profile;
+    profile.sha256HashRounds = SHA256_ROUNDS;
+    profile.cpuWorkMultiplier = 1;
+    profile.memorySize = best.memorySize;
+    profile.pageSize = best.pageSize;
+    profile.numThreads = best.numThreads;
+    profile.latency = latency;
+    profile.fillBandwidth = (uint64)best.fillBandwidth;
+    if(!keystretchSaveProfile(profilePath, &profile)) {
+        return 1;
+    }
+    printf("profile %s: memorySize %lluMB pageSize %uKB numThreads %u latency %.1fms\n", profilePath,
+        profile.memorySize >> 20, profile.pageSize >> 10, profile.numThreads, latency*1.0e-6);
+    return 0;
+}
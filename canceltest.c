@@ -0,0 +1,99 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// canceltest checks keystretchCancelHash: it must stop the hash running on a context, and the
+// calls already waiting for the context's lock, but not calls made after it.  It prints what
+// it checks, and exits with 1 if any check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "keystretch.h"
+
+#define MEMORY_SIZE (16 << 20)
+#define PAGE_SIZE (16 << 10)
+#define KEY_SIZE 32
+#define QUEUE_WAIT_US 200000 // Long enough for a thread to block on the context's lock
+
+typedef struct callStruct *Call;
+
+// One keystretchHash call, run on its own thread.
+struct callStruct {
+    KeystretchContext context;
+    pthread_t thread;
+    bool succeeded;
+};
+
+static uint32 started; // Set when the first round is filled, only access with __atomic builtins
+static uint32 release; // Set to let the hash go on, only access with __atomic builtins
+
+// Hold the hash after its first round until told to go on, so the test can queue calls behind
+// it.
+static bool holdHash(uint32 pagesFilled, uint32 numPages, void *userData) {
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    while(!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    return true;
+}
+
+static bool hash(KeystretchContext context) {
+    uint8 key[KEY_SIZE];
+    char password[] = "password";
+    return keystretchHash(context, 16, 1, MEMORY_SIZE, PAGE_SIZE, 1, key, KEY_SIZE, "canceltest salt", 15,
+        password, strlen(password), false, false);
+}
+
+static void *runCall(void *arg) {
+    Call call = (Call)arg;
+    call->succeeded = hash(call->context);
+    return NULL;
+}
+
+static void startCall(Call call, KeystretchContext context) {
+    call->context = context;
+    if(pthread_create(&call->thread, NULL, runCall, call) != 0) {
+        fprintf(stderr, "Unable to create thread\n");
+        exit(1);
+    }
+}
+
+static bool check(bool passed, const char *name) {
+    printf("%s %s\n", name, passed? "passed" : "FAILED");
+    return passed;
+}
+
+int main(void) {
+    struct callStruct running, queued;
+    bool passed = true;
+    KeystretchContext context = keystretchCreateContext(MEMORY_SIZE, 1);
+    if(context == NULL) {
+        return 1;
+    }
+
+    // A cancel with nothing running must not cancel the next call.
+    keystretchCancelHash(context);
+    passed &= check(hash(context), "idle cancel");
+
+    // Cancel a hash while another call is queued behind it: both must fail.
+    keystretchSetProgress(context, holdHash, NULL);
+    startCall(&running, context);
+    while(!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    startCall(&queued, context);
+    usleep(QUEUE_WAIT_US);
+    keystretchCancelHash(context);
+    __atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+    pthread_join(running.thread, NULL);
+    pthread_join(queued.thread, NULL);
+    passed &= check(!running.succeeded, "running cancel");
+    passed &= check(!queued.succeeded, "queued cancel");
+
+    // Calls made after the cancel run as usual.
+    keystretchSetProgress(context, NULL, NULL);
+    passed &= check(hash(context), "later call");
+    keystretchDestroyContext(context);
+    return passed? 0 : 1;
+}
@@ -0,0 +1,62 @@
+// This file is released into the public domain, like the rest of keystretch.
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "counters.h"
+
+// Open one counter for the calling thread, on whatever CPU it runs on, counting user and
+// kernel time, so page faults show up too.  Returns -1 if we can't.
+static int openCounter(uint32 type, uint64 config) {
+    struct perf_event_attr attr;
+    memset(&attr, '\0', sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if(fd < 0) {
+        // Counting the kernel may not be allowed, so try the user side alone
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+// Start counting cycles, last level cache misses and dTLB load misses on the calling thread.
+bool keystretchCountersStart(Counters counters) {
+    uint32 i;
+    bool started = false;
+    counters->fds[COUNTER_CYCLES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fds[COUNTER_LLC_MISSES] = openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    counters->fds[COUNTER_DTLB_MISSES] = openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        if(counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            started = true;
+        }
+    }
+    return started;
+}
+
+// Stop the counters, and read them into values.
+void keystretchCountersStop(Counters counters, uint64 *values) {
+    uint32 i;
+    for(i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = 0;
+        if(counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if(read(counters->fds[i], values + i, sizeof(uint64)) != sizeof(uint64)) {
+                values[i] = 0;
+            }
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+}
@@ -0,0 +1,30 @@
+// Hardware performance counters for the fill workers, from perf_event_open, so a slow run can
+// be traced to the CPU (cycles), the caches (LLC misses), or page walks (dTLB misses).
+// Counters only count the thread that started them.  They may be unavailable, such as in
+// containers, or with kernel.perf_event_paranoid set high, and then they read as 0.
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "keystretch.h"
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    NUM_COUNTERS
+} CounterType;
+
+typedef struct countersStruct *Counters;
+
+struct countersStruct {
+    int fds[NUM_COUNTERS]; // -1 for counters we could not open
+};
+
+// Start counting on the calling thread.  Returns false if no counter could be opened.
+bool keystretchCountersStart(Counters counters);
+
+// Stop counting, write the counts to values, and close the counters.
+void keystretchCountersStop(Counters counters, uint64 *values);
+
+#endif
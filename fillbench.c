@@ -0,0 +1,135 @@
+// This file benchmarks the page filling kernels on pages that stay in cache, so it measures
+// how fast the CPU can hash rather than memory bandwidth.  Each kernel is first checked
+// against the scalar kernel, with a CPU work multiplier of 1 and of CHECK_MULTIPLIER, so the
+// inner loop that hashes a page again is checked too.  Kernels are compiled separately for
+// common page sizes, and for those, the generic loop is checked and timed too.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fillpage.h"
+
+#define NUM_LANES MAX_THREADS
+#define MIN_SECONDS 0.5
+#define CHECK_MULTIPLIER 3 // Kernels are also checked with this CPU work multiplier
+
+static double getSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1.0e-9;
+}
+
+// Fill NUM_LANES pages from the pages before them, in groups of the kernel's width.
+static void fillLanes(FillKernel kernel, FillPagesFunc fillPages, struct laneStateStruct *states, uint64 *mem,
+        uint32 pageLength, uint32 cpuWorkMultiplier) {
+    LaneState statePtrs[NUM_LANES];
+    uint64 *fromPages[NUM_LANES], *toPages[NUM_LANES];
+    uint32 lane;
+    for(lane = 0; lane < NUM_LANES; lane++) {
+        statePtrs[lane] = states + lane;
+        fromPages[lane] = mem + lane*pageLength;
+        toPages[lane] = mem + (lane + NUM_LANES)*pageLength;
+    }
+    for(lane = 0; lane < NUM_LANES; lane += kernel->width) {
+        uint32 numLanes = NUM_LANES - lane < kernel->width? NUM_LANES - lane : kernel->width;
+        fillPages(statePtrs + lane, fromPages + lane, toPages + lane, numLanes, pageLength, cpuWorkMultiplier);
+    }
+}
+
+static void initLanes(struct laneStateStruct *states, uint64 *mem, uint32 pageLength) {
+    uint32 i;
+    srand(1);
+    for(i = 0; i < 2*NUM_LANES*pageLength; i++) {
+        mem[i] = ((uint64)rand() << 42) ^ ((uint64)rand() << 21) ^ rand();
+    }
+    for(i = 0; i < NUM_LANES; i++) {
+        memcpy(states[i].key, mem + 8*i, 8*sizeof(uint64));
+        states[i].lastPageData = mem[i];
+    }
+}
+
+// Return true if the kernel writes the same pages and states as the generic scalar kernel.
+static bool checkKernel(FillKernel kernel, FillPagesFunc fillPages, uint32 pageLength,
+        uint32 cpuWorkMultiplier) {
+    uint64 memLength = 2*NUM_LANES*pageLength;
+    uint64 *expected = malloc(memLength*sizeof(uint64));
+    uint64 *mem = malloc(memLength*sizeof(uint64));
+    struct laneStateStruct expectedStates[NUM_LANES], states[NUM_LANES];
+    initLanes(expectedStates, expected, pageLength);
+    initLanes(states, mem, pageLength);
+    FillKernel scalar = keystretchFillKernelFind("scalar");
+    fillLanes(scalar, scalar->fillPagesGeneric, expectedStates, expected, pageLength, cpuWorkMultiplier);
+    fillLanes(kernel, fillPages, states, mem, pageLength, cpuWorkMultiplier);
+    bool passed = !memcmp(expected, mem, memLength*sizeof(uint64)) &&
+        !memcmp(expectedStates, states, sizeof(states));
+    free(expected);
+    free(mem);
+    return passed;
+}
+
+// Return the rate the kernel fills pages in GB/s.
+static double timeKernel(FillKernel kernel, FillPagesFunc fillPages, uint32 pageLength) {
+    uint64 *mem = malloc(2*NUM_LANES*pageLength*sizeof(uint64));
+    struct laneStateStruct states[NUM_LANES];
+    initLanes(states, mem, pageLength);
+    uint64 bytes = 0;
+    double start = getSeconds();
+    double elapsed;
+    do {
+        uint32 i;
+        for(i = 0; i < 16; i++) {
+            fillLanes(kernel, fillPages, states, mem, pageLength, 1);
+        }
+        bytes += 16ULL*NUM_LANES*pageLength*sizeof(uint64);
+        elapsed = getSeconds() - start;
+    } while(elapsed < MIN_SECONDS);
+    free(mem);
+    return bytes/elapsed/1.0e9;
+}
+
+// Return true if the kernels are compiled separately for this page size.
+static bool isSpecialized(uint32 pageSize) {
+    return pageSize == (4 << 10) || pageSize == (8 << 10) || pageSize == (16 << 10) || pageSize == (32 << 10);
+}
+
+int main(int argc, char **argv) {
+    uint32 pageSize = 4096;
+    keystretchSetLog(keystretchLogStdio, NULL);
+    if(argc > 2) {
+        fprintf(stderr, "Usage: fillbench [page size in bytes]\n");
+        return 1;
+    }
+    if(argc == 2) {
+        pageSize = atoi(argv[1]);
+    }
+    if(pageSize < 64 || (pageSize & (pageSize - 1))) {
+        fprintf(stderr, "Page size must be a power of 2, at least 64\n");
+        return 1;
+    }
+    uint32 pageLength = pageSize/sizeof(uint64);
+    printf("default kernel: %s\n", keystretchFillKernelSelect()->name);
+    uint32 i;
+    bool passed = true;
+    for(i = 0; i < keystretchFillKernelCount; i++) {
+        FillKernel kernel = keystretchFillKernels + i;
+        if(!kernel->isSupported()) {
+            printf("%-8s not supported\n", kernel->name);
+            continue;
+        }
+        if(!checkKernel(kernel, kernel->fillPages, pageLength, 1) ||
+                !checkKernel(kernel, kernel->fillPagesGeneric, pageLength, 1) ||
+                !checkKernel(kernel, kernel->fillPages, pageLength, CHECK_MULTIPLIER) ||
+                !checkKernel(kernel, kernel->fillPagesGeneric, pageLength, CHECK_MULTIPLIER)) {
+            printf("%-8s FAILED: output differs from scalar\n", kernel->name);
+            passed = false;
+            continue;
+        }
+        printf("%-8s width %u: %.2f GB/s", kernel->name, kernel->width,
+            timeKernel(kernel, kernel->fillPages, pageLength));
+        if(isSpecialized(pageSize)) {
+            printf(", generic loop %.2f GB/s", timeKernel(kernel, kernel->fillPagesGeneric, pageLength));
+        }
+        printf("\n");
+    }
+    return passed? 0 : 1;
+}
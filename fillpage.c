@@ -0,0 +1,384 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// Variables ending in "size" are in bytes, while variables ending in "length" are in
+// 64-bit words.
+//
+// Within a page, each key depends on the one just computed, so a single lane is a long chain
+// of 64-bit multiplies.  The vector kernels keep a row of 8 keys in registers, and hide the
+// latency by running several lanes side by side.  SSE4.1 and AVX2 have no 64-bit multiply,
+// so they build one from 32-bit multiplies.
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include "fillpage.h"
+#include "log.h"
+
+// Fill toPage, hashing with the key and fromPage as we go.
+static inline __attribute__((always_inline)) void fillPage(LaneState state, uint64 *fromPage, uint64 *toPage,
+        uint32 pageLength, uint32 cpuWorkMultiplier) {
+    uint64 key0 = state->key[0];
+    uint64 key1 = state->key[1];
+    uint64 key2 = state->key[2];
+    uint64 key3 = state->key[3];
+    uint64 key4 = state->key[4];
+    uint64 key5 = state->key[5];
+    uint64 key6 = state->key[6];
+    uint64 key7 = state->key[7];
+    uint64 lastPageData = state->lastPageData;
+    uint64 pageData0, pageData1, pageData2, pageData3;
+    uint64 pageData4, pageData5, pageData6, pageData7 = 0;
+    uint32 workMultiplier = cpuWorkMultiplier;
+    while(workMultiplier--) {
+        uint32 numLoops = pageLength;
+        uint64 *page = toPage;
+        uint32 i;
+        for(i = 0; i < numLoops; ) {
+            pageData0 = fromPage[i++];
+            pageData1 = fromPage[i++];
+            pageData2 = fromPage[i++];
+            pageData3 = fromPage[i++];
+            pageData4 = fromPage[i++];
+            pageData5 = fromPage[i++];
+            pageData6 = fromPage[i++];
+            pageData7 = fromPage[i++];
+
+            key0 += (pageData0*key1) ^ lastPageData;
+            key1 += (pageData1*key2) ^ pageData0;
+            key2 += (pageData2*key3) ^ pageData1;
+            key3 += (pageData3*key4) ^ pageData2;
+            key4 += (pageData4*key5) ^ pageData3;
+            key5 += (pageData5*key6) ^ pageData4;
+            key6 += (pageData6*key7) ^ pageData5;
+            key7 += (pageData7*key0) ^ pageData6;
+            lastPageData = pageData7;
+
+            *page++ = key0;
+            *page++ = key1;
+            *page++ = key2;
+            *page++ = key3;
+            *page++ = key4;
+            *page++ = key5;
+            *page++ = key6;
+            *page++ = key7;
+        }
+    }
+    state->key[0] = key0;
+    state->key[1] = key1;
+    state->key[2] = key2;
+    state->key[3] = key3;
+    state->key[4] = key4;
+    state->key[5] = key5;
+    state->key[6] = key6;
+    state->key[7] = key7;
+    state->lastPageData = lastPageData;
+}
+
+// Fill each lane on its own with fillPage, with pageLength passed on, so it can be a constant.
+#define FILL_ONE_AT_A_TIME(pageLength) \
+    for(; numLanes != 0; numLanes--) { \
+        fillPage(*states++, *fromPages++, *toPages++, pageLength, cpuWorkMultiplier); \
+    }
+
+// Fill the lanes in groups of 8, 4, 2 and 1 with fillLanes, which must be an inline function
+// taking the group size as its last parameter, so each size is compiled separately.
+#define FILL_IN_GROUPS(fillLanes, pageLength) \
+    while(numLanes >= 8) { \
+        fillLanes(states, fromPages, toPages, pageLength, cpuWorkMultiplier, 8); \
+        states += 8; fromPages += 8; toPages += 8; numLanes -= 8; \
+    } \
+    if(numLanes >= 4) { \
+        fillLanes(states, fromPages, toPages, pageLength, cpuWorkMultiplier, 4); \
+        states += 4; fromPages += 4; toPages += 4; numLanes -= 4; \
+    } \
+    if(numLanes >= 2) { \
+        fillLanes(states, fromPages, toPages, pageLength, cpuWorkMultiplier, 2); \
+        states += 2; fromPages += 2; toPages += 2; numLanes -= 2; \
+    } \
+    if(numLanes == 1) { \
+        fillLanes(states, fromPages, toPages, pageLength, cpuWorkMultiplier, 1); \
+    }
+
+// Run fill, one of the macros above, with the page length as a constant for the page sizes
+// people use, so the row loop has a known trip count, and with the generic loop otherwise.
+#define FILL_BY_PAGE_SIZE(fill, ...) \
+    switch(pageLength) { \
+    case (4 << 10)/sizeof(uint64): fill(__VA_ARGS__ (4 << 10)/sizeof(uint64)) break; \
+    case (8 << 10)/sizeof(uint64): fill(__VA_ARGS__ (8 << 10)/sizeof(uint64)) break; \
+    case (16 << 10)/sizeof(uint64): fill(__VA_ARGS__ (16 << 10)/sizeof(uint64)) break; \
+    case (32 << 10)/sizeof(uint64): fill(__VA_ARGS__ (32 << 10)/sizeof(uint64)) break; \
+    default: fill(__VA_ARGS__ pageLength) \
+    }
+
+static void fillPagesScalar(LaneState *states, uint64 **fromPages, uint64 **toPages, uint32 numLanes,
+        uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_BY_PAGE_SIZE(FILL_ONE_AT_A_TIME)
+}
+
+static void fillPagesScalarGeneric(LaneState *states, uint64 **fromPages, uint64 **toPages, uint32 numLanes,
+        uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_ONE_AT_A_TIME(pageLength)
+}
+
+// The vector kernels only read the last word of each from-page into lastPageData once a
+// page is done, since that is where the row loop leaves it.
+static inline void saveLastPageData(LaneState *states, uint64 **fromPages, uint32 pageLength,
+        uint32 cpuWorkMultiplier, uint32 numLanes) {
+    uint32 lane;
+    if(cpuWorkMultiplier != 0) {
+        for(lane = 0; lane < numLanes; lane++) {
+            states[lane]->lastPageData = fromPages[lane][pageLength - 1];
+        }
+    }
+}
+
+#define SSE41 __attribute__((target("sse4.1"), always_inline)) inline
+#define AVX2 __attribute__((target("avx2"), always_inline)) inline
+#define AVX512 __attribute__((target("avx512f,avx512dq"), always_inline)) inline
+
+// Low 64 bits of a 64x64 multiply from 32-bit multiplies: lo*lo + ((lo*hi + hi*lo) << 32).
+static SSE41 __m128i mul64Sse41(__m128i a, __m128i b) {
+    __m128i cross = _mm_mullo_epi32(a, _mm_shuffle_epi32(b, 0xb1));
+    __m128i high = _mm_slli_epi64(_mm_add_epi32(cross, _mm_srli_epi64(cross, 32)), 32);
+    return _mm_add_epi64(_mm_mul_epu32(a, b), high);
+}
+
+// A row of 8 keys is 4 registers of 2 words.  alignr shifts a word in from the neighbouring
+// register, which gives both the next key and the previous page word.
+static SSE41 void fillLanesSse41(LaneState *states, uint64 **fromPages, uint64 **toPages,
+        uint32 pageLength, uint32 cpuWorkMultiplier, const uint32 numLanes) {
+    __m128i key[8][4], prev[8];
+    uint32 lane, i;
+    for(lane = 0; lane < numLanes; lane++) {
+        for(i = 0; i < 4; i++) {
+            key[lane][i] = _mm_loadu_si128((__m128i *)(states[lane]->key + 2*i));
+        }
+        prev[lane] = _mm_set1_epi64x(states[lane]->lastPageData);
+    }
+    while(cpuWorkMultiplier--) {
+        for(i = 0; i < pageLength; i += 8) {
+            for(lane = 0; lane < numLanes; lane++) {
+                __m128i *from = (__m128i *)(fromPages[lane] + i);
+                __m128i *to = (__m128i *)(toPages[lane] + i);
+                __m128i *k = key[lane];
+                __m128i p01 = _mm_loadu_si128(from);
+                __m128i p23 = _mm_loadu_si128(from + 1);
+                __m128i p45 = _mm_loadu_si128(from + 2);
+                __m128i p67 = _mm_loadu_si128(from + 3);
+                __m128i shifted01 = _mm_alignr_epi8(p01, prev[lane], 8);
+                __m128i shifted23 = _mm_alignr_epi8(p23, p01, 8);
+                __m128i shifted45 = _mm_alignr_epi8(p45, p23, 8);
+                __m128i shifted67 = _mm_alignr_epi8(p67, p45, 8);
+                __m128i next01 = _mm_alignr_epi8(k[1], k[0], 8);
+                __m128i next23 = _mm_alignr_epi8(k[2], k[1], 8);
+                __m128i next45 = _mm_alignr_epi8(k[3], k[2], 8);
+                __m128i next67 = _mm_alignr_epi8(k[0], k[3], 8);
+                k[0] = _mm_add_epi64(k[0], _mm_xor_si128(mul64Sse41(p01, next01), shifted01));
+                k[1] = _mm_add_epi64(k[1], _mm_xor_si128(mul64Sse41(p23, next23), shifted23));
+                k[2] = _mm_add_epi64(k[2], _mm_xor_si128(mul64Sse41(p45, next45), shifted45));
+                // key7 uses the new key0, so redo it
+                __m128i key67 = _mm_add_epi64(k[3], _mm_xor_si128(mul64Sse41(p67, next67), shifted67));
+                __m128i key0 = _mm_unpacklo_epi64(k[0], k[0]);
+                __m128i key77 = _mm_add_epi64(k[3], _mm_xor_si128(mul64Sse41(p67, key0), shifted67));
+                k[3] = _mm_blend_epi16(key67, key77, 0xf0);
+                _mm_storeu_si128(to, k[0]);
+                _mm_storeu_si128(to + 1, k[1]);
+                _mm_storeu_si128(to + 2, k[2]);
+                _mm_storeu_si128(to + 3, k[3]);
+                prev[lane] = p67;
+            }
+        }
+    }
+    for(lane = 0; lane < numLanes; lane++) {
+        for(i = 0; i < 4; i++) {
+            _mm_storeu_si128((__m128i *)(states[lane]->key + 2*i), key[lane][i]);
+        }
+    }
+    saveLastPageData(states, fromPages, pageLength, cpuWorkMultiplier, numLanes);
+}
+
+static __attribute__((target("sse4.1"))) void fillPagesSse41(LaneState *states, uint64 **fromPages,
+        uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_BY_PAGE_SIZE(FILL_IN_GROUPS, fillLanesSse41,)
+}
+
+static __attribute__((target("sse4.1"))) void fillPagesSse41Generic(LaneState *states, uint64 **fromPages,
+        uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_IN_GROUPS(fillLanesSse41, pageLength)
+}
+
+static AVX2 __m256i mul64Avx2(__m256i a, __m256i b) {
+    __m256i cross = _mm256_mullo_epi32(a, _mm256_shuffle_epi32(b, 0xb1));
+    __m256i high = _mm256_slli_epi64(_mm256_add_epi32(cross, _mm256_srli_epi64(cross, 32)), 32);
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), high);
+}
+
+// A row of 8 keys is 2 registers of 4 words.  Rotating each register by one word and
+// blending in the end word of the other gives the next key and the previous page word.
+static AVX2 void fillLanesAvx2(LaneState *states, uint64 **fromPages, uint64 **toPages,
+        uint32 pageLength, uint32 cpuWorkMultiplier, const uint32 numLanes) {
+    __m256i keyLow[8], keyHigh[8], prevRotated[8];
+    uint32 lane, i;
+    for(lane = 0; lane < numLanes; lane++) {
+        keyLow[lane] = _mm256_loadu_si256((__m256i *)states[lane]->key);
+        keyHigh[lane] = _mm256_loadu_si256((__m256i *)(states[lane]->key + 4));
+        prevRotated[lane] = _mm256_set1_epi64x(states[lane]->lastPageData);
+    }
+    while(cpuWorkMultiplier--) {
+        for(i = 0; i < pageLength; i += 8) {
+            for(lane = 0; lane < numLanes; lane++) {
+                __m256i *from = (__m256i *)(fromPages[lane] + i);
+                __m256i *to = (__m256i *)(toPages[lane] + i);
+                __m256i pLow = _mm256_loadu_si256(from);
+                __m256i pHigh = _mm256_loadu_si256(from + 1);
+                // [p3 p0 p1 p2] and [p7 p4 p5 p6]
+                __m256i rotatedLow = _mm256_permute4x64_epi64(pLow, _MM_SHUFFLE(2, 1, 0, 3));
+                __m256i rotatedHigh = _mm256_permute4x64_epi64(pHigh, _MM_SHUFFLE(2, 1, 0, 3));
+                __m256i shiftedLow = _mm256_blend_epi32(rotatedLow, prevRotated[lane], 0x03);
+                __m256i shiftedHigh = _mm256_blend_epi32(rotatedHigh, rotatedLow, 0x03);
+                // [k1 k2 k3 k0] and [k5 k6 k7 k4]
+                __m256i kLow = _mm256_permute4x64_epi64(keyLow[lane], _MM_SHUFFLE(0, 3, 2, 1));
+                __m256i kHigh = _mm256_permute4x64_epi64(keyHigh[lane], _MM_SHUFFLE(0, 3, 2, 1));
+                __m256i nextLow = _mm256_blend_epi32(kLow, kHigh, 0xc0);
+                __m256i nextHigh = _mm256_blend_epi32(kHigh, kLow, 0xc0);
+                keyLow[lane] = _mm256_add_epi64(keyLow[lane],
+                    _mm256_xor_si256(mul64Avx2(pLow, nextLow), shiftedLow));
+                // key7 uses the new key0, so redo it
+                __m256i key0 = _mm256_permute4x64_epi64(keyLow[lane], 0);
+                __m256i high = _mm256_add_epi64(keyHigh[lane],
+                    _mm256_xor_si256(mul64Avx2(pHigh, nextHigh), shiftedHigh));
+                __m256i high7 = _mm256_add_epi64(keyHigh[lane],
+                    _mm256_xor_si256(mul64Avx2(pHigh, key0), shiftedHigh));
+                keyHigh[lane] = _mm256_blend_epi32(high, high7, 0xc0);
+                _mm256_storeu_si256(to, keyLow[lane]);
+                _mm256_storeu_si256(to + 1, keyHigh[lane]);
+                prevRotated[lane] = rotatedHigh;
+            }
+        }
+    }
+    for(lane = 0; lane < numLanes; lane++) {
+        _mm256_storeu_si256((__m256i *)states[lane]->key, keyLow[lane]);
+        _mm256_storeu_si256((__m256i *)(states[lane]->key + 4), keyHigh[lane]);
+    }
+    saveLastPageData(states, fromPages, pageLength, cpuWorkMultiplier, numLanes);
+}
+
+static __attribute__((target("avx2"))) void fillPagesAvx2(LaneState *states, uint64 **fromPages,
+        uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_BY_PAGE_SIZE(FILL_IN_GROUPS, fillLanesAvx2,)
+}
+
+static __attribute__((target("avx2"))) void fillPagesAvx2Generic(LaneState *states, uint64 **fromPages,
+        uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_IN_GROUPS(fillLanesAvx2, pageLength)
+}
+
+// A row of 8 keys is one register.  AVX-512DQ has a real 64-bit multiply, and valignq and
+// vpermq give the previous page words and next keys directly.
+static AVX512 void fillLanesAvx512(LaneState *states, uint64 **fromPages, uint64 **toPages,
+        uint32 pageLength, uint32 cpuWorkMultiplier, const uint32 numLanes) {
+    __m512i key[8], prev[8];
+    __m512i nextIndex = _mm512_set_epi64(0, 7, 6, 5, 4, 3, 2, 1);
+    uint32 lane, i;
+    for(lane = 0; lane < numLanes; lane++) {
+        key[lane] = _mm512_loadu_si512(states[lane]->key);
+        prev[lane] = _mm512_set1_epi64(states[lane]->lastPageData);
+    }
+    while(cpuWorkMultiplier--) {
+        for(i = 0; i < pageLength; i += 8) {
+            for(lane = 0; lane < numLanes; lane++) {
+                __m512i pageData = _mm512_loadu_si512(fromPages[lane] + i);
+                __m512i shifted = _mm512_alignr_epi64(pageData, prev[lane], 7);
+                __m512i next = _mm512_permutexvar_epi64(nextIndex, key[lane]);
+                __m512i k = key[lane];
+                k = _mm512_mask_add_epi64(k, 0x7f, k,
+                    _mm512_xor_si512(_mm512_mullo_epi64(pageData, next), shifted));
+                // key7 uses the new key0, so redo it
+                __m512i key0 = _mm512_broadcastq_epi64(_mm512_castsi512_si128(k));
+                k = _mm512_mask_add_epi64(k, 0x80, k,
+                    _mm512_xor_si512(_mm512_mullo_epi64(pageData, key0), shifted));
+                _mm512_storeu_si512(toPages[lane] + i, k);
+                key[lane] = k;
+                prev[lane] = pageData;
+            }
+        }
+    }
+    for(lane = 0; lane < numLanes; lane++) {
+        _mm512_storeu_si512(states[lane]->key, key[lane]);
+    }
+    saveLastPageData(states, fromPages, pageLength, cpuWorkMultiplier, numLanes);
+}
+
+static __attribute__((target("avx512f,avx512dq"))) void fillPagesAvx512(LaneState *states, uint64 **fromPages,
+        uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_BY_PAGE_SIZE(FILL_IN_GROUPS, fillLanesAvx512,)
+}
+
+static __attribute__((target("avx512f,avx512dq"))) void fillPagesAvx512Generic(LaneState *states,
+        uint64 **fromPages, uint64 **toPages, uint32 numLanes, uint32 pageLength, uint32 cpuWorkMultiplier) {
+    FILL_IN_GROUPS(fillLanesAvx512, pageLength)
+}
+
+static bool scalarIsSupported(void) {
+    return true;
+}
+
+static bool sse41IsSupported(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static bool avx2IsSupported(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool avx512IsSupported(void) {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+}
+
+// The first supported kernel is the default.  AVX-512 has a 64-bit multiply, and filling 8
+// lanes at once keeps more page reads in flight.  AVX2 builds its multiply out of 32-bit ones,
+// which since the scalar loop was specialized by page size makes it slower than scalar, as
+// emulating the multiply makes SSE4.1.  So the kernels after scalar are only used when asked
+// for.
+struct fillKernelStruct keystretchFillKernels[] = {
+    {"avx512", 8, avx512IsSupported, fillPagesAvx512, fillPagesAvx512Generic},
+    {"scalar", 1, scalarIsSupported, fillPagesScalar, fillPagesScalarGeneric},
+    {"avx2", 4, avx2IsSupported, fillPagesAvx2, fillPagesAvx2Generic},
+    {"sse4.1", 2, sse41IsSupported, fillPagesSse41, fillPagesSse41Generic},
+};
+uint32 keystretchFillKernelCount = sizeof(keystretchFillKernels)/sizeof(struct fillKernelStruct);
+
+// Return the kernel with the given name, or NULL if it does not exist or this CPU cannot run it.
+FillKernel keystretchFillKernelFind(char *name) {
+    uint32 i;
+    for(i = 0; i < keystretchFillKernelCount; i++) {
+        if(!strcmp(keystretchFillKernels[i].name, name)) {
+            return keystretchFillKernels[i].isSupported()? keystretchFillKernels + i : NULL;
+        }
+    }
+    return NULL;
+}
+
+// Return the kernel to use on this CPU.
+FillKernel keystretchFillKernelSelect(void) {
+    static FillKernel selected = NULL;
+    FillKernel kernel = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if(kernel != NULL) {
+        return kernel;
+    }
+    char *name = getenv("KEYSTRETCH_KERNEL");
+    if(name != NULL) {
+        kernel = keystretchFillKernelFind(name);
+        if(kernel == NULL) {
+            keystretchLogMessage(KEYSTRETCH_LOG_WARNING, "Kernel %s is not available, so using the default", name);
+        }
+    }
+    uint32 i;
+    for(i = 0; kernel == NULL; i++) {
+        if(keystretchFillKernels[i].isSupported()) {
+            kernel = keystretchFillKernels + i;
+        }
+    }
+    __atomic_store_n(&selected, kernel, __ATOMIC_RELEASE);
+    return kernel;
+}
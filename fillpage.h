@@ -0,0 +1,45 @@
+// Page filling kernels.  A lane is an independent hash chain, and a kernel fills one page for
+// each of several lanes at once, interleaving them so the multipliers stay busy.  Every kernel
+// computes exactly what the scalar loop in keystretch-ref.c does, one lane at a time.
+
+#ifndef FILLPAGE_H
+#define FILLPAGE_H
+
+#include "keystretch.h"
+
+// The chaining state of one lane.
+struct laneStateStruct {
+    uint64 key[8];
+    uint64 lastPageData;
+};
+
+typedef struct laneStateStruct *LaneState;
+
+// Fill toPages[i] from fromPages[i] with states[i], for i from 0 to numLanes-1.  The pages must
+// not overlap.
+typedef void (*FillPagesFunc)(LaneState *states, uint64 **fromPages, uint64 **toPages, uint32 numLanes,
+    uint32 pageLength, uint32 cpuWorkMultiplier);
+
+typedef struct fillKernelStruct *FillKernel;
+
+struct fillKernelStruct {
+    char *name;
+    uint32 width; // The number of lanes this kernel prefers to fill at once
+    bool (*isSupported)(void);
+    FillPagesFunc fillPages;        // Compiled for common page sizes, with fillPagesGeneric otherwise
+    FillPagesFunc fillPagesGeneric; // The loop for any page size, for checking and benchmarking
+};
+
+// Return the kernel to use on this CPU.  The KEYSTRETCH_KERNEL environment variable can name a
+// kernel to use instead, for testing and benchmarking.
+FillKernel keystretchFillKernelSelect(void);
+
+// Return the kernel with the given name, or NULL if it does not exist or this CPU cannot run it.
+FillKernel keystretchFillKernelFind(char *name);
+
+// The known kernels, the default first, then the ones only used when asked for.  Not all are
+// supported on every CPU.
+extern struct fillKernelStruct keystretchFillKernels[];
+extern uint32 keystretchFillKernelCount;
+
+#endif
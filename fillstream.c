@@ -0,0 +1,227 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// fillstream writes the words keystretch fills memory with to stdout, in binary, as fast as it
+// can fill them, so statistical test suites can read them from a pipe:
+//
+//     ./fillstream | dieharder -a -g 200
+//     ./fillstream | RNG_test stdin64
+//
+// It hashes the same way keystretchHash does, with one thread, for password after password,
+// each a 64-bit counter starting at the seed, and writes each page as it is filled, every
+// pass of it when the CPU work multiplier is more than 1.  Page 0 comes from PBKDF2 rather than
+// the fill, so it is left out.  The kernel is the one keystretch would pick, so set
+// KEYSTRETCH_KERNEL to test another.  -c checks the fill against keystretchHash instead of
+// writing the stream.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "fillpage.h"
+#include "sha256.h"
+
+#define MIN_PAGE_SIZE 1024 // keystretchHash needs 8 words per lane
+#define KEY_SIZE 64
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+static const uint8 salt[] = "fillstream salt";
+
+typedef struct streamStruct *Stream;
+
+// The parameters of the hashes, and where we are in the stream.
+struct streamStruct {
+    uint64 *mem;
+    uint32 pageLength;
+    uint32 numPages;
+    uint32 cpuWorkMultiplier;
+    uint32 sha256Rounds;
+    int lane;          // Only write this lane's pages, or all of them if -1
+    uint64 bytesLeft;  // Stop after writing this many bytes
+    FillKernel kernel;
+    struct laneStateStruct states[MAX_THREADS];
+};
+
+// Write the pages, unless we only want another lane's.  Returns false when we have written
+// all we were asked for, or stdout is closed.
+static bool writePages(Stream s, uint64 **toPages, uint32 *toPageNums, uint32 numPages) {
+    uint64 pageSize = s->pageLength*sizeof(uint64);
+    uint32 i;
+    for(i = 0; i < numPages; i++) {
+        if(s->lane >= 0 && (toPageNums[i] & (MAX_THREADS - 1)) != (uint32)s->lane) {
+            continue;
+        }
+        uint64 size = pageSize < s->bytesLeft? pageSize : s->bytesLeft;
+        if(fwrite(toPages[i], 1, size, stdout) != size) {
+            return false;
+        }
+        s->bytesLeft -= size;
+        if(s->bytesLeft == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fill a group of pages, one pass at a time, writing each pass if write is set.
+static bool fillGroup(Stream s, LaneState *states, uint64 **fromPages, uint64 **toPages, uint32 *toPageNums,
+        uint32 numPages, bool write) {
+    uint32 pass;
+    for(pass = 0; pass < s->cpuWorkMultiplier; pass++) {
+        s->kernel->fillPages(states, fromPages, toPages, numPages, s->pageLength, 1);
+        if(write && !writePages(s, toPages, toPageNums, numPages)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Hash the password as keystretchHash does, and write the key to key.  If write is set, write
+// the pages as we fill them.  Returns false when we should stop.
+static bool hashPassword(Stream s, const uint8 *password, uint32 passwordSize, uint8 *key, bool write) {
+    LaneState states[MAX_THREADS];
+    uint64 *fromPages[MAX_THREADS], *toPages[MAX_THREADS];
+    uint32 toPageNums[MAX_THREADS];
+    uint32 pageLength = s->pageLength;
+    uint32 firstPageNum, lane, numGrouped = 0;
+    uint64 *mem = s->mem;
+    PBKDF2_SHA256(password, passwordSize, salt, sizeof(salt), s->sha256Rounds, key, KEY_SIZE);
+    PBKDF2_SHA256(key, KEY_SIZE, salt, sizeof(salt), 1, (uint8 *)(void *)mem, pageLength*sizeof(uint64));
+    for(lane = 0; lane < MAX_THREADS; lane++) {
+        PBKDF2_SHA256((uint8 *)(void *)(mem + lane*8), 8*sizeof(uint64), salt, sizeof(salt), 1,
+            (uint8 *)(void *)(s->states[lane].key), 8*sizeof(uint64));
+        s->states[lane].lastPageData = mem[0];
+    }
+
+    // Fill a round of pages at once, but if a page reads one earlier in the round, fill the
+    // pages before it first.
+    for(firstPageNum = 0; firstPageNum < s->numPages; firstPageNum += MAX_THREADS) {
+        for(lane = 0; lane < MAX_THREADS && firstPageNum + lane < s->numPages; lane++) {
+            uint32 toPageNum = firstPageNum + lane;
+            if(toPageNum == 0) {
+                continue;
+            }
+            uint32 fromPageNum = (uint32)s->states[lane].key[0] % toPageNum; // keystretch uses 32 bits
+            if(fromPageNum >= toPageNum - numGrouped) {
+                if(!fillGroup(s, states, fromPages, toPages, toPageNums, numGrouped, write)) {
+                    return false;
+                }
+                numGrouped = 0;
+            }
+            states[numGrouped] = s->states + lane;
+            fromPages[numGrouped] = mem + (uint64)fromPageNum*pageLength;
+            toPages[numGrouped] = mem + (uint64)toPageNum*pageLength;
+            toPageNums[numGrouped++] = toPageNum;
+        }
+        if(!fillGroup(s, states, fromPages, toPages, toPageNums, numGrouped, write)) {
+            return false;
+        }
+        numGrouped = 0;
+    }
+    PBKDF2_SHA256((uint8 *)(void *)(mem + (uint64)(s->numPages - MAX_THREADS)*pageLength),
+        MAX_THREADS*pageLength*sizeof(uint64), salt, sizeof(salt), 1, key, KEY_SIZE);
+    return true;
+}
+
+// Check our fill gives the key keystretchHash does, for the first password.
+static bool checkStream(Stream s, uint64 seed) {
+    uint8 expectedKey[KEY_SIZE], key[KEY_SIZE];
+    uint64 memorySize = (uint64)s->numPages*s->pageLength*sizeof(uint64);
+    uint64 password = seed;
+    KeystretchContext context = keystretchCreateContext(memorySize, 1);
+    if(context == NULL || !keystretchHash(context, s->sha256Rounds, s->cpuWorkMultiplier, memorySize,
+            s->pageLength*sizeof(uint64), 1, expectedKey, KEY_SIZE, salt, sizeof(salt), &password,
+            sizeof(password), false, false)) {
+        fprintf(stderr, "keystretchHash failed\n");
+        return false;
+    }
+    keystretchDestroyContext(context);
+    hashPassword(s, (uint8 *)&password, sizeof(password), key, false);
+    if(memcmp(key, expectedKey, KEY_SIZE)) {
+        printf("%s FAILED: the stream is not what keystretchHash fills\n", s->kernel->name);
+        return false;
+    }
+    printf("%s passed\n", s->kernel->name);
+    return true;
+}
+
+// Show the library's errors and warnings, but nothing it would write to stdout with the stream.
+static void logProblems(KeystretchLogLevel level, const char *message, void *userData) {
+    if(level != KEYSTRETCH_LOG_INFO) {
+        keystretchLogStdio(level, message, userData);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: fillstream [-m memory size in MB] [-p page size] [-w cpu work multiplier]\n"
+        "                  [-s sha256 rounds] [-l lane] [-n bytes] [-x seed] [-c]\n"
+        "Writes the words keystretch fills memory with to stdout, until -n bytes are written, or\n"
+        "stdout is closed.  -c checks the fill against keystretchHash instead.\n");
+    exit(1);
+}
+
+static uint64 readNumber(const char *text) {
+    char *end;
+    uint64 value = strtoull(text, &end, 0);
+    if(*text == '\0' || *end != '\0') {
+        usage();
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    struct streamStruct s;
+    uint64 memorySize = 64ULL << 20, pageSize = 16 << 10, seed = 0;
+    bool check = false;
+    int option;
+    keystretchSetLog(logProblems, NULL);
+    memset(&s, '\0', sizeof(s));
+    s.cpuWorkMultiplier = 1;
+    s.sha256Rounds = 1;
+    s.lane = -1;
+    s.bytesLeft = ~0ULL;
+    while((option = getopt(argc, argv, "m:p:w:s:l:n:x:c")) != -1) {
+        switch(option) {
+        case 'm': memorySize = readNumber(optarg) << 20; break;
+        case 'p': pageSize = readNumber(optarg); break;
+        case 'w': s.cpuWorkMultiplier = readNumber(optarg); break;
+        case 's': s.sha256Rounds = readNumber(optarg); break;
+        case 'l': s.lane = readNumber(optarg); break;
+        case 'n': s.bytesLeft = readNumber(optarg); break;
+        case 'x': seed = readNumber(optarg); break;
+        case 'c': check = true; break;
+        default: usage();
+        }
+    }
+    if(optind != argc || s.cpuWorkMultiplier == 0 || s.sha256Rounds == 0 || s.lane >= MAX_THREADS ||
+            s.bytesLeft == 0) {
+        usage();
+    }
+    if(pageSize < MIN_PAGE_SIZE || (pageSize & (pageSize - 1)) || memorySize/pageSize <= MAX_THREADS ||
+            memorySize/pageSize > 0xffffffffULL) {
+        fprintf(stderr, "The page size must be a power of 2, at least %u, and the memory more than %u pages\n",
+            MIN_PAGE_SIZE, MAX_THREADS);
+        return 1;
+    }
+    s.pageLength = pageSize/sizeof(uint64);
+    s.numPages = memorySize/pageSize;
+    s.kernel = keystretchFillKernelSelect();
+    if(posix_memalign((void **)&s.mem, 64, (uint64)s.numPages*pageSize) != 0) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    if(check) {
+        return checkStream(&s, seed)? 0 : 1;
+    }
+
+    // A closed pipe is how we are normally told to stop.
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    uint8 key[KEY_SIZE];
+    uint64 password;
+    for(password = seed; hashPassword(&s, (uint8 *)&password, sizeof(password), key, true); password++);
+    fflush(stdout);
+    free(s.mem);
+    return 0;
+}
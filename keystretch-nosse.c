@@ -5,118 +5,625 @@
 // Variables ending in "size" are in bytes, while variables ending in "length" are in
 // 64-bit words.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "sha256.h"
 #include "keystretch.h"
+#include "fillpage.h"
+#include "arena.h"
+#include "pool.h"
+#include "topology.h"
+#include "counters.h"
+#include "log.h"
 
 typedef struct threadContextStruct *ThreadContext;
 
+// There is one of these per lane.  Lane l owns the pages congruent to l mod MAX_THREADS, and
+// fills them in order, so pagesFilled is all a reader needs to know if a page is ready.  Lane
+// 0 starts with page 0, which is the seed page.  Each lane gets its own cache line, since
+// pagesFilled is polled by other threads.
 struct threadContextStruct {
-    uint64 key[8];
-    uint64 lastPageData;
+    struct laneStateStruct state;
     uint64 *mem;
     uint32 pageLength;
     uint32 numPages;
     uint32 cpuWorkMultiplier;
+    uint32 pagesFilled; // Only access with __atomic builtins
+} __attribute__((aligned(64)));
+
+typedef struct stopStruct *Stop;
+
+// When to stop filling memory early, for keystretchHashForTime and keystretchHashToStop, or
+// because the hash was cancelled.  A round is the MAX_THREADS pages with the same page index,
+// one per lane.  Pages only read lower pages, and never depend on how many pages there will
+// be, so the first stopRound rounds are the same as hashing stopRound*MAX_THREADS pages of
+// memory.  Workers that see a reason to stop lower stopRound, and it only ever goes down, so
+// every worker fills at least the rounds below the final value.  Cancelling sets it to 0,
+// since no key is wanted then.
+struct stopStruct {
+    uint64 deadline;  // CLOCK_MONOTONIC nanoseconds, or 0 for no deadline
+    const uint8 *tag; // Stop after the round where lane 0's page matches this tag, or NULL
+    const void *salt;
+    uint32 saltSize;
+    const uint64 *cancel; // Cancel when this reaches call, only access with __atomic builtins
+    uint64 call;
+    KeystretchProgress progress; // Told how far lane 0 has got after each round, or NULL
+    void *progressData;
+    uint32 stopRound; // Only access with __atomic builtins
+};
+
+typedef struct workerStruct *Worker;
+
+// A physical thread runs the lanes set in laneMask.
+struct workerStruct {
+    ThreadContext contexts;
+    FillKernel kernel;
+    Stop stop;
+    uint32 laneMask;
+    bool countEvents;              // Count hardware events while filling
+    bool counted;                  // True if any counter could be opened
+    uint64 counts[NUM_COUNTERS];
 };
 
-// Fill toPage, hashing with the key and fromPage as we go.
-static void fillPage(ThreadContext c, uint32 fromPageNum, uint32 toPageNum) {
-    uint32 pageLength = c->pageLength;
-    uint64 *fromPage = c->mem + fromPageNum*pageLength;
-    uint64 key0 = c->key[0];
-    uint64 key1 = c->key[1];
-    uint64 key2 = c->key[2];
-    uint64 key3 = c->key[3];
-    uint64 key4 = c->key[4];
-    uint64 key5 = c->key[5];
-    uint64 key6 = c->key[6];
-    uint64 key7 = c->key[7];
-    uint64 lastPageData =  c->lastPageData;
-    uint64 pageData0, pageData1, pageData2, pageData3;
-    uint64 pageData4, pageData5, pageData6, pageData7 = 0;
-    uint32 workMultiplier = c->cpuWorkMultiplier;
-    while(workMultiplier--) {
-        uint32 numLoops = pageLength;
-        uint64 *toPage = c->mem + toPageNum*pageLength;
-        uint32 i;
-        for(i = 0; i < numLoops; ) {
-            pageData0 = fromPage[i++];
-            pageData1 = fromPage[i++];
-            pageData2 = fromPage[i++];
-            pageData3 = fromPage[i++];
-            pageData4 = fromPage[i++];
-            pageData5 = fromPage[i++];
-            pageData6 = fromPage[i++];
-            pageData7 = fromPage[i++];
-
-            key0 += (pageData0*key1) ^ lastPageData;
-            key1 += (pageData1*key2) ^ pageData0;
-            key2 += (pageData2*key3) ^ pageData1;
-            key3 += (pageData3*key4) ^ pageData2;
-            key4 += (pageData4*key5) ^ pageData3;
-            key5 += (pageData5*key6) ^ pageData4;
-            key6 += (pageData6*key7) ^ pageData5;
-            key7 += (pageData7*key0) ^ pageData6;
-            lastPageData = pageData7;
-
-            *toPage++ = key0;
-            *toPage++ = key1;
-            *toPage++ = key2;
-            *toPage++ = key3;
-            *toPage++ = key4;
-            *toPage++ = key5;
-            *toPage++ = key6;
-            *toPage++ = key7;
-
-            /*
-            printf("%llu\n", key0);
-            printf("%llu\n", key1);
-            printf("%llu\n", key2);
-            printf("%llu\n", key3);
-            printf("%llu\n", key4);
-            printf("%llu\n", key5);
-            printf("%llu\n", key6);
-            printf("%llu\n", key7);
-            */
-        }
-    }
-    c->key[0] = key0;
-    c->key[1] = key1;
-    c->key[2] = key2;
-    c->key[3] = key3;
-    c->key[4] = key4;
-    c->key[5] = key5;
-    c->key[6] = key6;
-    c->key[7] = key7;
-    c->lastPageData = lastPageData;
-}
-
-// Hash pages randomly into the derived key.
-static void *hashMem(void *threadContextPtr) {
-    ThreadContext c = (ThreadContext)threadContextPtr;
-    uint32 fromPageNum = 0;
-    uint32 toPageNum;
-    uint32 numPages = c->numPages;
+static uint64 getNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+// Lower the stop round to round, unless it is already lower.  At least 2 rounds are always
+// filled, since the key is made from the last MAX_THREADS pages, which can't include page 0.
+static void stopAtRound(Stop stop, uint32 round) {
+    uint32 stopRound = __atomic_load_n(&stop->stopRound, __ATOMIC_ACQUIRE);
+    if(round < 2) {
+        round = 2;
+    }
+    while(round < stopRound && !__atomic_compare_exchange_n(&stop->stopRound, &stopRound, round, true,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// Stop all the workers as soon as they next check, without computing a key.
+static void cancelStop(Stop stop) {
+    __atomic_store_n(&stop->stopRound, 0, __ATOMIC_RELEASE);
+}
+
+// Return true if round is past the stop round.
+static inline bool stopped(Stop stop, uint32 round) {
+    return round >= __atomic_load_n(&stop->stopRound, __ATOMIC_ACQUIRE);
+}
+
+// Compute the stop tag of a page: a hash of its first 64 bytes with the salt.
+static void computeStopTag(Stop stop, uint64 *page, uint8 *tag) {
+    PBKDF2_SHA256((uint8 *)(void *)page, 8*sizeof(uint64), stop->salt, stop->saltSize, 1, tag,
+        KEYSTRETCH_STOP_TAG_SIZE);
+}
+
+// Spin until the lane owning pageNum has written it.  After a while, yield the CPU, in case
+// we have more threads than cores.  If the worker's round gets stopped while we wait, the page
+// may never be written, so return false.
+static inline bool waitForPage(ThreadContext contexts, uint32 pageNum, Stop stop, uint32 round) {
+    ThreadContext owner = contexts + (pageNum & THREAD_MASK);
+    uint32 pageIndex = pageNum/MAX_THREADS;
+    uint32 spins = 0;
+    while(__atomic_load_n(&owner->pagesFilled, __ATOMIC_ACQUIRE) <= pageIndex) {
+        if(stopped(stop, round)) {
+            return false;
+        }
+        if(++spins < 1024) {
+            __builtin_ia32_pause();
+        } else {
+            sched_yield();
+        }
+    }
+    return true;
+}
+
+// Return true if the lane owning pageNum has written it.
+static inline bool pageIsReady(ThreadContext contexts, uint32 pageNum) {
+    ThreadContext owner = contexts + (pageNum & THREAD_MASK);
+    return __atomic_load_n(&owner->pagesFilled, __ATOMIC_ACQUIRE) > pageNum/MAX_THREADS;
+}
+
+typedef struct pageGroupStruct *PageGroup;
+
+// Pages a worker has picked to fill together with its kernel.
+struct pageGroupStruct {
+    LaneState states[MAX_THREADS];
+    uint64 *fromPages[MAX_THREADS];
+    uint64 *toPages[MAX_THREADS];
+    ThreadContext contexts[MAX_THREADS];
+    uint32 toPageNums[MAX_THREADS];
+    uint32 numPages;
+};
+
+// Fill the pages in the group, and let the other threads know they are ready.
+static void fillPageGroup(Worker w, PageGroup g) {
+    ThreadContext c = w->contexts;
+    uint32 i;
+    if(g->numPages == 0) {
+        return;
+    }
+    w->kernel->fillPages(g->states, g->fromPages, g->toPages, g->numPages, c->pageLength, c->cpuWorkMultiplier);
+    for(i = 0; i < g->numPages; i++) {
+        __atomic_store_n(&g->contexts[i]->pagesFilled, g->toPageNums[i]/MAX_THREADS + 1, __ATOMIC_RELEASE);
+    }
+    g->numPages = 0;
+}
+
+// Hash pages randomly into the derived key.  Pages are filled in increasing order by every
+// worker, and a page only reads from lower pages, so the lowest unfilled page can always make
+// progress, and the result does not depend on how lanes are assigned to threads.  Each round
+// of MAX_THREADS pages, the worker's lanes are filled together by the kernel, unless a lane
+// reads a page that is not ready yet.  Then we fill the pages we have so far first, since the
+// page we need may depend on them.  Before each round, the worker checks if the hash was
+// cancelled, and when stopping early, the deadline.  After each round, the worker with lane 0
+// reports progress, and checks its page against the stop tag.
+static void hashMem(Worker w) {
+    ThreadContext contexts = w->contexts;
+    ThreadContext c;
+    Stop stop = w->stop;
+    struct pageGroupStruct group;
+    uint32 fromPageNum, toPageNum, firstPageNum, lane, round;
+    uint32 numPages = contexts->numPages;
+    uint32 pageLength = contexts->pageLength;
+    uint64 *mem = contexts->mem;
     uint32 hash;
-    for(toPageNum = 1; toPageNum < numPages; toPageNum++) {
-        hash = c->key[0];
-        fromPageNum = hash % toPageNum;
-        fillPage(c, fromPageNum, toPageNum);
+    uint8 tag[KEYSTRETCH_STOP_TAG_SIZE];
+    group.numPages = 0;
+    for(firstPageNum = 0; firstPageNum < numPages; firstPageNum += MAX_THREADS) {
+        round = firstPageNum/MAX_THREADS;
+        if(__atomic_load_n(stop->cancel, __ATOMIC_RELAXED) >= stop->call) {
+            cancelStop(stop);
+        }
+        if(stop->deadline != 0 && getNanoseconds() >= stop->deadline) {
+            stopAtRound(stop, round);
+        }
+        if(stopped(stop, round)) {
+            return;
+        }
+        for(lane = 0; lane < MAX_THREADS; lane++) {
+            toPageNum = firstPageNum + lane;
+            if(!(w->laneMask & (1 << lane)) || toPageNum == 0) {
+                continue;
+            }
+            if(toPageNum >= numPages) {
+                break;
+            }
+            c = contexts + lane;
+            hash = c->state.key[0];
+            fromPageNum = hash % toPageNum;
+            if(!pageIsReady(contexts, fromPageNum)) {
+                fillPageGroup(w, &group);
+                if(!waitForPage(contexts, fromPageNum, stop, round)) {
+                    return;
+                }
+            }
+            group.states[group.numPages] = &c->state;
+            group.fromPages[group.numPages] = mem + (uint64)fromPageNum*pageLength;
+            group.toPages[group.numPages] = mem + (uint64)toPageNum*pageLength;
+            group.contexts[group.numPages] = c;
+            group.toPageNums[group.numPages] = toPageNum;
+            group.numPages++;
+        }
+        fillPageGroup(w, &group);
+        if(stop->progress != NULL && (w->laneMask & 1) && !stop->progress(firstPageNum + MAX_THREADS < numPages?
+                firstPageNum + MAX_THREADS : numPages, numPages, stop->progressData)) {
+            cancelStop(stop);
+        }
+        if(stop->tag != NULL && (w->laneMask & 1) && round != 0) {
+            computeStopTag(stop, mem + (uint64)firstPageNum*pageLength, tag);
+            if(!memcmp(tag, stop->tag, KEYSTRETCH_STOP_TAG_SIZE)) {
+                stopAtRound(stop, round + 1);
+            }
+        }
+    }
+}
+
+// Pool job to run worker index of the workers array, counting hardware events if asked.
+static void hashMemJob(void *workers, uint32 index) {
+    Worker w = (Worker)workers + index;
+    struct countersStruct counters;
+    w->counted = w->countEvents && keystretchCountersStart(&counters);
+    hashMem(w);
+    if(w->counted) {
+        keystretchCountersStop(&counters, w->counts);
+    }
+}
+
+typedef struct wipeStruct *Wipe;
+
+// Memory to wipe, split evenly over numJobs threads.
+struct wipeStruct {
+    Arena arena;
+    uint64 size;
+    uint32 numJobs;
+};
+
+// A context holds everything keystretchHash needs between calls, so the arena stays mapped and
+// faulted in, rather than being allocated and page faulted again on every call.
+struct keystretchContextStruct {
+    struct threadContextStruct contexts[MAX_THREADS];
+    struct workerStruct workers[MAX_THREADS];
+    struct arenaStruct arena;
+    struct poolStruct pool;
+    uint64 maxMemorySize;
+    uint32 maxThreads;
+    bool prefaulted;      // False until the arena has been faulted in
+    bool backgroundWipe;  // Wipe memory on the workers after returning the key
+    struct wipeStruct wipe;
+    uint64 callsStarted;  // Calls made on the context so far, only access with __atomic builtins
+    uint64 cancel;        // Calls up to this one are cancelled, only access with __atomic builtins
+    KeystretchProgress progress;
+    void *progressData;
+    KeystretchStats *stats; // Filled in by each call, if not NULL
+    bool countEvents;       // Have the fill workers count hardware events for stats
+    pthread_mutex_t lock; // Held while hashing, so a context can be shared between threads
+};
+
+static void prefaultArena(KeystretchContext context);
+
+// Create a context for hashing up to maxMemorySize bytes with up to maxThreads threads, placed
+// as asked.  If cpus is not NULL, the caller has picked the CPUs for the context's threads, so
+// we neither place nor report on it.  If prefault is false, the arena is faulted in by
+// the first keystretchHash call, while it does the initial stretch.  Returns NULL if we run out
+// of memory.
+static KeystretchContext createContext(uint64 maxMemorySize, uint32 maxThreads,
+        KeystretchPlacement placement, const uint32 *cpus, bool prefault) {
+    KeystretchContext context;
+    struct topologyStruct topology;
+    if(maxThreads == 0 || maxThreads > MAX_THREADS) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid number of threads");
+        return NULL;
+    }
+    if(posix_memalign((void **)&context, CACHE_LINE_SIZE, sizeof(struct keystretchContextStruct)) != 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate context");
+        return NULL;
+    }
+    memset(context, '\0', sizeof(struct keystretchContextStruct));
+    if(!keystretchArenaAllocate(&context->arena, maxMemorySize)) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate memory");
+        free(context);
+        return NULL;
+    }
+    if(cpus == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_INFO, "memory:%s", keystretchArenaBackingName(context->arena.backing));
+    }
+    bool placed = false;
+    if(cpus == NULL && placement == KEYSTRETCH_PLACEMENT_TOPOLOGY) {
+        placed = keystretchTopologyPlan(&topology, maxThreads);
+        if(!placed) {
+            keystretchLogMessage(KEYSTRETCH_LOG_WARNING, "Unable to read CPU topology, using simple placement");
+        } else {
+            if(!keystretchTopologyPlaceMemory(&topology, context->arena.mem, context->arena.mappedSize)) {
+                keystretchLogMessage(KEYSTRETCH_LOG_WARNING, "Unable to set NUMA memory policy");
+            }
+            keystretchTopologyReport(&topology);
+        }
+    }
+    context->maxMemorySize = maxMemorySize;
+    context->maxThreads = maxThreads;
+    keystretchPoolStart(&context->pool, maxThreads, cpus != NULL? cpus : placed? topology.cpus : NULL);
+    pthread_mutex_init(&context->lock, NULL);
+    if(prefault) {
+        prefaultArena(context);
+    }
+    return context;
+}
+
+// Create a context for hashing up to maxMemorySize bytes with up to maxThreads threads, placed
+// as asked.  The arena is allocated and faulted in here.  Returns NULL if we run out of memory.
+KeystretchContext keystretchCreatePlacedContext(uint64 maxMemorySize, uint32 maxThreads,
+        KeystretchPlacement placement) {
+    return createContext(maxMemorySize, maxThreads, placement, NULL, true);
+}
+
+// Return the placement KEYSTRETCH_PLACEMENT in the environment asks for.
+static KeystretchPlacement placementFromEnvironment(void) {
+    char *placement = getenv("KEYSTRETCH_PLACEMENT");
+    if(placement != NULL && !strcmp(placement, "topology")) {
+        return KEYSTRETCH_PLACEMENT_TOPOLOGY;
+    }
+    return KEYSTRETCH_PLACEMENT_SIMPLE;
+}
+
+// Return the version of the library, which may be newer than the header the caller used.
+const char *keystretchVersion(void) {
+    return KEYSTRETCH_VERSION;
+}
+
+// Create a context with the placement KEYSTRETCH_PLACEMENT in the environment asks for.
+KeystretchContext keystretchCreateContext(uint64 maxMemorySize, uint32 maxThreads) {
+    return keystretchCreatePlacedContext(maxMemorySize, maxThreads, placementFromEnvironment());
+}
+
+// Free the context and its arena, after any background wipe finishes.
+void keystretchDestroyContext(KeystretchContext context) {
+    if(context == NULL) {
+        return;
+    }
+    keystretchPoolStop(&context->pool);
+    keystretchArenaFree(&context->arena);
+    pthread_mutex_destroy(&context->lock);
+    memset(context, '\0', sizeof(struct keystretchContextStruct));
+    free(context);
+}
+
+// Fill memory with the lanes spread over numThreads of the pool's threads.  Returns the number of
+// workers used.
+static uint32 fillMemory(KeystretchContext context, uint32 numThreads, Stop stop) {
+    ThreadContext contexts = context->contexts;
+    Worker workers = context->workers;
+    uint32 lane, t;
+    FillKernel kernel = keystretchFillKernelSelect();
+    if(numThreads > context->pool.numThreads) {
+        numThreads = context->pool.numThreads;
+    }
+    for(t = 0; t < numThreads; t++) {
+        workers[t].contexts = contexts;
+        workers[t].kernel = kernel;
+        workers[t].stop = stop;
+        workers[t].laneMask = 0;
+        workers[t].countEvents = context->stats != NULL && context->countEvents;
+    }
+    for(lane = 0; lane < MAX_THREADS; lane++) {
+        workers[lane % numThreads].laneMask |= 1 << lane;
+    }
+    keystretchPoolRun(&context->pool, hashMemJob, workers, numThreads);
+    return numThreads;
+}
+
+// Below this many SHA-256 rounds of PBKDF2 work per thread, starting a thread costs more than
+// it saves.
+#define MIN_PARALLEL_PBKDF2_ROUNDS 1024
+
+typedef struct pbkdf2JobStruct *Pbkdf2Job;
+
+// A range of PBKDF2 output blocks for one thread to compute.
+struct pbkdf2JobStruct {
+    const void *password;
+    uint32 passwordSize;
+    const void *salt;
+    uint32 saltSize;
+    uint64 rounds;
+    uint8 *derivedKey;
+    uint32 derivedKeySize;
+    uint32 firstBlock;
+    uint32 numBlocks;
+};
+
+// Pool job to compute the blocks of job index of the jobs array.
+static void pbkdf2Job(void *jobs, uint32 index) {
+    Pbkdf2Job job = (Pbkdf2Job)jobs + index;
+    PBKDF2_SHA256_Blocks(job->password, job->passwordSize, job->salt, job->saltSize, job->rounds,
+        job->derivedKey, job->derivedKeySize, job->firstBlock, job->numBlocks);
+}
+
+// Split the 32 byte output blocks of PBKDF2_SHA256 over up to numThreads of the pool's threads,
+// and return how many jobs that makes.  Every block runs all the rounds on its own, so a long
+// derived key or seed page takes about as long as the share of blocks each thread gets.
+static uint32 splitPbkdf2(KeystretchContext context, uint32 numThreads, Pbkdf2Job jobs,
+        const void *password, uint32 passwordSize, const void *salt, uint32 saltSize, uint64 rounds,
+        void *derivedKey, uint32 derivedKeySize) {
+    uint32 numBlocks = (derivedKeySize + 31)/32;
+    uint64 maxThreads = numBlocks*rounds/MIN_PARALLEL_PBKDF2_ROUNDS;
+    uint32 t, firstBlock = 0;
+    if(numThreads > context->pool.numThreads) {
+        numThreads = context->pool.numThreads;
+    }
+    if(numThreads > numBlocks) {
+        numThreads = numBlocks;
+    }
+    if(numThreads > maxThreads) {
+        numThreads = maxThreads == 0? 1 : maxThreads;
+    }
+    for(t = 0; t < numThreads; t++) {
+        jobs[t].password = password;
+        jobs[t].passwordSize = passwordSize;
+        jobs[t].salt = salt;
+        jobs[t].saltSize = saltSize;
+        jobs[t].rounds = rounds;
+        jobs[t].derivedKey = derivedKey;
+        jobs[t].derivedKeySize = derivedKeySize;
+        jobs[t].firstBlock = firstBlock;
+        jobs[t].numBlocks = numBlocks/numThreads + (t < numBlocks % numThreads? 1 : 0);
+        firstBlock += jobs[t].numBlocks;
+    }
+    return numThreads;
+}
+
+// Compute PBKDF2_SHA256 with its output blocks split over up to numThreads of the pool's threads.
+static void parallelPbkdf2(KeystretchContext context, uint32 numThreads, const void *password,
+        uint32 passwordSize, const void *salt, uint32 saltSize, uint64 rounds, void *derivedKey,
+        uint32 derivedKeySize) {
+    struct pbkdf2JobStruct jobs[MAX_THREADS];
+    numThreads = splitPbkdf2(context, numThreads, jobs, password, passwordSize, salt, saltSize, rounds,
+        derivedKey, derivedKeySize);
+    keystretchPoolRun(&context->pool, pbkdf2Job, jobs, numThreads);
+}
+
+// Threads fault in the arena in chunks this big, taking the next one as they finish.
+#define PREFAULT_CHUNK_SIZE (2 << 20)
+
+typedef struct setupStruct *Setup;
+
+// The first stage of a hash: the initial stretch, and, on a context's first call, faulting in
+// the arena.  Every pool thread takes part.  Threads with PBKDF2 blocks compute them first, and
+// the rest start on the arena right away, so the page faults are hidden behind the stretch.
+struct setupStruct {
+    struct pbkdf2JobStruct jobs[MAX_THREADS];
+    uint32 numPbkdf2Jobs;
+    Arena arena;     // NULL if the arena is already faulted in
+    uint64 nextChunk; // Only access with __atomic builtins
+    uint64 faultTime; // The longest any thread spent faulting, only access with __atomic builtins
+};
+
+static void setupJob(void *setupPtr, uint32 index) {
+    Setup setup = (Setup)setupPtr;
+    Arena arena = setup->arena;
+    uint64 start;
+    if(index < setup->numPbkdf2Jobs) {
+        pbkdf2Job(setup->jobs, index);
+    }
+    if(arena != NULL) {
+        uint64 faultStart = getNanoseconds();
+        while((start = __atomic_fetch_add(&setup->nextChunk, PREFAULT_CHUNK_SIZE, __ATOMIC_RELAXED)) <
+                arena->mappedSize) {
+            keystretchArenaPrefault(arena, start, start + PREFAULT_CHUNK_SIZE);
+        }
+        uint64 faultTime = getNanoseconds() - faultStart;
+        uint64 longest = __atomic_load_n(&setup->faultTime, __ATOMIC_RELAXED);
+        while(faultTime > longest && !__atomic_compare_exchange_n(&setup->faultTime, &longest, faultTime, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+}
+
+// Run the setup with as many pool threads as it can use.
+static void runSetup(KeystretchContext context, Setup setup) {
+    uint32 numThreads = setup->numPbkdf2Jobs;
+    setup->nextChunk = 0;
+    setup->faultTime = 0;
+    if(setup->arena != NULL) {
+        numThreads = context->pool.numThreads;
+    }
+    if(numThreads == 0) {
+        return;
+    }
+    keystretchPoolRun(&context->pool, setupJob, setup, numThreads);
+    context->prefaulted = true;
+}
+
+// Fault in the arena on all the pool's threads.
+static void prefaultArena(KeystretchContext context) {
+    struct setupStruct setup;
+    setup.numPbkdf2Jobs = 0;
+    setup.arena = &context->arena;
+    runSetup(context, &setup);
+}
+
+// Pool job to wipe share index of the memory.  Shares are whole 4KB pages, so threads never
+// write to the same page.
+static void wipeJob(void *wipePtr, uint32 index) {
+    Wipe wipe = (Wipe)wipePtr;
+    uint64 share = ((wipe->size/wipe->numJobs + 4095)/4096)*4096;
+    uint64 start = index*share;
+    uint64 end = start + share;
+    if(end > wipe->size) {
+        end = wipe->size;
+    }
+    if(start < end) {
+        keystretchArenaWipe(wipe->arena, start, end);
+    }
+}
+
+// Set the first size bytes of the arena to 0's on the pool's threads.  With backgroundWipe
+// set, only the workers do it, and we return right away.  Before the pool runs anything else,
+// keystretchHash waits for it to finish.
+static void wipeMemory(KeystretchContext context, uint64 size) {
+    Wipe wipe = &context->wipe;
+    wipe->arena = &context->arena;
+    wipe->size = size;
+    if(context->backgroundWipe && context->pool.numThreads > 1) {
+        wipe->numJobs = context->pool.numThreads - 1;
+        keystretchPoolRunInBackground(&context->pool, wipeJob, wipe, wipe->numJobs);
+    } else {
+        wipe->numJobs = context->pool.numThreads;
+        keystretchPoolRun(&context->pool, wipeJob, wipe, wipe->numJobs);
+    }
+}
+
+// Wipe in the background from now on.  A one-thread context has no workers of its own to wipe
+// on, so it gets a helper thread that only wipes, since the fill and the stretch never use
+// more than the call's threads.
+static void setBackgroundWipe(KeystretchContext context) {
+    context->backgroundWipe = true;
+    if(context->pool.numThreads == 1) {
+        keystretchPoolWait(&context->pool);
+        keystretchPoolAddWorker(&context->pool, -1);
     }
-    pthread_exit(NULL);
+}
+
+// With background set, clearMemory wipes the memory on the context's worker threads after
+// keystretchHash returns the key.  The next call waits for the wipe to finish first.
+void keystretchSetBackgroundWipe(KeystretchContext context, bool background) {
+    pthread_mutex_lock(&context->lock);
+    if(background) {
+        setBackgroundWipe(context);
+    } else {
+        context->backgroundWipe = false;
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+// Have progress called on the hashing thread after each round of pages, with how many of the
+// pages lane 0 has filled, and how many there are.  If it returns false, the hash is
+// cancelled.  Pass NULL to stop reporting.
+void keystretchSetProgress(KeystretchContext context, KeystretchProgress progress, void *userData) {
+    pthread_mutex_lock(&context->lock);
+    context->progress = progress;
+    context->progressData = userData;
+    pthread_mutex_unlock(&context->lock);
+}
+
+// Have each call on the context fill in stats, and with counters set, count hardware events on
+// the fill workers.  Pass NULL to stop.
+void keystretchSetStats(KeystretchContext context, KeystretchStats *stats, bool counters) {
+    pthread_mutex_lock(&context->lock);
+    context->stats = stats;
+    context->countEvents = counters;
+    pthread_mutex_unlock(&context->lock);
+}
+
+// Cancel the hash running on the context, and any waiting for it, but not ones called later.
+// This may be called from any thread, and does not wait: the workers stop before their next
+// round of pages, and the hash returns false.
+void keystretchCancelHash(KeystretchContext context) {
+    uint64 call = __atomic_load_n(&context->callsStarted, __ATOMIC_RELAXED);
+    uint64 cancel = __atomic_load_n(&context->cancel, __ATOMIC_RELAXED);
+    while(cancel < call && !__atomic_compare_exchange_n(&context->cancel, &cancel, call, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Return true if the context's memory is still being wiped in the background.
+bool keystretchWipePending(KeystretchContext context) {
+    return keystretchPoolBusy(&context->pool);
+}
+
+// Wait for a background wipe of the context's memory to finish.
+void keystretchWaitForWipe(KeystretchContext context) {
+    pthread_mutex_lock(&context->lock);
+    keystretchPoolWait(&context->pool);
+    pthread_mutex_unlock(&context->lock);
+}
+
+static bool hashWithStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, bool stretched, Stop stop, KeystretchStop *result);
+
+// Log the parameters of a single hash.  Batches don't, since there are so many.
+static void logParameters(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads) {
+    keystretchLogMessage(KEYSTRETCH_LOG_INFO,
+        "sha256HashRounds:%u cpuWorkMultiplier:%u memorySize:%llu pageSize:%u numThreads:%u", sha256HashRounds,
+        cpuWorkMultiplier, memorySize, pageSize, numThreads);
 }
 
 /* This is the main key derivation function.  Parameters are:
+    context              - Context from keystretchCreateContext, which holds the memory
     sha256HashRounds     - Parameter for increasing initial key stretching beyond 4096 SHA-256 rounds
     cpuWorkMultiplier    - How many times to repeat hashing the entire memory.  Most often, this should be 1
-    memorySize           - Memory to hash in bytes
-    pageSize             - Memory block size assumed to fit in L1 cache - must be a power of 2
-    numThreads,          - Number of threads to run in parallel to help fill memory bandwidth
+    memorySize           - Memory to hash in bytes, up to the context's maxMemorySize
+    pageSize             - Memory block size assumed to fit in L1 cache - must be a power of 2, at least 1KB
+    numThreads,          - Number of threads to run in parallel to help fill memory bandwidth, 1 to the
+                           context's maxThreads
     derivedKey           - Result derived key
     derivedKeySize       - Length of the result key - must be a power of 2
     salt                 - Salt/nonce
@@ -124,87 +631,865 @@ static void *hashMem(void *threadContextPtr) {
     password             - The password, which may contain 0's or any other value
     passwordSize         - Length of password in bytes
     clearPassword        - If true, set password to 0's after initial hashing
-    clearMemory          - Set memory to 0's before returning
-    freeMemory           - Free memory before returning
+    clearMemory          - Set memory to 0's, before returning, or after in the background if the
+                           context was set up with keystretchSetBackgroundWipe
 */
-bool keystretch(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
-        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
-        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory, bool freeMemory) {
+bool keystretchHash(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory) {
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory, false,
+        NULL, NULL);
+}
 
-    printf("sha256HashRounds:%u cpuWorkMultiplier:%u memorySize:%llu pageSize:%u numThreads:%u\n",
-        sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+// Return the number of pages the lanes actually wrote, which can be more than we use when
+// stopping early.
+static uint32 countPagesWritten(ThreadContext contexts) {
+    uint32 lane, pagesFilled, numPages = 0;
+    for(lane = 0; lane < MAX_THREADS; lane++) {
+        pagesFilled = __atomic_load_n(&contexts[lane].pagesFilled, __ATOMIC_ACQUIRE);
+        if(pagesFilled != 0 && (pagesFilled - 1)*MAX_THREADS + lane + 1 > numPages) {
+            numPages = (pagesFilled - 1)*MAX_THREADS + lane + 1;
+        }
+    }
+    return numPages;
+}
 
-    // Step 1: Do as much or more of the max key stretching OpenSSL Truecrypt allow, and and clear the password
-    PBKDF2_SHA256(password, passwordSize, salt, saltSize, sha256HashRounds, derivedKey, derivedKeySize);
-    if(clearPassword) {
-        memset(password, '\0', passwordSize); // It's a good idea to clear the password ASAP
+// Return the nanoseconds since *phaseStart, and start the next phase now.
+static uint64 lapTime(uint64 *phaseStart) {
+    uint64 now = getNanoseconds();
+    uint64 elapsed = now - *phaseStart;
+    *phaseStart = now;
+    return elapsed;
+}
+
+// Count the bytes the fill moved, and what the workers' counters saw.  Every page filled,
+// numPages of them, is read from one page and written pass times.
+static void countFill(KeystretchContext context, KeystretchStats *stats, uint32 numPages, uint64 passSize) {
+    uint32 t;
+    stats->bytesWritten = numPages*passSize;
+    stats->bytesRead = stats->bytesWritten;
+    if(stats->fillTime != 0) {
+        stats->fillBandwidth = (uint64)(stats->bytesWritten*1.0e9/stats->fillTime);
     }
+    for(t = 0; t < stats->numWorkers; t++) {
+        Worker w = context->workers + t;
+        if(w->counted) {
+            stats->countersValid = true;
+            stats->workers[t].cycles = w->counts[COUNTER_CYCLES];
+            stats->workers[t].llcMisses = w->counts[COUNTER_LLC_MISSES];
+            stats->workers[t].dtlbMisses = w->counts[COUNTER_DTLB_MISSES];
+        }
+    }
+}
 
-    // Now we're in pure security improvement territory... allocate memory
+// Hand the call's stats to the caller, if they asked for them.  Called with the context locked.
+static void reportStats(KeystretchContext context, KeystretchStats *stats, uint64 start) {
+    if(context->stats != NULL) {
+        stats->totalTime = getNanoseconds() - start;
+        *context->stats = *stats;
+    }
+}
+
+// Do the work of keystretchHash, stopping early as stop says, if it is not NULL.  Where we
+// stopped is written to result.  If stretched is true, derivedKey already holds the initial
+// stretch of the password, as the batch computes it for many passwords at once.  Unless stop
+// has its own, keystretchCancelHash and the context's progress callback apply.  If the hash is
+// cancelled, the memory written so far goes straight back to the OS, and we return false.
+static bool hashWithStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, bool stretched, Stop stop, KeystretchStop *result) {
     uint32 pageLength = pageSize/sizeof(uint64);
-    uint32 numPages = (uint32)(memorySize/(pageLength*sizeof(uint64)));
-    uint64 memoryLength = ((uint64)pageLength)*numPages;
-    uint64 *mem = (uint64 *)malloc(memoryLength * sizeof(uint64));
-    if(mem == NULL) {
-        fprintf(stderr, "Unable to allocate memory\n");
+    // Check the page size before dividing by it.
+    uint32 numPages = pageLength < 8*MAX_THREADS? 0 : (uint32)(memorySize/(pageLength*sizeof(uint64)));
+    if(numThreads == 0 || numThreads > context->maxThreads || pageLength < 8*MAX_THREADS ||
+            numPages <= MAX_THREADS || memorySize > context->maxMemorySize) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
         return false;
     }
+    KeystretchStats stats;
+    memset(&stats, '\0', sizeof(stats));
+    uint64 start = getNanoseconds();
+    uint64 phaseStart = start;
+    // Number the call before waiting for the lock, so a cancel while we wait still counts.
+    uint64 call = __atomic_add_fetch(&context->callsStarted, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&context->lock);
+    keystretchPoolWait(&context->pool); // The memory is not ours until any background wipe is done
+    stats.waitTime = lapTime(&phaseStart);
+    struct stopStruct noStop;
+    if(stop == NULL) {
+        memset(&noStop, '\0', sizeof(struct stopStruct));
+        stop = &noStop;
+    }
+    if(stop->cancel == NULL) {
+        stop->cancel = &context->cancel;
+        stop->call = call;
+    }
+    if(stop->progress == NULL) {
+        stop->progress = context->progress;
+        stop->progressData = context->progressData;
+    }
+
+    // Step 1: Do as much or more of the max key stretching OpenSSL Truecrypt allow, and and clear the password.
+    // If this is the context's first call, the other threads fault in the memory meanwhile.
+    struct setupStruct setup;
+    setup.numPbkdf2Jobs = stretched? 0 : splitPbkdf2(context, numThreads, setup.jobs, password, passwordSize,
+        salt, saltSize, sha256HashRounds, derivedKey, derivedKeySize);
+    setup.arena = context->prefaulted? NULL : &context->arena;
+    runSetup(context, &setup);
+    if(clearPassword) {
+        memset(password, '\0', passwordSize); // It's a good idea to clear the password ASAP
+    }
+    stats.stretchTime = lapTime(&phaseStart);
+    stats.faultTime = setup.faultTime;
+
+    // Now we're in pure security improvement territory... the memory is already allocated
+    uint64 *mem = context->arena.mem;
 
     // Initialize thread keys from derivedKey, and erase derivedKey
-    PBKDF2_SHA256(derivedKey, derivedKeySize, salt, saltSize, 1, (uint8 *)(void *)mem, pageLength*sizeof(uint64));
+    parallelPbkdf2(context, numThreads, derivedKey, derivedKeySize, salt, saltSize, 1, mem, pageLength*sizeof(uint64));
     memset(derivedKey, '\0', derivedKeySize);
 
-    pthread_t threads[MAX_THREADS];
-    struct threadContextStruct contexts[MAX_THREADS];
-    ThreadContext c = NULL;
-    // Launch the threads, using a spin-lock for synchronization.  The first thread starts
-    // with the spin-lock, and then passes it to the next round-robin.
-    int rc;
-    long t;
-    for(t = 0; t < numThreads; t++) {
-        c = contexts + t;
+    ThreadContext contexts = context->contexts;
+    ThreadContext c;
+    uint32 lane;
+    for(lane = 0; lane < MAX_THREADS; lane++) {
+        c = contexts + lane;
         c->mem = mem;
         c->pageLength = pageLength;
         c->numPages = numPages;
         c->cpuWorkMultiplier = cpuWorkMultiplier;
-        c->lastPageData = mem[0];
-        PBKDF2_SHA256((uint8 *)(void *)(mem + t*8*sizeof(uint64)), 8*sizeof(uint64), salt, saltSize, 1,
-            (uint8 *)(void *)(c->key), 8*sizeof(uint64));
+        c->state.lastPageData = mem[0];
+        c->pagesFilled = lane == 0? 1 : 0;
+        PBKDF2_SHA256((uint8 *)(void *)(mem + lane*8), 8*sizeof(uint64), salt, saltSize, 1,
+            (uint8 *)(void *)(c->state.key), 8*sizeof(uint64));
     }
-    for(t = 0; t < numThreads; t++) {
-        c = contexts + t;
-        rc = pthread_create(&threads[t], NULL, hashMem, (void *)c);
-        if (rc){
-            fprintf(stderr, "Unable to start threads\n");
-            return false;
+    stop->stopRound = (numPages + MAX_THREADS - 1)/MAX_THREADS;
+    stats.keyTime = lapTime(&phaseStart);
+    stats.numWorkers = fillMemory(context, numThreads, stop);
+    stats.fillTime = lapTime(&phaseStart);
+    uint32 pagesWritten = countPagesWritten(contexts);
+    uint64 writtenLength = (uint64)pageLength*pagesWritten;
+    memset(contexts, '\0', MAX_THREADS*sizeof(struct threadContextStruct));
+    countFill(context, &stats, pagesWritten - 1, (uint64)pageSize*cpuWorkMultiplier);
+    if(stop->stopRound == 0) {
+        // Cancelled, so there is no key, and the memory is wanted back now.  Releasing it clears
+        // it too, and the next call faults it in again during its stretch.
+        if(keystretchArenaRelease(&context->arena)) {
+            context->prefaulted = false;
+        } else {
+            wipeMemory(context, writtenLength*sizeof(uint64));
         }
+        stats.wipeTime = lapTime(&phaseStart);
+        reportStats(context, &stats, start);
+        pthread_mutex_unlock(&context->lock);
+        return false;
     }
-    // Wait for threads to finish
-    for(t = 0; t < numThreads; t++) {
-        (void)pthread_join(threads[t], NULL);
+
+    // When stopping early, only the rounds below the stop round count.
+    uint32 usedPages = numPages;
+    if(stop->stopRound*MAX_THREADS < numPages) {
+        usedPages = stop->stopRound*MAX_THREADS;
+    }
+    bool tagFound = true;
+    if(result != NULL) {
+        result->numPages = usedPages;
+        computeStopTag(stop, mem + (uint64)((usedPages - 1)/MAX_THREADS)*MAX_THREADS*pageLength, result->tag);
+        tagFound = stop->tag == NULL || !memcmp(result->tag, stop->tag, KEYSTRETCH_STOP_TAG_SIZE);
     }
 
-    // Hash the last page to form the key.
-    PBKDF2_SHA256((uint8 *)(void *)(mem + (numPages-1)*pageLength), pageLength*sizeof(uint64), salt, saltSize, 1,
-        derivedKey, derivedKeySize);
-    memset(contexts, '\0', MAX_THREADS*sizeof(struct threadContextStruct));
+    // Hash the last page of every lane to form the key.
+    PBKDF2_SHA256((uint8 *)(void *)(mem + (usedPages-MAX_THREADS)*pageLength), MAX_THREADS*pageLength*sizeof(uint64),
+        salt, saltSize, 1, derivedKey, derivedKeySize);
+    stats.hashTime = lapTime(&phaseStart);
 
-    // Clear used memory if requested.  This slows down the code by about 1/3.
+    // Clear used memory if requested.  Done on the caller's time, this slows down the code by
+    // about 1/3, so servers should wipe in the background.
     if(clearMemory) {
-        memset(mem, '\0', memoryLength*sizeof(uint64)); 
+        wipeMemory(context, writtenLength*sizeof(uint64));
     }
-    if(freeMemory) {
-        free(mem);
+    stats.wipeTime = lapTime(&phaseStart);
+    reportStats(context, &stats, start);
+    pthread_mutex_unlock(&context->lock);
+    if(!tagFound) {
+        memset(derivedKey, '\0', derivedKeySize);
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Stop tag not found");
+        return false;
     }
-
     return true;
 }
 
+// Time budget mode: fill memory until timeLimit nanoseconds after the call starts, or until
+// memorySize is used up, and record where we stopped in stop.
+bool keystretchHashForTime(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 timeLimit, uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey,
+        uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize,
+        bool clearPassword, bool clearMemory, KeystretchStop *stop) {
+    struct stopStruct stopCondition;
+    if(pageSize == 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+        return false;
+    }
+    memset(&stopCondition, '\0', sizeof(struct stopStruct));
+    // Only whole rounds, so the tag is always on the last round's page of lane 0
+    memorySize -= memorySize % ((uint64)pageSize*MAX_THREADS);
+    stopCondition.deadline = getNanoseconds() + timeLimit;
+    stopCondition.salt = salt;
+    stopCondition.saltSize = saltSize;
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory, false,
+        &stopCondition, stop);
+}
+
+// Recompute a key from keystretchHashForTime.  With stop->numPages set, this is keystretchHash
+// with that many pages.  With stop->numPages 0, memory is filled until lane 0's page matches
+// stop->tag, up to memorySize.  Returns false if it never does.
+bool keystretchHashToStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, const KeystretchStop *stop) {
+    struct stopStruct stopCondition;
+    KeystretchStop result;
+    if(stop->numPages != 0) {
+        if((uint64)stop->numPages*pageSize > memorySize) {
+            keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+            return false;
+        }
+        return keystretchHash(context, sha256HashRounds, cpuWorkMultiplier, (uint64)stop->numPages*pageSize,
+            pageSize, numThreads, derivedKey, derivedKeySize, salt, saltSize, password, passwordSize,
+            clearPassword, clearMemory);
+    }
+    memset(&stopCondition, '\0', sizeof(struct stopStruct));
+    stopCondition.tag = stop->tag;
+    stopCondition.salt = salt;
+    stopCondition.saltSize = saltSize;
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory, false,
+        &stopCondition, &result);
+}
+
+// The context keystretch uses when asked not to free memory, so the next call can reuse it.
+static KeystretchContext sharedContext = NULL;
+static pthread_mutex_t sharedContextLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hash in the shared context, growing it first if it is too small for this call.
+static bool hashInSharedContext(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
+        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory) {
+    bool result;
+    pthread_mutex_lock(&sharedContextLock);
+    if(sharedContext != NULL && (sharedContext->maxMemorySize < memorySize || sharedContext->maxThreads < numThreads)) {
+        keystretchDestroyContext(sharedContext);
+        sharedContext = NULL;
+    }
+    if(sharedContext == NULL) {
+        sharedContext = createContext(memorySize, numThreads, placementFromEnvironment(), NULL, false);
+        if(sharedContext != NULL) {
+            setBackgroundWipe(sharedContext);
+        }
+    }
+    result = sharedContext != NULL && keystretchHash(sharedContext, sha256HashRounds, cpuWorkMultiplier,
+        memorySize, pageSize, numThreads, derivedKey, derivedKeySize, salt, saltSize, password, passwordSize,
+        clearPassword, clearMemory);
+    pthread_mutex_unlock(&sharedContextLock);
+    return result;
+}
+
+// The original interface.  With freeMemory false, the memory is kept in a shared context for
+// the next call, rather than leaked.
+bool keystretch(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
+        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory, bool freeMemory) {
+    if(!freeMemory) {
+        return hashInSharedContext(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+            derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory);
+    }
+    KeystretchContext context = createContext(memorySize, numThreads, placementFromEnvironment(), NULL, false);
+    if(context == NULL) {
+        return false;
+    }
+    bool result = keystretchHash(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory);
+    keystretchDestroyContext(context);
+    return result;
+}
+
 // Wrapper for the password hashing competition. Note that the password, "in" cannot be
 // cleared!  This leaves the unencrypted password lying around memory for the entire
-// hashing session.
+// hashing session.  Calls share one context, so the memory is only allocated once.
 int PHS(void *out, size_t outlen, const void *in, size_t inlen, const void *salt, size_t saltlen,
         unsigned int t_cost, unsigned int m_cost) {
-    return keystretch(4096, t_cost, m_cost, 16*(1 << 10), 1, out, outlen, salt, saltlen, (void *)in, inlen,
-        false, false, false);
+    return hashInSharedContext(4096, t_cost, m_cost, 16*(1 << 10), 1, out, outlen, salt, saltlen, (void *)in,
+        inlen, false, false);
+}
+
+// A batch hashes many passwords on a set of slots, each with its own context, so bulk jobs pay
+// for allocating and faulting in memory once, rather than once per password.  The slots run on
+// a pool of their own, and each takes the next group of jobs as it finishes the last.
+struct keystretchBatchStruct {
+    KeystretchContext contexts[MAX_THREADS];
+    struct poolStruct pool;
+    uint32 numSlots;
+    uint64 maxMemorySize;
+    uint32 maxThreads;    // Per job
+    KeystretchJob *jobs;
+    uint32 numJobs;
+    uint32 nextJob;       // Only access with __atomic builtins
+    bool clearPasswords;
+    bool clearMemory;
+};
+
+// Fill in cpus with numCpus of the CPUs we may run on, starting from the first'th and
+// wrapping around.
+static void listAllowedCpus(uint32 *cpus, uint32 first, uint32 numCpus) {
+    cpu_set_t allowed;
+    uint32 cpu, numAllowed = 0, i = 0;
+    uint32 allowedCpus[CPU_SETSIZE];
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &allowed)) {
+                allowedCpus[numAllowed++] = cpu;
+            }
+        }
+    }
+    for(i = 0; i < numCpus; i++) {
+        cpus[i] = numAllowed == 0? first + i : allowedCpus[(first + i) % numAllowed];
+    }
+}
+
+// Create a context for each job that fits at once in memoryBudget bytes and maxThreads threads,
+// for jobs of up to maxMemorySize bytes and maxJobThreads threads each, with each slot's threads
+// pinned to CPUs of their own, and no more than maxSlots.  The CPU of each slot's first thread
+// is written to slotCpus.  Returns how many slots there are, which is fewer if memory runs out.
+static uint32 createSlots(KeystretchContext *contexts, uint32 *slotCpus, uint64 memoryBudget,
+        uint32 maxThreads, uint64 maxMemorySize, uint32 maxJobThreads, uint32 maxSlots) {
+    uint32 cpus[MAX_THREADS];
+    uint32 slot, numSlots;
+    if(maxJobThreads == 0 || maxJobThreads > MAX_THREADS || maxMemorySize == 0 ||
+            maxThreads < maxJobThreads || memoryBudget < maxMemorySize) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch batch parameters");
+        return 0;
+    }
+    numSlots = maxThreads/maxJobThreads;
+    if(numSlots > memoryBudget/maxMemorySize) {
+        numSlots = memoryBudget/maxMemorySize;
+    }
+    if(numSlots > maxSlots) {
+        numSlots = maxSlots;
+    }
+    for(slot = 0; slot < numSlots; slot++) {
+        listAllowedCpus(cpus, slot*maxJobThreads, maxJobThreads);
+        slotCpus[slot] = cpus[0];
+        contexts[slot] = createContext(maxMemorySize, maxJobThreads, KEYSTRETCH_PLACEMENT_SIMPLE, cpus, true);
+        if(contexts[slot] == NULL) {
+            break;
+        }
+    }
+    return slot;
+}
+
+// Create a batch that runs as many jobs at once as fit in memoryBudget bytes and maxThreads
+// threads, for jobs of up to maxMemorySize bytes and maxJobThreads threads each.  Every slot's
+// threads are pinned to CPUs of their own.  Returns NULL if not even one slot fits.
+KeystretchBatch keystretchCreateBatch(uint64 memoryBudget, uint32 maxThreads, uint64 maxMemorySize,
+        uint32 maxJobThreads) {
+    uint32 slotCpus[MAX_THREADS];
+    KeystretchBatch batch = (KeystretchBatch)calloc(1, sizeof(struct keystretchBatchStruct));
+    if(batch == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate batch");
+        return NULL;
+    }
+    batch->numSlots = createSlots(batch->contexts, slotCpus, memoryBudget, maxThreads, maxMemorySize,
+        maxJobThreads, MAX_THREADS);
+    if(batch->numSlots == 0) {
+        free(batch);
+        return NULL;
+    }
+    batch->maxMemorySize = maxMemorySize;
+    batch->maxThreads = maxJobThreads;
+    keystretchPoolStart(&batch->pool, batch->numSlots, slotCpus);
+    return batch;
+}
+
+// Free the batch's contexts and slot threads.
+void keystretchDestroyBatch(KeystretchBatch batch) {
+    uint32 slot;
+    if(batch == NULL) {
+        return;
+    }
+    keystretchPoolStop(&batch->pool);
+    for(slot = 0; slot < batch->numSlots; slot++) {
+        keystretchDestroyContext(batch->contexts[slot]);
+    }
+    free(batch);
+}
+
+// Do the initial stretch of the jobs, which all have the same rounds and key size, side by side
+// with PBKDF2_SHA256_Multi.
+static void stretchJobs(KeystretchJob **jobs, uint32 numJobs) {
+    const uint8 *passwords[MAX_THREADS], *salts[MAX_THREADS];
+    size_t passwordSizes[MAX_THREADS], saltSizes[MAX_THREADS];
+    uint8 *keys[MAX_THREADS];
+    uint32 i;
+    for(i = 0; i < numJobs; i++) {
+        passwords[i] = jobs[i]->password;
+        passwordSizes[i] = jobs[i]->passwordSize;
+        salts[i] = jobs[i]->salt;
+        saltSizes[i] = jobs[i]->saltSize;
+        keys[i] = jobs[i]->derivedKey;
+    }
+    PBKDF2_SHA256_Multi(numJobs, passwords, passwordSizes, salts, saltSizes, jobs[0]->sha256HashRounds, keys,
+        jobs[0]->derivedKeySize);
+}
+
+// Return true if the job fits in slot contexts for maxMemorySize bytes and maxThreads threads.
+// Other parameters are checked when the job is hashed.
+static bool jobFits(uint64 maxMemorySize, uint32 maxThreads, KeystretchJob *job) {
+    return job->memorySize <= maxMemorySize && job->numThreads != 0 && job->numThreads <= maxThreads &&
+        job->sha256HashRounds != 0;
+}
+
+// Hash the group of jobs on the slot's context.  Jobs next to each other with the same rounds
+// and key size are stretched together first.
+static void hashJobGroup(KeystretchBatch batch, KeystretchContext context, KeystretchJob *jobs,
+        uint32 numJobs) {
+    KeystretchJob *run[MAX_THREADS];
+    KeystretchJob *job;
+    uint32 i, numRun = 0;
+    for(i = 0; i <= numJobs; i++) {
+        job = i < numJobs? jobs + i : NULL;
+        if(job != NULL && !jobFits(batch->maxMemorySize, batch->maxThreads, job)) {
+            keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+            job->succeeded = false;
+            continue;
+        }
+        if(numRun != 0 && (job == NULL || job->sha256HashRounds != run[0]->sha256HashRounds ||
+                job->derivedKeySize != run[0]->derivedKeySize)) {
+            stretchJobs(run, numRun);
+            numRun = 0;
+        }
+        if(job != NULL) {
+            run[numRun++] = job;
+        }
+    }
+    for(i = 0; i < numJobs; i++) {
+        job = jobs + i;
+        if(!jobFits(batch->maxMemorySize, batch->maxThreads, job)) {
+            continue;
+        }
+        if(batch->clearPasswords) {
+            memset(job->password, '\0', job->passwordSize);
+        }
+        job->succeeded = hashWithStop(context, job->sha256HashRounds, job->cpuWorkMultiplier, job->memorySize,
+            job->pageSize, job->numThreads, job->derivedKey, job->derivedKeySize, job->salt, job->saltSize,
+            job->password, job->passwordSize, false, batch->clearMemory, true, NULL, NULL);
+        if(!job->succeeded) {
+            memset(job->derivedKey, '\0', job->derivedKeySize); // Don't hand back the bare stretch
+        }
+    }
+}
+
+// Pool job for slot index: hash groups of jobs until there are none left.
+static void batchSlotJob(void *batchPtr, uint32 index) {
+    KeystretchBatch batch = (KeystretchBatch)batchPtr;
+    uint32 groupSize = PBKDF2_SHA256_Multi_Lanes();
+    uint32 first;
+    while((first = __atomic_fetch_add(&batch->nextJob, groupSize, __ATOMIC_RELAXED)) < batch->numJobs) {
+        uint32 numJobs = batch->numJobs - first < groupSize? batch->numJobs - first : groupSize;
+        hashJobGroup(batch, batch->contexts[index], batch->jobs + first, numJobs);
+    }
+}
+
+// Hash all the jobs, and return true if they all succeeded.  Each job's succeeded field says
+// how it went.
+bool keystretchHashBatch(KeystretchBatch batch, KeystretchJob *jobs, uint32 numJobs, bool clearPasswords,
+        bool clearMemory) {
+    uint32 i;
+    if(numJobs == 0) {
+        return true;
+    }
+    batch->jobs = jobs;
+    batch->numJobs = numJobs;
+    batch->nextJob = 0;
+    batch->clearPasswords = clearPasswords;
+    batch->clearMemory = clearMemory;
+    keystretchPoolRun(&batch->pool, batchSlotJob, batch, batch->numSlots);
+    for(i = 0; i < numJobs; i++) {
+        if(!jobs[i].succeeded) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A queue hashes jobs as they are submitted, on slots like a batch's, so servers can hash
+// passwords without tying up a thread per request.  The slots run on a pool of their own, and
+// each sleeps on the queue until there is a job to take.  One more pool thread runs the
+// callbacks of requests cancelled while waiting, so callbacks always run on a queue thread.
+// Requests are kept in four lists: those waiting for a slot, those cancelled while waiting and
+// not yet called back, those done but not yet taken with keystretchNextCompleted, and those
+// done and handed to the caller, but not yet finished.  A request the caller has not finished is
+// always on one of them, so destroying the queue can free it.
+struct keystretchQueueStruct {
+    KeystretchContext contexts[MAX_THREADS];
+    struct poolStruct pool;
+    uint32 numSlots;
+    uint64 maxMemorySize;
+    uint32 maxThreads;    // Per job
+    int eventFd;
+    pthread_mutex_t lock; // Guards the lists, the request states, and stop
+    pthread_cond_t wake;  // Signaled when a request is queued, or we stop
+    pthread_cond_t callbackWake; // Signaled when a request is cancelled while waiting, or we stop
+    KeystretchRequest firstPending, lastPending;
+    KeystretchRequest firstCancelled, lastCancelled;
+    KeystretchRequest firstCompleted, lastCompleted;
+    KeystretchRequest firstTaken, lastTaken;
+    bool stop;
+};
+
+typedef enum {
+    REQUEST_PENDING,
+    REQUEST_RUNNING,
+    REQUEST_DONE
+} RequestState;
+
+struct keystretchRequestStruct {
+    KeystretchQueue queue;
+    KeystretchJob *job;
+    KeystretchCallback callback;
+    void *userData;
+    KeystretchRequest prev, next; // In the pending, cancelled, completed, or taken list
+    RequestState state;
+    bool clearPassword;
+    bool clearMemory;
+    uint64 cancel;                // Set to 1 to cancel the running job, only access with __atomic builtins
+    bool cancelled;
+    bool completedListed;         // True while on the completed list
+};
+
+// Append the request to a list.
+static void appendRequest(KeystretchRequest *first, KeystretchRequest *last, KeystretchRequest request) {
+    request->prev = *last;
+    request->next = NULL;
+    if(*last != NULL) {
+        (*last)->next = request;
+    } else {
+        *first = request;
+    }
+    *last = request;
+}
+
+// Remove the request from a list.
+static void removeRequest(KeystretchRequest *first, KeystretchRequest *last, KeystretchRequest request) {
+    if(request->prev != NULL) {
+        request->prev->next = request->next;
+    } else {
+        *first = request->next;
+    }
+    if(request->next != NULL) {
+        request->next->prev = request->prev;
+    } else {
+        *last = request->prev;
+    }
+    request->prev = NULL;
+    request->next = NULL;
+}
+
+// Mark the request done, and tell the caller: through the callback if it has one, and
+// otherwise by putting it on the completed list and bumping the eventfd.  Called on a queue
+// thread with the queue locked.  The lock is dropped while the callback runs, since it may
+// submit more jobs.
+static void completeRequest(KeystretchQueue queue, KeystretchRequest request) {
+    uint64 one = 1;
+    request->state = REQUEST_DONE;
+    if(request->callback != NULL) {
+        // Listed before the callback runs, since it may finish the request, or hand it on
+        appendRequest(&queue->firstTaken, &queue->lastTaken, request);
+        pthread_mutex_unlock(&queue->lock);
+        request->callback(request, request->job->succeeded, request->userData);
+        pthread_mutex_lock(&queue->lock);
+        return;
+    }
+    appendRequest(&queue->firstCompleted, &queue->lastCompleted, request);
+    request->completedListed = true;
+    if(write(queue->eventFd, &one, sizeof(one)) != sizeof(one)) {
+        // Only fails if the counter would overflow, and then the eventfd is readable anyway
+    }
+}
+
+// Take a request that has not started off the pending list, and fail its job.  The password is
+// still cleared if that was asked for.  Without a callback, it is completed right away, and
+// otherwise it is passed to the callback thread.  Called with the queue locked.
+static void cancelRequest(KeystretchQueue queue, KeystretchRequest request) {
+    KeystretchJob *job = request->job;
+    removeRequest(&queue->firstPending, &queue->lastPending, request);
+    if(request->clearPassword) {
+        memset(job->password, '\0', job->passwordSize);
+    }
+    request->cancelled = true;
+    job->succeeded = false;
+    if(request->callback == NULL) {
+        completeRequest(queue, request);
+        return;
+    }
+    request->state = REQUEST_RUNNING; // Until the callback thread completes it
+    appendRequest(&queue->firstCancelled, &queue->lastCancelled, request);
+    pthread_cond_signal(&queue->callbackWake);
+}
+
+// Run on the callback thread: complete requests cancelled while waiting until the queue is
+// destroyed, and then the last of them.
+static void runCancelledCallbacks(KeystretchQueue queue) {
+    KeystretchRequest request;
+    pthread_mutex_lock(&queue->lock);
+    while(true) {
+        while(!queue->stop && queue->firstCancelled == NULL) {
+            pthread_cond_wait(&queue->callbackWake, &queue->lock);
+        }
+        request = queue->firstCancelled;
+        if(request == NULL) {
+            break;
+        }
+        removeRequest(&queue->firstCancelled, &queue->lastCancelled, request);
+        completeRequest(queue, request);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Pool job for slot index: hash queued jobs one at a time until the queue is destroyed.  The
+// index after the last slot is the callback thread.
+static void queueSlotJob(void *queuePtr, uint32 index) {
+    KeystretchQueue queue = (KeystretchQueue)queuePtr;
+    KeystretchContext context = queue->contexts[index];
+    KeystretchRequest request;
+    KeystretchJob *job;
+    struct stopStruct stop;
+    if(index == queue->numSlots) {
+        runCancelledCallbacks(queue);
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while(true) {
+        while(!queue->stop && queue->firstPending == NULL) {
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        if(queue->stop) {
+            break;
+        }
+        request = queue->firstPending;
+        removeRequest(&queue->firstPending, &queue->lastPending, request);
+        request->state = REQUEST_RUNNING;
+        pthread_mutex_unlock(&queue->lock);
+        job = request->job;
+        memset(&stop, '\0', sizeof(struct stopStruct));
+        stop.cancel = &request->cancel;
+        stop.call = 1;
+        job->succeeded = hashWithStop(context, job->sha256HashRounds, job->cpuWorkMultiplier, job->memorySize,
+            job->pageSize, job->numThreads, job->derivedKey, job->derivedKeySize, job->salt, job->saltSize,
+            job->password, job->passwordSize, request->clearPassword, request->clearMemory, false, &stop, NULL);
+        pthread_mutex_lock(&queue->lock);
+        request->cancelled = !job->succeeded && __atomic_load_n(&request->cancel, __ATOMIC_RELAXED);
+        completeRequest(queue, request);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Create a queue that hashes as many jobs at once as fit in memoryBudget bytes and maxThreads
+// threads, for jobs of up to maxMemorySize bytes and maxJobThreads threads each.  Returns NULL
+// if not even one slot fits.
+KeystretchQueue keystretchCreateQueue(uint64 memoryBudget, uint32 maxThreads, uint64 maxMemorySize,
+        uint32 maxJobThreads) {
+    uint32 slotCpus[MAX_THREADS], cpus[MAX_THREADS];
+    uint32 slot;
+    KeystretchQueue queue = (KeystretchQueue)calloc(1, sizeof(struct keystretchQueueStruct));
+    if(queue == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate queue");
+        return NULL;
+    }
+    queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(queue->eventFd < 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to create eventfd");
+        free(queue);
+        return NULL;
+    }
+    // The caller's thread is index 0 of the pool, and the callback thread comes after the slots
+    queue->numSlots = createSlots(queue->contexts, slotCpus, memoryBudget, maxThreads, maxMemorySize,
+        maxJobThreads, MAX_THREADS - 2);
+    if(queue->numSlots == 0) {
+        close(queue->eventFd);
+        free(queue);
+        return NULL;
+    }
+    queue->maxMemorySize = maxMemorySize;
+    queue->maxThreads = maxJobThreads;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+    pthread_cond_init(&queue->callbackWake, NULL);
+    cpus[0] = slotCpus[0];
+    for(slot = 0; slot < queue->numSlots; slot++) {
+        cpus[slot + 1] = slotCpus[slot];
+    }
+    cpus[queue->numSlots + 1] = slotCpus[0]; // The callback thread rarely runs
+    keystretchPoolStart(&queue->pool, queue->numSlots + 2, cpus);
+    if(queue->pool.numThreads < queue->numSlots + 2) {
+        // Run with the slots that have a thread, keeping one for callbacks
+        queue->numSlots = queue->pool.numThreads < 2? 0 : queue->pool.numThreads - 2;
+    }
+    if(queue->numSlots == 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to start queue threads");
+        keystretchDestroyQueue(queue);
+        return NULL;
+    }
+    keystretchPoolRunInBackground(&queue->pool, queueSlotJob, queue, queue->numSlots + 1);
+    return queue;
+}
+
+// Cancel the jobs still waiting, wait for running ones and the callbacks, and free the queue.
+// Requests not yet finished with keystretchFinish are freed too, whether or not they were taken.
+void keystretchDestroyQueue(KeystretchQueue queue) {
+    KeystretchRequest request;
+    uint32 slot;
+    if(queue == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while(queue->firstPending != NULL) {
+        request = queue->firstPending;
+        cancelRequest(queue, request);
+    }
+    queue->stop = true;
+    pthread_cond_broadcast(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    keystretchPoolStop(&queue->pool);
+    while((request = queue->firstCompleted) != NULL) {
+        removeRequest(&queue->firstCompleted, &queue->lastCompleted, request);
+        free(request);
+    }
+    while((request = queue->firstTaken) != NULL) {
+        removeRequest(&queue->firstTaken, &queue->lastTaken, request);
+        free(request);
+    }
+    for(slot = 0; slot < MAX_THREADS; slot++) {
+        keystretchDestroyContext(queue->contexts[slot]);
+    }
+    pthread_cond_destroy(&queue->wake);
+    pthread_cond_destroy(&queue->callbackWake);
+    pthread_mutex_destroy(&queue->lock);
+    close(queue->eventFd);
+    free(queue);
+}
+
+// Return the eventfd that is bumped each time a request without a callback completes.
+int keystretchQueueEventFd(KeystretchQueue queue) {
+    return queue->eventFd;
+}
+
+// Return how many jobs the queue runs at once.
+uint32 keystretchQueueSlots(KeystretchQueue queue) {
+    return queue->numSlots;
+}
+
+// Queue the job, and return a handle to it, or NULL if it doesn't fit the queue.  The job and
+// the buffers it points to must stay put until the request completes.
+KeystretchRequest keystretchSubmit(KeystretchQueue queue, KeystretchJob *job, bool clearPassword,
+        bool clearMemory, KeystretchCallback callback, void *userData) {
+    KeystretchRequest request;
+    if(!jobFits(queue->maxMemorySize, queue->maxThreads, job)) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+        return NULL;
+    }
+    request = (KeystretchRequest)calloc(1, sizeof(struct keystretchRequestStruct));
+    if(request == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate request");
+        return NULL;
+    }
+    request->queue = queue;
+    request->job = job;
+    request->callback = callback;
+    request->userData = userData;
+    request->clearPassword = clearPassword;
+    request->clearMemory = clearMemory;
+    job->succeeded = false;
+    pthread_mutex_lock(&queue->lock);
+    request->state = REQUEST_PENDING;
+    appendRequest(&queue->firstPending, &queue->lastPending, request);
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    return request;
+}
+
+// Return true if the request has completed.
+bool keystretchPoll(KeystretchRequest request) {
+    KeystretchQueue queue = request->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool done = request->state == REQUEST_DONE;
+    pthread_mutex_unlock(&queue->lock);
+    return done;
+}
+
+// Cancel the request, and return false if it is already done.  A request still waiting is
+// completed right away, though its callback, if it has one, runs on the queue's callback
+// thread.  A running one stops before its next round of pages, and its slot's
+// memory is released, unless it finishes first.  A cancelled request still completes, with its
+// job failed, so it is finished like any other.
+bool keystretchCancel(KeystretchRequest request) {
+    KeystretchQueue queue = request->queue;
+    bool cancelling = true;
+    pthread_mutex_lock(&queue->lock);
+    if(request->state == REQUEST_PENDING) {
+        cancelRequest(queue, request);
+    } else if(request->state == REQUEST_RUNNING) {
+        __atomic_store_n(&request->cancel, 1, __ATOMIC_RELAXED);
+    } else {
+        cancelling = false;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return cancelling;
+}
+
+// Return true if the request was cancelled before its job finished.
+bool keystretchCancelled(KeystretchRequest request) {
+    KeystretchQueue queue = request->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool cancelled = request->cancelled;
+    pthread_mutex_unlock(&queue->lock);
+    return cancelled;
+}
+
+// Return the userData the request was submitted with.
+void *keystretchRequestUserData(KeystretchRequest request) {
+    return request->userData;
+}
+
+// Take the oldest completed request off the completed list, or return NULL if there is none.
+KeystretchRequest keystretchNextCompleted(KeystretchQueue queue) {
+    pthread_mutex_lock(&queue->lock);
+    KeystretchRequest request = queue->firstCompleted;
+    if(request != NULL) {
+        removeRequest(&queue->firstCompleted, &queue->lastCompleted, request);
+        request->completedListed = false;
+        appendRequest(&queue->firstTaken, &queue->lastTaken, request);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return request;
+}
+
+// Free a completed request, and return whether its job succeeded.
+bool keystretchFinish(KeystretchRequest request) {
+    KeystretchQueue queue = request->queue;
+    pthread_mutex_lock(&queue->lock);
+    if(request->completedListed) {
+        removeRequest(&queue->firstCompleted, &queue->lastCompleted, request);
+    } else {
+        removeRequest(&queue->firstTaken, &queue->lastTaken, request);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    bool succeeded = request->job->succeeded;
+    free(request);
+    return succeeded;
 }
@@ -9,8 +9,12 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "sha256.h"
 #include "keystretch.h"
+#include "log.h"
 
 typedef struct ContextStruct *Context;
 
@@ -40,25 +44,136 @@ static void fillPage(Context c, uint32 fromPageNum, uint32 toPageNum) {
     }
 }
 
-// Hash pages randomly into the derived key.
-static void hashMem(Context c) {
+// Return the current time in nanoseconds.
+static uint64 getNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+// Compute the stop tag of a page: a hash of its first 64 bytes with the salt.
+static void computeStopTag(uint64 *page, const void *salt, uint32 saltSize, uint8 *tag) {
+    PBKDF2_SHA256((uint8 *)(void *)page, 8*sizeof(uint64), salt, saltSize, 1, tag, KEYSTRETCH_STOP_TAG_SIZE);
+}
+
+// Hash pages randomly into the derived key.  Page toPageNum belongs to lane toPageNum mod
+// MAX_THREADS, and each lane has its own context.  Before each round of MAX_THREADS pages
+// after the first two, stop if the deadline has passed, or if the last round's page of lane 0
+// matches tag.  Returns the number of pages filled.
+static uint32 hashMem(Context contexts, uint64 deadline, const uint8 *tag, const void *salt, uint32 saltSize) {
+    Context c;
     uint32 fromPageNum = 0;
     uint32 toPageNum;
-    uint32 numPages = c->numPages;
+    uint32 numPages = contexts->numPages;
     uint32 hash;
+    uint8 pageTag[KEYSTRETCH_STOP_TAG_SIZE];
     for(toPageNum = 1; toPageNum < numPages; toPageNum++) {
+        if((toPageNum & THREAD_MASK) == 0 && toPageNum >= 2*MAX_THREADS) {
+            if(deadline != 0 && getNanoseconds() >= deadline) {
+                return toPageNum;
+            }
+            if(tag != NULL) {
+                computeStopTag(contexts->mem + (toPageNum - MAX_THREADS)*contexts->pageLength, salt, saltSize,
+                    pageTag);
+                if(!memcmp(pageTag, tag, KEYSTRETCH_STOP_TAG_SIZE)) {
+                    return toPageNum;
+                }
+            }
+        }
+        c = contexts + (toPageNum & THREAD_MASK);
         hash = c->key[0];
         fromPageNum = hash % toPageNum;
         fillPage(c, fromPageNum, toPageNum);
     }
+    return numPages;
+}
+
+// The ref version's context just holds the memory.
+struct keystretchContextStruct {
+    uint64 *mem;
+    uint64 maxMemorySize;
+    uint32 maxThreads;
+};
+
+const char *keystretchVersion(void) {
+    return KEYSTRETCH_VERSION;
+}
+
+KeystretchContext keystretchCreateContext(uint64 maxMemorySize, uint32 maxThreads) {
+    KeystretchContext context = (KeystretchContext)calloc(1, sizeof(struct keystretchContextStruct));
+    if(context == NULL) {
+        return NULL;
+    }
+    context->mem = (uint64 *)malloc(maxMemorySize);
+    if(context->mem == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to allocate memory");
+        free(context);
+        return NULL;
+    }
+    context->maxMemorySize = maxMemorySize;
+    context->maxThreads = maxThreads;
+    return context;
+}
+
+// The reference version runs on the caller's thread, so there is nothing to place.
+KeystretchContext keystretchCreatePlacedContext(uint64 maxMemorySize, uint32 maxThreads,
+        KeystretchPlacement placement) {
+    return keystretchCreateContext(maxMemorySize, maxThreads);
+}
+
+// The reference version always wipes memory before returning, so no wipe is ever pending.
+void keystretchSetBackgroundWipe(KeystretchContext context, bool background) {
+}
+
+bool keystretchWipePending(KeystretchContext context) {
+    return false;
+}
+
+void keystretchWaitForWipe(KeystretchContext context) {
+}
+
+// The reference version always runs a hash to the end, so it neither reports progress nor
+// can be cancelled.
+void keystretchSetProgress(KeystretchContext context, KeystretchProgress progress, void *userData) {
+}
+
+void keystretchCancelHash(KeystretchContext context) {
+}
+
+// The reference version doesn't time its phases, so the stats just read as zero.
+void keystretchSetStats(KeystretchContext context, KeystretchStats *stats, bool counters) {
+    if(stats != NULL) {
+        memset(stats, '\0', sizeof(KeystretchStats));
+    }
+}
+
+void keystretchDestroyContext(KeystretchContext context) {
+    if(context != NULL) {
+        free(context->mem);
+        free(context);
+    }
+}
+
+static bool hashWithStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, uint64 deadline, const uint8 *tag, KeystretchStop *result);
+
+// Log the parameters of a single hash.  Batches don't, since there are so many.
+static void logParameters(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads) {
+    keystretchLogMessage(KEYSTRETCH_LOG_INFO,
+        "sha256HashRounds:%u cpuWorkMultiplier:%u memorySize:%llu pageSize:%u numThreads:%u", sha256HashRounds,
+        cpuWorkMultiplier, memorySize, pageSize, numThreads);
 }
 
 /* This is the main key derivation function.  Parameters are:
+    context              - Context from keystretchCreateContext, which holds the memory
     sha256HashRounds     - Parameter for increasing initial key stretching beyond 4096 SHA-256 rounds
     cpuWorkMultiplier    - How many times to repeat hashing the entire memory.  Most often, this should be 1
-    memorySize           - Memory to hash in bytes
+    memorySize           - Memory to hash in bytes, up to the context's maxMemorySize
     pageSize             - Memory block size assumed to fit in L1 cache - must be a power of 2
-    numThreads,          - Number of threads - ignored in ref version
+    numThreads,          - Number of threads - ignored in ref version, which runs all lanes in order
     derivedKey           - Result derived key
     derivedKeySize       - Length of the result key - must be a power of 2
     salt                 - Salt/nonce
@@ -67,61 +182,319 @@ static void hashMem(Context c) {
     passwordSize         - Length of password in bytes
     clearPassword        - If true, set password to 0's after initial hashing
     clearMemory          - Set memory to 0's before returning
-    freeMemory           - Free memory before returning
 */
-bool keystretch(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
-        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
-        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory, bool freeMemory) {
+bool keystretchHash(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory) {
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory, 0, NULL,
+        NULL);
+}
 
-    printf("sha256HashRounds:%u cpuWorkMultiplier:%u memorySize:%llu pageSize:%u numThreads:%u\n",
-        sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+// Do the work of keystretchHash, stopping at the deadline or the tag, if given, and write where
+// we stopped to result.
+static bool hashWithStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, uint64 deadline, const uint8 *tag, KeystretchStop *result) {
+    uint32 pageLength = pageSize/sizeof(uint64);
+    // Check the page size before dividing by it.
+    uint32 numPages = pageLength < 8*MAX_THREADS? 0 : (uint32)(memorySize/(pageLength*sizeof(uint64)));
+    uint64 memoryLength = ((uint64)pageLength)*numPages;
+    if(pageLength < 8*MAX_THREADS || numPages <= MAX_THREADS || memorySize > context->maxMemorySize) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+        return false;
+    }
 
     // Do standard key stretching and and clear the password
     PBKDF2_SHA256(password, passwordSize, salt, saltSize, sha256HashRounds, derivedKey, derivedKeySize);
     if(clearPassword) {
         memset(password, '\0', passwordSize); // It's a good idea to clear the password ASAP
     }
-
-    // Now we're in pure security improvement territory... allocate memory
-    uint32 pageLength = pageSize/sizeof(uint64);
-    uint32 numPages = (uint32)(memorySize/(pageLength*sizeof(uint64)));
-    uint64 memoryLength = ((uint64)pageLength)*numPages;
-    uint64 *mem = (uint64 *)malloc(memoryLength * sizeof(uint64));
-    if(mem == NULL) {
-        fprintf(stderr, "Unable to allocate memory\n");
-        return false;
-    }
+    uint64 *mem = context->mem;
 
     // Initialize initial page from derivedKey
     PBKDF2_SHA256(derivedKey, derivedKeySize, salt, saltSize, 1, (uint8 *)(void *)mem, pageLength*sizeof(uint64));
 
-    struct ContextStruct c;
-    c.mem = mem;
-    c.pageLength = pageLength;
-    c.numPages = numPages;
-    c.cpuWorkMultiplier = cpuWorkMultiplier;
-    c.lastPageData = mem[0];
-    PBKDF2_SHA256((uint8 *)(void *)mem, 8*sizeof(uint64), salt, saltSize, 1, (uint8 *)(void *)(c.key), 8*sizeof(uint64));
+    struct ContextStruct contexts[MAX_THREADS];
+    uint32 lane;
+    for(lane = 0; lane < MAX_THREADS; lane++) {
+        Context c = contexts + lane;
+        c->mem = mem;
+        c->pageLength = pageLength;
+        c->numPages = numPages;
+        c->cpuWorkMultiplier = cpuWorkMultiplier;
+        c->lastPageData = mem[0];
+        PBKDF2_SHA256((uint8 *)(void *)(mem + lane*8), 8*sizeof(uint64), salt, saltSize, 1,
+            (uint8 *)(void *)(c->key), 8*sizeof(uint64));
+    }
 
     // Hash memory
-    hashMem(&c);
+    uint32 usedPages = hashMem(contexts, deadline, tag, salt, saltSize);
+    bool tagFound = true;
+    if(result != NULL) {
+        result->numPages = usedPages;
+        computeStopTag(mem + ((usedPages - 1)/MAX_THREADS)*MAX_THREADS*pageLength, salt, saltSize, result->tag);
+        tagFound = tag == NULL || !memcmp(result->tag, tag, KEYSTRETCH_STOP_TAG_SIZE);
+    }
 
-    // Hash the last page to form the key.
-    PBKDF2_SHA256((uint8 *)(void *)(mem + (numPages-1)*pageLength), pageLength*sizeof(uint64), salt, saltSize, 1,
-        derivedKey, derivedKeySize);
-    memset((void *)&c, '\0', sizeof(struct ContextStruct));
+    // Hash the last page of every lane to form the key.
+    PBKDF2_SHA256((uint8 *)(void *)(mem + (usedPages-MAX_THREADS)*pageLength), MAX_THREADS*pageLength*sizeof(uint64),
+        salt, saltSize, 1, derivedKey, derivedKeySize);
+    memset((void *)contexts, '\0', MAX_THREADS*sizeof(struct ContextStruct));
 
     // Clear used memory if requested.  This slows down the code by about 1/3.
     if(clearMemory) {
         memset(mem, '\0', memoryLength*sizeof(uint64)); 
     }
-    if(freeMemory) {
-        free(mem);
+    if(!tagFound) {
+        memset(derivedKey, '\0', derivedKeySize);
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Stop tag not found");
+        return false;
     }
+    return true;
+}
 
+// Time budget mode: fill memory until timeLimit nanoseconds after the call starts, or until
+// memorySize is used up, and record where we stopped in stop.
+bool keystretchHashForTime(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 timeLimit, uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey,
+        uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize,
+        bool clearPassword, bool clearMemory, KeystretchStop *stop) {
+    if(pageSize == 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+        return false;
+    }
+    memorySize -= memorySize % ((uint64)pageSize*MAX_THREADS);
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory,
+        getNanoseconds() + timeLimit, NULL, stop);
+}
+
+// Recompute a key from keystretchHashForTime, from stop->numPages if set, and otherwise by
+// filling memory until the stop tag matches.
+bool keystretchHashToStop(KeystretchContext context, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword,
+        bool clearMemory, const KeystretchStop *stop) {
+    KeystretchStop result;
+    if(stop->numPages != 0) {
+        if((uint64)stop->numPages*pageSize > memorySize) {
+            keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch parameters");
+            return false;
+        }
+        return keystretchHash(context, sha256HashRounds, cpuWorkMultiplier, (uint64)stop->numPages*pageSize,
+            pageSize, numThreads, derivedKey, derivedKeySize, salt, saltSize, password, passwordSize,
+            clearPassword, clearMemory);
+    }
+    logParameters(sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return hashWithStop(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory, 0,
+        stop->tag, &result);
+}
+
+// The ref version's batch hashes the jobs one at a time in a single context.
+struct keystretchBatchStruct {
+    KeystretchContext context;
+    uint32 maxThreads;
+};
+
+KeystretchBatch keystretchCreateBatch(uint64 memoryBudget, uint32 maxThreads, uint64 maxMemorySize,
+        uint32 maxJobThreads) {
+    if(maxJobThreads == 0 || maxJobThreads > MAX_THREADS || maxMemorySize == 0 ||
+            maxThreads < maxJobThreads || memoryBudget < maxMemorySize) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid keystretch batch parameters");
+        return NULL;
+    }
+    KeystretchBatch batch = (KeystretchBatch)calloc(1, sizeof(struct keystretchBatchStruct));
+    if(batch == NULL) {
+        return NULL;
+    }
+    batch->context = keystretchCreateContext(maxMemorySize, maxJobThreads);
+    if(batch->context == NULL) {
+        free(batch);
+        return NULL;
+    }
+    batch->maxThreads = maxJobThreads;
+    return batch;
+}
+
+bool keystretchHashBatch(KeystretchBatch batch, KeystretchJob *jobs, uint32 numJobs, bool clearPasswords,
+        bool clearMemory) {
+    bool allSucceeded = true;
+    uint32 i;
+    for(i = 0; i < numJobs; i++) {
+        KeystretchJob *job = jobs + i;
+        job->succeeded = job->numThreads <= batch->maxThreads && hashWithStop(batch->context,
+            job->sha256HashRounds, job->cpuWorkMultiplier, job->memorySize, job->pageSize, job->numThreads,
+            job->derivedKey, job->derivedKeySize, job->salt, job->saltSize, job->password, job->passwordSize,
+            clearPasswords, clearMemory, 0, NULL, NULL);
+        allSucceeded = allSucceeded && job->succeeded;
+    }
+    return allSucceeded;
+}
+
+void keystretchDestroyBatch(KeystretchBatch batch) {
+    if(batch != NULL) {
+        keystretchDestroyContext(batch->context);
+        free(batch);
+    }
+}
+
+// The ref version's queue hashes each job on the caller's thread when it is submitted, so
+// requests are done before keystretchSubmit returns, and can never be cancelled.  Every
+// request not yet finished is also on the unfinished list, so destroying the queue can free it.
+struct keystretchQueueStruct {
+    KeystretchBatch batch;
+    int eventFd;
+    KeystretchRequest firstCompleted, lastCompleted;
+    KeystretchRequest firstUnfinished;
+};
+
+struct keystretchRequestStruct {
+    KeystretchQueue queue;
+    KeystretchJob *job;
+    void *userData;
+    KeystretchRequest next;
+    KeystretchRequest nextUnfinished;
+    bool completedListed;
+};
+
+KeystretchQueue keystretchCreateQueue(uint64 memoryBudget, uint32 maxThreads, uint64 maxMemorySize,
+        uint32 maxJobThreads) {
+    KeystretchQueue queue = (KeystretchQueue)calloc(1, sizeof(struct keystretchQueueStruct));
+    if(queue == NULL) {
+        return NULL;
+    }
+    queue->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->batch = keystretchCreateBatch(memoryBudget, maxThreads, maxMemorySize, maxJobThreads);
+    if(queue->eventFd < 0 || queue->batch == NULL) {
+        keystretchDestroyQueue(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void keystretchDestroyQueue(KeystretchQueue queue) {
+    KeystretchRequest request;
+    while((request = queue->firstUnfinished) != NULL) {
+        queue->firstUnfinished = request->nextUnfinished;
+        free(request);
+    }
+    keystretchDestroyBatch(queue->batch);
+    if(queue->eventFd >= 0) {
+        close(queue->eventFd);
+    }
+    free(queue);
+}
+
+int keystretchQueueEventFd(KeystretchQueue queue) {
+    return queue->eventFd;
+}
+
+KeystretchRequest keystretchSubmit(KeystretchQueue queue, KeystretchJob *job, bool clearPassword,
+        bool clearMemory, KeystretchCallback callback, void *userData) {
+    uint64 one = 1;
+    KeystretchRequest request = (KeystretchRequest)calloc(1, sizeof(struct keystretchRequestStruct));
+    if(request == NULL) {
+        return NULL;
+    }
+    request->queue = queue;
+    request->job = job;
+    request->userData = userData;
+    request->nextUnfinished = queue->firstUnfinished;
+    queue->firstUnfinished = request;
+    keystretchHashBatch(queue->batch, job, 1, clearPassword, clearMemory);
+    if(callback != NULL) {
+        callback(request, job->succeeded, userData);
+        return request;
+    }
+    if(queue->lastCompleted != NULL) {
+        queue->lastCompleted->next = request;
+    } else {
+        queue->firstCompleted = request;
+    }
+    queue->lastCompleted = request;
+    request->completedListed = true;
+    if(write(queue->eventFd, &one, sizeof(one)) != sizeof(one)) {
+        // Only fails if the counter would overflow, and then the eventfd is readable anyway
+    }
+    return request;
+}
+
+uint32 keystretchQueueSlots(KeystretchQueue queue) {
+    return 1;
+}
+
+void *keystretchRequestUserData(KeystretchRequest request) {
+    return request->userData;
+}
+
+bool keystretchPoll(KeystretchRequest request) {
     return true;
 }
 
+bool keystretchCancel(KeystretchRequest request) {
+    return false;
+}
+
+bool keystretchCancelled(KeystretchRequest request) {
+    return false;
+}
+
+KeystretchRequest keystretchNextCompleted(KeystretchQueue queue) {
+    KeystretchRequest request = queue->firstCompleted;
+    if(request != NULL) {
+        queue->firstCompleted = request->next;
+        if(queue->firstCompleted == NULL) {
+            queue->lastCompleted = NULL;
+        }
+        request->completedListed = false;
+    }
+    return request;
+}
+
+bool keystretchFinish(KeystretchRequest request) {
+    KeystretchQueue queue = request->queue;
+    KeystretchRequest prev = NULL;
+    KeystretchRequest *unfinished = &queue->firstUnfinished;
+    bool succeeded = request->job->succeeded;
+    while(*unfinished != request) {
+        unfinished = &(*unfinished)->nextUnfinished;
+    }
+    *unfinished = request->nextUnfinished;
+    if(request->completedListed) {
+        KeystretchRequest *link = &queue->firstCompleted;
+        while(*link != request) {
+            prev = *link;
+            link = &prev->next;
+        }
+        *link = request->next;
+        if(queue->lastCompleted == request) {
+            queue->lastCompleted = prev;
+        }
+    }
+    free(request);
+    return succeeded;
+}
+
+// The ref version always frees memory.
+bool keystretch(uint32 sha256HashRounds, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
+        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory, bool freeMemory) {
+    KeystretchContext context = keystretchCreateContext(memorySize, numThreads);
+    if(context == NULL) {
+        return false;
+    }
+    bool result = keystretchHash(context, sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKey, derivedKeySize, salt, saltSize, password, passwordSize, clearPassword, clearMemory);
+    keystretchDestroyContext(context);
+    return result;
+}
+
 // Wrapper for the password hashing competition. Note that the password, "in" cannot be
 // cleared!  This leaves the unencrypted password lying around memory for the entire
 // hashing session.
@@ -1,4 +1,23 @@
+#ifndef KEYSTRETCH_H
+#define KEYSTRETCH_H
+
 #include <stdbool.h>
+#include <stddef.h>
+
+// The version of this header.  keystretchVersion returns the version of the library actually
+// linked, which for a shared library may be newer.  The major version changes when the API or
+// its results do.
+#define KEYSTRETCH_VERSION_MAJOR 1
+#define KEYSTRETCH_VERSION_MINOR 0
+#define KEYSTRETCH_VERSION_PATCH 0
+#define KEYSTRETCH_VERSION "1.0.0"
+
+// The library is built with hidden visibility, so only what is declared here is exported.
+#ifdef __GNUC__
+#define KEYSTRETCH_API __attribute__((visibility("default")))
+#else
+#define KEYSTRETCH_API
+#endif
 
 typedef unsigned char uint8;
 typedef unsigned short uint16;
@@ -8,12 +27,223 @@ typedef unsigned int uint32;
 #define MAX_THREADS 16 // Must be power of 2
 #define THREAD_MASK (MAX_THREADS - 1)
 
-bool keystretch(uint32 initialHashingFactor, uint32 cpuWorkMultiplier, uint64 memorySize, uint32
-        pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt, uint32 saltSize,
-        void *password, uint32 passwordSize, bool clearPassword, bool clearMemory, bool freeMemory);
+KEYSTRETCH_API const char *keystretchVersion(void);
+
+// Diagnostics, such as the memory a context got and why a call failed, go to a log hook, and
+// with none set, they are dropped without being formatted, so embedding keystretch costs no
+// stdio.  Messages have no trailing newline.  keystretchLogStdio prints errors and warnings to
+// stderr, and the rest to stdout, as the command line tools do.  Set the hook before hashing.
+typedef enum {
+    KEYSTRETCH_LOG_ERROR,
+    KEYSTRETCH_LOG_WARNING,
+    KEYSTRETCH_LOG_INFO
+} KeystretchLogLevel;
+
+typedef void (*KeystretchLog)(KeystretchLogLevel level, const char *message, void *userData);
+
+KEYSTRETCH_API void keystretchSetLog(KeystretchLog log, void *userData);
+KEYSTRETCH_API void keystretchLogStdio(KeystretchLogLevel level, const char *message, void *userData);
+
+typedef struct keystretchContextStruct *KeystretchContext;
+
+// A context keeps the memory and thread state between calls, so servers hashing many
+// passwords do not allocate and page fault gigabytes each time.  Create one with the most
+// memory and threads you will hash with, call keystretchHash as often as you like, and
+// destroy it when done.  Calls on the same context are serialized.
+KEYSTRETCH_API KeystretchContext keystretchCreateContext(uint64 maxMemorySize, uint32 maxThreads);
+KEYSTRETCH_API bool keystretchHash(KeystretchContext context, uint32 sha256HashRounds,
+        uint32 cpuWorkMultiplier, uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey,
+        uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize,
+        bool clearPassword, bool clearMemory);
+KEYSTRETCH_API void keystretchDestroyContext(KeystretchContext context);
+
+// With background set, clearMemory does not wipe the memory before keystretchHash returns,
+// but after, on the context's worker threads, with non-temporal stores.  A one-thread context
+// starts a helper thread to wipe on.  The next call on the context, and
+// keystretchDestroyContext, wait for the wipe to finish first.  keystretch() with freeMemory
+// false wipes its shared context in the background.
+KEYSTRETCH_API void keystretchSetBackgroundWipe(KeystretchContext context, bool background);
+KEYSTRETCH_API bool keystretchWipePending(KeystretchContext context);
+KEYSTRETCH_API void keystretchWaitForWipe(KeystretchContext context);
+
+// A hash on a context can be cancelled from another thread with keystretchCancelHash, such as
+// when the client that wanted it has gone.  Calls still waiting for the context are cancelled
+// too, but not ones made after.  The workers check before each round of pages, and stop
+// filling memory, keystretchHash returns false, and the memory written so far is handed
+// straight back to the OS, which clears it too.  A progress callback set on the context is
+// called on the hashing thread after each round, with how many of the numPages pages are
+// filled, and can cancel the hash by returning false.
+typedef bool (*KeystretchProgress)(uint32 pagesFilled, uint32 numPages, void *userData);
+
+KEYSTRETCH_API void keystretchSetProgress(KeystretchContext context, KeystretchProgress progress,
+        void *userData);
+KEYSTRETCH_API void keystretchCancelHash(KeystretchContext context);
+
+// Where the time goes in each hash on a context, to tell whether a slow run is the CPU, memory
+// or the kernel.  After keystretchSetStats, each call fills in stats.  Times are in
+// nanoseconds.  waitTime is spent waiting for another call on the context, or a background
+// wipe.  stretchTime is the initial PBKDF2 stretch, and faultTime the longest any thread spent
+// faulting in the arena, which happens at the same time, on the first call.  keyTime sets up
+// the lanes' keys, fillTime fills memory, hashTime hashes the last pages into the key, and
+// wipeTime clears memory, unless that is done in the background.  bytesWritten and bytesRead
+// count the fill's page writes and reads, and fillBandwidth is bytes written per second of
+// fillTime.  With counters set, each fill worker also counts its cycles, last level cache
+// misses and dTLB load misses, with perf_event_open.  countersValid is false if the kernel
+// would not let us count.
+typedef struct {
+    uint64 cycles;
+    uint64 llcMisses;
+    uint64 dtlbMisses;
+} KeystretchWorkerStats;
+
+typedef struct {
+    uint64 totalTime;
+    uint64 waitTime;
+    uint64 stretchTime;
+    uint64 faultTime;
+    uint64 keyTime;
+    uint64 fillTime;
+    uint64 hashTime;
+    uint64 wipeTime;
+    uint64 bytesWritten;
+    uint64 bytesRead;
+    uint64 fillBandwidth;
+    uint32 numWorkers;
+    bool countersValid;
+    KeystretchWorkerStats workers[MAX_THREADS];
+} KeystretchStats;
+
+KEYSTRETCH_API void keystretchSetStats(KeystretchContext context, KeystretchStats *stats, bool counters);
+
+// How a context places its threads and memory.  Simple placement pins worker i to the i'th CPU
+// we may run on, and leaves memory wherever first touch puts it.  Topology placement reads the
+// CPU and NUMA topology from sysfs, pins one worker per physical core, keeps to the caller's
+// NUMA node when it has enough cores, and prefers or interleaves the memory over the nodes
+// used.  It prints the placement it chose.  keystretchCreateContext uses topology placement
+// when KEYSTRETCH_PLACEMENT=topology is set in the environment, and simple placement otherwise.
+typedef enum {
+    KEYSTRETCH_PLACEMENT_SIMPLE,
+    KEYSTRETCH_PLACEMENT_TOPOLOGY
+} KeystretchPlacement;
+
+KEYSTRETCH_API KeystretchContext keystretchCreatePlacedContext(uint64 maxMemorySize, uint32 maxThreads,
+        KeystretchPlacement placement);
+
+// Time budget mode, so users can pick a time to run rather than a memory size.  Memory is
+// filled until timeLimit nanoseconds after the call starts, or until memorySize is used up.
+// stop records where we stopped: how many pages were filled, and a tag hashed from the last
+// round's page of lane 0.  To compute the key again, pass stop to keystretchHashToStop.  If
+// numPages is kept, that is the same as keystretchHash with memorySize numPages*pageSize.
+// For deniability, only the tag need be kept: set numPages to 0, and memory is filled until
+// the tag matches, up to memorySize.  keystretchHashToStop fails if the tag never matches.
+#define KEYSTRETCH_STOP_TAG_SIZE 16
+
+typedef struct {
+    uint32 numPages;
+    uint8 tag[KEYSTRETCH_STOP_TAG_SIZE];
+} KeystretchStop;
+
+KEYSTRETCH_API bool keystretchHashForTime(KeystretchContext context, uint32 sha256HashRounds,
+        uint32 cpuWorkMultiplier, uint64 timeLimit, uint64 memorySize, uint32 pageSize, uint32 numThreads,
+        void *derivedKey, uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password,
+        uint32 passwordSize, bool clearPassword, bool clearMemory, KeystretchStop *stop);
+KEYSTRETCH_API bool keystretchHashToStop(KeystretchContext context, uint32 sha256HashRounds,
+        uint32 cpuWorkMultiplier, uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey,
+        uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize,
+        bool clearPassword, bool clearMemory, const KeystretchStop *stop);
+
+// Parameters tuned for a host by keystretch-calibrate, which picks the page size, threads and
+// the most memory that fit a latency budget.  latency is in nanoseconds, and fillBandwidth in
+// bytes per second, as measured when the profile was made.
+typedef struct {
+    uint32 sha256HashRounds;
+    uint32 cpuWorkMultiplier;
+    uint64 memorySize;
+    uint32 pageSize;
+    uint32 numThreads;
+    uint64 latency;
+    uint64 fillBandwidth;
+} KeystretchProfile;
+
+KEYSTRETCH_API bool keystretchLoadProfile(const char *path, KeystretchProfile *profile);
+KEYSTRETCH_API bool keystretchSaveProfile(const char *path, const KeystretchProfile *profile);
+
+// A batch hashes many passwords, such as when rehashing a whole password database, with
+// contexts that are allocated once for the whole batch.  It runs as many jobs at once as fit in
+// memoryBudget bytes and maxThreads threads, for jobs of up to maxMemorySize bytes and
+// maxJobThreads threads each, and each slot's threads are pinned to CPUs of their own.  The
+// initial stretch is done for many jobs at once, in SIMD lanes.  keystretchHashBatch may be
+// called as often as you like, and returns true if every job succeeded.  Jobs that don't fit
+// the batch fail, and the succeeded field of each job says how it went.
+typedef struct keystretchBatchStruct *KeystretchBatch;
+
+typedef struct {
+    uint32 sha256HashRounds;
+    uint32 cpuWorkMultiplier;
+    uint64 memorySize;
+    uint32 pageSize;
+    uint32 numThreads;
+    void *derivedKey;
+    uint32 derivedKeySize;
+    const void *salt;
+    uint32 saltSize;
+    void *password;
+    uint32 passwordSize;
+    bool succeeded;
+} KeystretchJob;
+
+KEYSTRETCH_API KeystretchBatch keystretchCreateBatch(uint64 memoryBudget, uint32 maxThreads,
+        uint64 maxMemorySize, uint32 maxJobThreads);
+KEYSTRETCH_API bool keystretchHashBatch(KeystretchBatch batch, KeystretchJob *jobs, uint32 numJobs,
+        bool clearPasswords, bool clearMemory);
+KEYSTRETCH_API void keystretchDestroyBatch(KeystretchBatch batch);
+
+// A queue hashes jobs as they are submitted, on slots like a batch's, run by the library's own
+// threads.  keystretchSubmit returns a request handle right away, and the job, with the buffers
+// it points to, must stay put until the request completes.  Completion is reported one of two
+// ways.  With a callback, it is called on a queue thread when the job is done, and is given the
+// request, which must be passed to keystretchFinish then or later.  Without one, the request
+// goes on the queue's completed list, and the eventfd from keystretchQueueEventFd is bumped,
+// so it can be watched with poll or epoll: when it is readable, read it, then take requests
+// with keystretchNextCompleted until it returns NULL.  keystretchPoll says if a request is
+// done.  keystretchCancel cancels a request: one still waiting completes right away, and a
+// running one stops as keystretchCancelHash does.  Either way it completes as usual, with the
+// job failed, and keystretchCancelled returns true.  The callback of a cancelled request still
+// runs on a queue thread, never on the one that called keystretchCancel.  keystretchQueueSlots says how many jobs
+// the queue runs at once, and keystretchRequestUserData returns the userData a request was
+// submitted with, which is handy for finding what a completed request was for.  Every request
+// must be passed to keystretchFinish once it completes, which frees it and returns whether the
+// job succeeded.  Destroying the queue cancels jobs still waiting, waits for the running ones
+// and for the callbacks, and frees every request not yet passed to keystretchFinish, including
+// ones already taken with keystretchNextCompleted or given to a callback.
+typedef struct keystretchQueueStruct *KeystretchQueue;
+typedef struct keystretchRequestStruct *KeystretchRequest;
+typedef void (*KeystretchCallback)(KeystretchRequest request, bool succeeded, void *userData);
+
+KEYSTRETCH_API KeystretchQueue keystretchCreateQueue(uint64 memoryBudget, uint32 maxThreads,
+        uint64 maxMemorySize, uint32 maxJobThreads);
+KEYSTRETCH_API void keystretchDestroyQueue(KeystretchQueue queue);
+KEYSTRETCH_API int keystretchQueueEventFd(KeystretchQueue queue);
+KEYSTRETCH_API uint32 keystretchQueueSlots(KeystretchQueue queue);
+KEYSTRETCH_API KeystretchRequest keystretchSubmit(KeystretchQueue queue, KeystretchJob *job,
+        bool clearPassword, bool clearMemory, KeystretchCallback callback, void *userData);
+KEYSTRETCH_API bool keystretchPoll(KeystretchRequest request);
+KEYSTRETCH_API bool keystretchCancel(KeystretchRequest request);
+KEYSTRETCH_API bool keystretchCancelled(KeystretchRequest request);
+KEYSTRETCH_API void *keystretchRequestUserData(KeystretchRequest request);
+KEYSTRETCH_API KeystretchRequest keystretchNextCompleted(KeystretchQueue queue);
+KEYSTRETCH_API bool keystretchFinish(KeystretchRequest request);
+
+// Hash without a context.  If freeMemory is false, the memory is kept for the next call.
+KEYSTRETCH_API bool keystretch(uint32 initialHashingFactor, uint32 cpuWorkMultiplier, uint64 memorySize,
+        uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize, const void *salt,
+        uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword, bool clearMemory,
+        bool freeMemory);
 
 // This is the prototype required for the password hashing competition.  It just sets
-// initialHashingFactor to 0,  pageSize to 16KB, numThreads to 2, and clearMemory and
+// initialHashingFactor to 4096,  pageSize to 16KB, numThreads to 1, and clearMemory and
 // freeMemory to false.
-int PHS(void *out, size_t outlen, const void *in, size_t inlen, const void *salt, size_t saltlen,
-    unsigned int t_cost, unsigned int m_cost);
+KEYSTRETCH_API int PHS(void *out, size_t outlen, const void *in, size_t inlen, const void *salt,
+    size_t saltlen, unsigned int t_cost, unsigned int m_cost);
+
+#endif
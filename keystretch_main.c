@@ -17,7 +17,14 @@ static void usage(char *format, ...) {
         "    Memory size in MB\n"
         "    Page size in KB\n"
         "    Hashing factor is integer difficulty multiplier\n"
-        "    Derived key size in bytes\n");
+        "    Derived key size in bytes\n"
+        "   or: keystretch -p <profile> <derived key size> <salt in hex> <password>\n"
+        "    Profile is a file written by keystretch-calibrate\n"
+        "   or: keystretch -b <memory budget> <threads> [file]\n"
+        "    Batch mode reads one record per line from the file, or stdin, with the same fields as\n"
+        "    the command line, password last, and writes one hex key, or \"error\", per line.\n"
+        "    Up to <threads> threads and <memory budget> MB are used for as many records at once\n"
+        "    as fit.\n");
     exit(1);
 }
 
@@ -96,6 +103,22 @@ static void printHex(
 static void readArguments(int argc, char **argv, uint32 *sha256Rounds, uint32 *cpuWorkMultiplier,
         uint64 *memorySize, uint32 *pageSize, uint32 *numThreads, uint32 *derivedKeySize,
         uint8 **salt, uint32 *saltSize, char **password, uint32 *passwordSize) {
+    KeystretchProfile profile;
+    if(argc == 6 && !strcmp(argv[1], "-p")) {
+        if(!keystretchLoadProfile(argv[2], &profile)) {
+            usage("Unable to load profile");
+        }
+        *sha256Rounds = profile.sha256HashRounds;
+        *cpuWorkMultiplier = profile.cpuWorkMultiplier;
+        *memorySize = profile.memorySize;
+        *pageSize = profile.pageSize;
+        *numThreads = profile.numThreads;
+        *derivedKeySize = readUint32(argv, 3);
+        *salt = readHexSalt(argv[4], saltSize);
+        *password = argv[5];
+        *passwordSize = strlen(*password);
+        return;
+    }
     if(argc != 9) {
         usage("Incorrect number of arguments");
     }
@@ -110,49 +133,245 @@ static void readArguments(int argc, char **argv, uint32 *sha256Rounds, uint32 *c
     *passwordSize = strlen(*password);
 }
 
-// Verify the input parameters are reasonalble.
-static void verifyParameters(uint32 sha256Rounds, uint32 cpuWorkMultiplier, uint64
+// Check the input parameters are reasonalble.  Returns what is wrong, or NULL if nothing is.
+static char *checkParameters(uint32 sha256Rounds, uint32 cpuWorkMultiplier, uint64
         memorySize, uint32 pageSize, uint32 numThreads, uint32 derivedKeySize, uint32 saltSize,
         uint32 passwordSize) {
     if(sha256Rounds == 0 || sha256Rounds > (1 << 30)) {
-        usage("Invalid hashing factor");
+        return "Invalid hashing factor";
     }
     if(cpuWorkMultiplier < 1 || cpuWorkMultiplier > (1 << 20)) {
-        usage("Invalid cpu work multipler");
+        return "Invalid cpu work multipler";
     }
     if(memorySize > (1LL << 32)*100 || memorySize < (1 << 20)) {
-        usage("Invalid memory size");
+        return "Invalid memory size";
     }
     if(pageSize > (1 << 28) || pageSize < (1 << 8)) {
-        usage("Invalid page size");
+        return "Invalid page size";
     }
     if(numThreads == 0 || numThreads > MAX_THREADS) {
-        usage("Invalid number of threads");
+        return "Invalid number of threads";
+    }
+    if(memorySize/pageSize <= MAX_THREADS) {
+        return "Memory size must be more than MAX_THREADS pages";
     }
     if(derivedKeySize < 8 || derivedKeySize > (1 << 20)) {
-        usage("Invalid derived key size");
+        return "Invalid derived key size";
     }
     if(saltSize > (1 << 9) || saltSize < 4) {
-        usage("Invalid salt size");
+        return "Invalid salt size";
     }
     if(passwordSize == 0) {
-        usage("Invalid password size");
+        return "Invalid password size";
     }
     while((pageSize & 1) == 0) {
         pageSize >>= 1;
     }
     if(pageSize != 1) {
-        usage("Page size must be a power of 2");
+        return "Page size must be a power of 2";
     }
     while((derivedKeySize & 1) == 0) {
         derivedKeySize >>= 1;
     }
     if(derivedKeySize != 1) {
-        usage("Derived key size must be a power of 2");
+        return "Derived key size must be a power of 2";
+    }
+    return NULL;
+}
+
+// Verify the input parameters are reasonalble.
+static void verifyParameters(uint32 sha256Rounds, uint32 cpuWorkMultiplier, uint64
+        memorySize, uint32 pageSize, uint32 numThreads, uint32 derivedKeySize, uint32 saltSize,
+        uint32 passwordSize) {
+    char *problem = checkParameters(sha256Rounds, cpuWorkMultiplier, memorySize, pageSize, numThreads,
+        derivedKeySize, saltSize, passwordSize);
+    if(problem != NULL) {
+        usage("%s", problem);
+    }
+}
+
+// Records are hashed this many at a time in batch mode.
+#define BATCH_SIZE 256
+#define MAX_RECORD_SIZE 2048
+
+typedef struct recordStruct *Record;
+
+// One line of batch input.
+struct recordStruct {
+    uint8 salt[MAX_RECORD_SIZE/2];
+    char password[MAX_RECORD_SIZE];
+    uint8 *derivedKey;
+    uint32 lineNum;
+    bool valid;
+};
+
+// Parse a line of batch input into job and record.  Returns false if it is not valid.
+static bool readRecord(char *line, uint32 lineNum, KeystretchJob *job, Record record) {
+    uint32 memoryMB, pageKB, saltChars, i;
+    char saltHex[MAX_RECORD_SIZE];
+    int passwordStart = 0;
+    record->lineNum = lineNum;
+    if(sscanf(line, "%u %u %u %u %u %u %2047s %n", &job->sha256HashRounds, &job->cpuWorkMultiplier,
+            &memoryMB, &pageKB, &job->numThreads, &job->derivedKeySize, saltHex, &passwordStart) < 7 ||
+            passwordStart == 0) {
+        fprintf(stderr, "Line %u: expected 8 fields\n", lineNum);
+        return false;
+    }
+    job->memorySize = memoryMB*(1LL << 20);
+    job->pageSize = pageKB*(1 << 10);
+    saltChars = strlen(saltHex);
+    job->saltSize = saltChars/2;
+    if(job->saltSize > MAX_RECORD_SIZE/2) {
+        fprintf(stderr, "Line %u: salt longer than %u bytes\n", lineNum, MAX_RECORD_SIZE/2);
+        return false;
+    }
+    for(i = 0; i < saltChars; i += 2) {
+        if(saltChars & 1 || !readHexByte(record->salt + i/2, saltHex + i)) {
+            fprintf(stderr, "Line %u: invalid hex salt\n", lineNum);
+            return false;
+        }
+    }
+    char *password = line + passwordStart;
+    job->passwordSize = strcspn(password, "\r\n");
+    if(job->passwordSize >= MAX_RECORD_SIZE) {
+        fprintf(stderr, "Line %u: password longer than %u bytes\n", lineNum, MAX_RECORD_SIZE - 1);
+        return false;
+    }
+    memcpy(record->password, password, job->passwordSize);
+    char *problem = checkParameters(job->sha256HashRounds, job->cpuWorkMultiplier, job->memorySize,
+        job->pageSize, job->numThreads, job->derivedKeySize, job->saltSize, job->passwordSize);
+    if(problem != NULL) {
+        fprintf(stderr, "Line %u: %s\n", lineNum, problem);
+        return false;
+    }
+    record->derivedKey = (uint8 *)calloc(job->derivedKeySize, sizeof(uint8));
+    job->derivedKey = record->derivedKey;
+    job->salt = record->salt;
+    job->password = record->password;
+    return record->derivedKey != NULL;
+}
+
+// Hash the records read so far, growing the batch first if a record needs more memory or
+// threads than it has, and print the keys in order.  A record that needs more than the whole
+// budget fails on its own.  Returns true if every record was hashed.
+static bool hashRecords(KeystretchBatch *batch, uint64 *batchMemory, uint32 *batchThreads,
+        uint64 memoryBudget, uint32 maxThreads, KeystretchJob *jobs, struct recordStruct *records,
+        uint32 numRecords) {
+    uint64 maxMemorySize = *batchMemory;
+    uint32 maxJobThreads = *batchThreads;
+    uint32 i, numJobs = 0;
+    KeystretchJob batchJobs[BATCH_SIZE];
+    for(i = 0; i < numRecords; i++) {
+        if(records[i].valid && (jobs[i].memorySize > memoryBudget || jobs[i].numThreads > maxThreads)) {
+            fprintf(stderr, "Line %u: needs more memory or threads than the batch has\n", records[i].lineNum);
+            records[i].valid = false;
+        }
+        if(records[i].valid) {
+            if(jobs[i].memorySize > maxMemorySize) {
+                maxMemorySize = jobs[i].memorySize;
+            }
+            if(jobs[i].numThreads > maxJobThreads) {
+                maxJobThreads = jobs[i].numThreads;
+            }
+            batchJobs[numJobs++] = jobs[i];
+        }
+    }
+    if(numJobs != 0 && (*batch == NULL || maxMemorySize > *batchMemory || maxJobThreads > *batchThreads)) {
+        keystretchDestroyBatch(*batch);
+        *batch = keystretchCreateBatch(memoryBudget, maxThreads, maxMemorySize, maxJobThreads);
+        // If that failed, the next records start over with a new batch.
+        *batchMemory = *batch == NULL? 0 : maxMemorySize;
+        *batchThreads = *batch == NULL? 0 : maxJobThreads;
+    }
+    if(*batch != NULL) {
+        keystretchHashBatch(*batch, batchJobs, numJobs, true, false);
+    }
+    bool allHashed = true;
+    numJobs = 0;
+    for(i = 0; i < numRecords; i++) {
+        if(records[i].valid && *batch != NULL && batchJobs[numJobs++].succeeded) {
+            printHex(records[i].derivedKey, jobs[i].derivedKeySize);
+            printf("\n");
+        } else {
+            printf("error\n");
+            allHashed = false;
+        }
+        if(records[i].derivedKey != NULL) {
+            memset(records[i].derivedKey, '\0', jobs[i].derivedKeySize);
+            free(records[i].derivedKey);
+        }
+    }
+    fflush(stdout);
+    memset(records, '\0', numRecords*sizeof(struct recordStruct));
+    return allHashed;
+}
+
+// Batch mode: hash records from the file, or stdin if path is NULL, writing keys to stdout.
+// Returns the exit code: 0 if every record was hashed.
+static int hashBatch(uint64 memoryBudget, uint32 maxThreads, char *path) {
+    static struct recordStruct records[BATCH_SIZE];
+    KeystretchJob jobs[BATCH_SIZE];
+    KeystretchBatch batch = NULL;
+    uint64 batchMemory = 0;
+    uint32 batchThreads = 0;
+    char line[3*MAX_RECORD_SIZE];
+    uint32 numRecords = 0, lineNum = 0;
+    bool allHashed = true;
+    FILE *file = path == NULL? stdin : fopen(path, "r");
+    if(file == NULL) {
+        usage("Unable to open %s", path);
+    }
+    memset(records, '\0', sizeof(records));
+    while(fgets(line, sizeof(line), file) != NULL) {
+        lineNum++;
+        memset(jobs + numRecords, '\0', sizeof(KeystretchJob));
+        if(strchr(line, '\n') == NULL && !feof(file)) {
+            // fgets stopped short of the end of the line.  Skip the rest of it, rather than
+            // reading it as another record.
+            fprintf(stderr, "Line %u: longer than %u characters\n", lineNum, (uint32)sizeof(line) - 2);
+            while(fgets(line, sizeof(line), file) != NULL && strchr(line, '\n') == NULL);
+            records[numRecords].valid = false;
+        } else {
+            records[numRecords].valid = readRecord(line, lineNum, jobs + numRecords, records + numRecords);
+        }
+        if(++numRecords == BATCH_SIZE) {
+            allHashed &= hashRecords(&batch, &batchMemory, &batchThreads, memoryBudget, maxThreads, jobs,
+                records, numRecords);
+            numRecords = 0;
+        }
+    }
+    memset(line, '\0', sizeof(line));
+    allHashed &= hashRecords(&batch, &batchMemory, &batchThreads, memoryBudget, maxThreads, jobs, records,
+        numRecords);
+    if(path != NULL) {
+        fclose(file);
+    }
+    keystretchDestroyBatch(batch);
+    return allHashed? 0 : 1;
+}
+
+// Report where the time went, one "name:value" line per phase, as KEYSTRETCH_STATS asks.
+static void printStats(KeystretchStats *stats) {
+    uint32 t;
+    printf("total:%.3fms wait:%.3fms stretch:%.3fms fault:%.3fms key:%.3fms fill:%.3fms hash:%.3fms wipe:%.3fms\n",
+        stats->totalTime/1.0e6, stats->waitTime/1.0e6, stats->stretchTime/1.0e6, stats->faultTime/1.0e6,
+        stats->keyTime/1.0e6, stats->fillTime/1.0e6, stats->hashTime/1.0e6, stats->wipeTime/1.0e6);
+    printf("written:%llu read:%llu bandwidth:%.2fGB/s\n", stats->bytesWritten, stats->bytesRead,
+        stats->fillBandwidth/1.0e9);
+    if(!stats->countersValid) {
+        return;
+    }
+    for(t = 0; t < stats->numWorkers; t++) {
+        printf("worker %u cycles:%llu llcMisses:%llu dtlbMisses:%llu\n", t, stats->workers[t].cycles,
+            stats->workers[t].llcMisses, stats->workers[t].dtlbMisses);
     }
 }
 
 int main(int argc, char **argv) {
+    keystretchSetLog(keystretchLogStdio, NULL);
+    if(argc >= 4 && argc <= 5 && !strcmp(argv[1], "-b")) {
+        return hashBatch(readUint32(argv, 2)*(1LL << 20), readUint32(argv, 3), argc == 5? argv[4] : NULL);
+    }
     uint64 memorySize;
     uint32 sha256Rounds, cpuWorkMultiplier, pageSize, numThreads, derivedKeySize, saltSize, passwordSize;
     uint8 *salt;
@@ -162,11 +381,23 @@ int main(int argc, char **argv) {
     verifyParameters(sha256Rounds, cpuWorkMultiplier, memorySize, pageSize, numThreads, derivedKeySize,
         saltSize, passwordSize);
     uint8 *derivedKey = (uint8 *)calloc(derivedKeySize, sizeof(uint8));
-    if(!keystretch(sha256Rounds, cpuWorkMultiplier, memorySize, pageSize, numThreads, derivedKey, derivedKeySize,
-            salt, saltSize, (uint8 *)password, passwordSize, true, false, false)) {
+    KeystretchContext context = keystretchCreateContext(memorySize, numThreads);
+    // KEYSTRETCH_STATS=1 reports where the time went, and KEYSTRETCH_STATS=counters adds the
+    // fill workers' hardware counters.
+    KeystretchStats stats;
+    const char *statsMode = getenv("KEYSTRETCH_STATS");
+    if(context != NULL && statsMode != NULL) {
+        keystretchSetStats(context, &stats, !strcmp(statsMode, "counters"));
+    }
+    if(context == NULL || !keystretchHash(context, sha256Rounds, cpuWorkMultiplier, memorySize, pageSize,
+            numThreads, derivedKey, derivedKeySize, salt, saltSize, (uint8 *)password, passwordSize, true, false)) {
         fprintf(stderr, "Key stretching failed.\n");
         return 1;
     }
+    keystretchDestroyContext(context);
+    if(statsMode != NULL) {
+        printStats(&stats);
+    }
     printHex(derivedKey, derivedKeySize);
     printf("\n");
     memset(derivedKey, '\0', derivedKeySize*sizeof(uint8));
@@ -0,0 +1,213 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// The client library for keystretchd.  Each call opens a connection, sends one request, and
+// waits for the reply, which may take as long as the hash does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "keystretchd.h"
+#include "log.h"
+
+// Write size bytes of data as 2*size upper case hex digits, and a terminating '\0'.
+void keystretchdWriteHex(const uint8 *data, uint32 size, char *hex) {
+    static const char digits[] = "0123456789ABCDEF";
+    uint32 i;
+    for(i = 0; i < size; i++) {
+        *hex++ = digits[data[i] >> 4];
+        *hex++ = digits[data[i] & 0xf];
+    }
+    *hex = '\0';
+}
+
+// Return the value of a hex digit, or -1 if it isn't one.
+static int hexDigit(char c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if(c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Read 2*size hex digits into data.
+bool keystretchdReadHex(const char *hex, uint32 hexLength, uint8 *data, uint32 size) {
+    uint32 i;
+    if(hexLength != 2*size) {
+        return false;
+    }
+    for(i = 0; i < size; i++) {
+        int high = hexDigit(hex[2*i]);
+        int low = hexDigit(hex[2*i + 1]);
+        if(high < 0 || low < 0) {
+            return false;
+        }
+        data[i] = (uint8)(high << 4 | low);
+    }
+    return true;
+}
+
+// Connect to the daemon.  Returns -1 if we can't.
+static int connectToDaemon(const char *socketPath) {
+    struct sockaddr_un address;
+    int fd;
+    if(strlen(socketPath) >= sizeof(address.sun_path)) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Socket path too long: %s", socketPath);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    memset(&address, '\0', sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    if(connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to connect to keystretchd at %s", socketPath);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send request, and read replies into reply until one ends with last, such as "\n" for one
+// line, or "end\n" for stats.  Returns false if the daemon can't be reached, or the reply
+// doesn't fit.
+static bool sendRequest(const char *socketPath, const char *request, char *reply, uint32 replySize,
+        const char *last) {
+    uint32 requestLength = strlen(request), lastLength = strlen(last);
+    uint32 sent = 0, received = 0;
+    ssize_t n;
+    int fd = connectToDaemon(socketPath);
+    if(fd < 0) {
+        return false;
+    }
+    while(sent < requestLength) {
+        n = send(fd, request + sent, requestLength - sent, MSG_NOSIGNAL);
+        if(n <= 0) {
+            close(fd);
+            return false;
+        }
+        sent += n;
+    }
+    while(received < lastLength || strcmp(reply + received - lastLength, last)) {
+        if(received + 1 >= replySize) {
+            close(fd);
+            return false;
+        }
+        n = read(fd, reply + received, replySize - received - 1);
+        if(n <= 0) {
+            close(fd);
+            return false;
+        }
+        received += n;
+        reply[received] = '\0';
+    }
+    close(fd);
+    return true;
+}
+
+// Format the fields hash and verify share into line, and return how long it is.  Returns 0
+// if they don't fit.
+static uint32 formatJob(char *line, const char *command, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads) {
+    int length = snprintf(line, KEYSTRETCHD_MAX_LINE, "%s %u %u %llu %u %u ", command, sha256HashRounds,
+        cpuWorkMultiplier, memorySize, pageSize, numThreads);
+    return length > 0 && length < KEYSTRETCHD_MAX_LINE? length : 0;
+}
+
+// Append a number and a space to line.  Returns false if it won't fit.
+static bool appendNumber(char *line, uint32 *length, uint32 value) {
+    int numberLength = snprintf(line + *length, KEYSTRETCHD_MAX_LINE - *length, "%u ", value);
+    if(numberLength <= 0 || *length + numberLength >= KEYSTRETCHD_MAX_LINE) {
+        return false;
+    }
+    *length += numberLength;
+    return true;
+}
+
+// Append size bytes of data in hex to line, followed by end.  Returns false if it won't fit.
+static bool appendHex(char *line, uint32 *length, const void *data, uint32 size, char end) {
+    if(*length + 2ULL*size + 2 > KEYSTRETCHD_MAX_LINE) {
+        return false;
+    }
+    keystretchdWriteHex(data, size, line + *length);
+    *length += 2*size;
+    line[(*length)++] = end;
+    line[*length] = '\0';
+    return true;
+}
+
+// Map a one line reply that isn't a key to a result.
+static KeystretchdResult parseReply(const char *reply) {
+    if(!strcmp(reply, "ok\n")) {
+        return KEYSTRETCHD_OK;
+    }
+    if(!strcmp(reply, "mismatch\n")) {
+        return KEYSTRETCHD_MISMATCH;
+    }
+    if(!strcmp(reply, "busy\n")) {
+        return KEYSTRETCHD_BUSY;
+    }
+    keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "keystretchd: %.*s", (int)strcspn(reply, "\n"), reply);
+    return KEYSTRETCHD_ERROR;
+}
+
+// Hash in the daemon, which writes the key to derivedKey.
+KeystretchdResult keystretchdHash(const char *socketPath, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey, uint32 derivedKeySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword) {
+    char line[KEYSTRETCHD_MAX_LINE], reply[KEYSTRETCHD_MAX_LINE];
+    KeystretchdResult result = KEYSTRETCHD_ERROR;
+    uint32 length = formatJob(line, "hash", sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize,
+        numThreads);
+    if(length != 0 && appendNumber(line, &length, derivedKeySize) &&
+            appendHex(line, &length, salt, saltSize, ' ') && appendHex(line, &length, password, passwordSize, '\n') &&
+            sendRequest(socketPath, line, reply, sizeof(reply), "\n")) {
+        if(!strncmp(reply, "ok ", 3)) {
+            result = keystretchdReadHex(reply + 3, strcspn(reply + 3, "\n"), derivedKey, derivedKeySize)?
+                KEYSTRETCHD_OK : KEYSTRETCHD_ERROR;
+        } else {
+            result = parseReply(reply);
+        }
+    }
+    if(clearPassword) {
+        memset(password, '\0', passwordSize);
+    }
+    memset(line, '\0', sizeof(line));
+    memset(reply, '\0', sizeof(reply));
+    return result;
+}
+
+// Have the daemon check the password gives expectedKey.
+KeystretchdResult keystretchdVerify(const char *socketPath, uint32 sha256HashRounds, uint32 cpuWorkMultiplier,
+        uint64 memorySize, uint32 pageSize, uint32 numThreads, const void *expectedKey, uint32 keySize,
+        const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword) {
+    char line[KEYSTRETCHD_MAX_LINE], reply[KEYSTRETCHD_MAX_LINE];
+    KeystretchdResult result = KEYSTRETCHD_ERROR;
+    uint32 length = formatJob(line, "verify", sha256HashRounds, cpuWorkMultiplier, memorySize, pageSize,
+        numThreads);
+    if(length != 0 && appendHex(line, &length, salt, saltSize, ' ') &&
+            appendHex(line, &length, password, passwordSize, ' ') &&
+            appendHex(line, &length, expectedKey, keySize, '\n') &&
+            sendRequest(socketPath, line, reply, sizeof(reply), "\n")) {
+        result = parseReply(reply);
+    }
+    if(clearPassword) {
+        memset(password, '\0', passwordSize);
+    }
+    memset(line, '\0', sizeof(line));
+    return result;
+}
+
+// Read the daemon's stats.
+bool keystretchdStats(const char *socketPath, char *stats, uint32 statsSize) {
+    return sendRequest(socketPath, "stats\n", stats, statsSize, "end\n");
+}
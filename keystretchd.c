@@ -0,0 +1,717 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// keystretchd serves hash and verify requests from local processes over a Unix socket, so a
+// host has one fixed pool of arenas and threads for password hashing, however many processes
+// want to hash at once.  Jobs run on a KeystretchQueue, whose slots are allocated up front from
+// the memory budget, so the daemon's memory never grows with load.  Jobs beyond the free slots
+// wait in the daemon, up to a limit, and when a bandwidth budget is given, jobs that would
+// wait longer than the longest wait allowed are turned away as busy, rather than pile up.
+//
+// Waiting jobs are kept per user, by the uid of the peer, and started either oldest first, or
+// round robin over the users, so one busy user can't starve the others.  The protocol is in
+// keystretchd.h.  A client may send its next request once it has the reply to the last.  If
+// a client goes away while its job runs, the job is cancelled, and its slot's memory
+// released.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "keystretch.h"
+#include "keystretchd.h"
+
+#define MAX_EVENTS 64
+#define MAX_FIELDS 10
+#define MAX_SALT_SIZE 512
+#define MAX_PASSWORD_SIZE 1024
+#define MAX_KEY_SIZE 1024
+// Latencies are counted in buckets 1/8 of a power of 2 wide, in microseconds.
+#define LATENCY_BUCKETS (62*8)
+
+typedef struct clientStruct *Client;
+typedef struct userStruct *User;
+typedef struct taskStruct *Task;
+
+// A hash or verify request, from when it is read until the reply is sent.
+struct taskStruct {
+    KeystretchJob job;
+    KeystretchRequest request; // NULL until the task is started
+    Client client;
+    User user;
+    Task next;                 // In the user's list of waiting tasks
+    uint64 workSize;           // Bytes of memory to fill, for estimating waits
+    uint64 arrivalTime;
+    uint64 startTime;
+    bool verify;
+    uint8 salt[MAX_SALT_SIZE];
+    uint8 password[MAX_PASSWORD_SIZE];
+    uint8 key[MAX_KEY_SIZE];
+    uint8 expectedKey[MAX_KEY_SIZE];
+};
+
+// A connection.  Only one of its requests is handled at a time, and any it sends meanwhile
+// wait in its input buffer.
+struct clientStruct {
+    int fd;
+    uid_t uid;
+    Task task;   // The request being handled, or NULL
+    bool broken; // A reply could not be sent, so drop the connection
+    bool closed; // Dropped, and freed once its task completes and the events in hand are handled
+    Client nextDead; // In the list of clients to free after this batch of events
+    uint32 inLength;
+    char in[KEYSTRETCHD_MAX_LINE];
+};
+
+// The tasks waiting for a slot, for one uid.
+struct userStruct {
+    uid_t uid;
+    Task first, last;
+    uint32 numWaiting;
+    User next;
+};
+
+// Everything the daemon knows.  Sizes are in bytes, and times in nanoseconds.
+static struct {
+    KeystretchQueue queue;
+    int epollFd, listenFd, signalFd, eventFd;
+    char *socketPath;
+    uint64 maxJobMemory;
+    uint32 maxJobThreads;
+    uint32 numSlots;
+    uint32 maxWaiting;         // Tasks waiting in all
+    uint32 maxWaitingPerUser;
+    uint64 maxWait;            // The longest estimated wait we accept, or 0 for no limit
+    uint64 bandwidth;          // Bytes per second all slots together fill, or 0 if unknown
+    bool fair;                 // Round robin over users rather than oldest first
+    User users;
+    User nextUser;             // Where round robin starts looking
+    uint32 numWaiting, numRunning;
+    uint64 waitingWork, runningWork;
+    uint64 accepted, rejected, completed, failed, cancelled;
+    uint64 totalLatency, maxLatency, totalQueueTime;
+    uint64 latencies[LATENCY_BUCKETS];
+    Client deadClients;        // Closed clients that events in hand may still point to
+} server;
+
+static void usage(char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, (char *)format, ap);
+    va_end(ap);
+    fprintf(stderr, "\nUsage: keystretchd [options] <memory budget> <threads> <max job memory> <max job threads>\n"
+        "    Memory sizes are in MB.  As many jobs run at once as fit in the memory budget and threads.\n"
+        "    -s <socket>        Listen on this socket, rather than " KEYSTRETCHD_SOCKET "\n"
+        "    -q <max waiting>   Jobs that may wait for a slot, 64 by default\n"
+        "    -u <max per user>  Jobs one user may have waiting, the same as -q by default\n"
+        "    -b <bandwidth>     MB per second all the jobs together fill, from keystretch-calibrate\n"
+        "    -w <max wait>      With -b, turn away jobs we expect to finish more than this many ms out\n"
+        "    -f <fifo|fair>     Start the oldest job first, or round robin over users, fifo by default\n");
+    exit(1);
+}
+
+static uint64 getNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+// Return the bucket for a latency in microseconds.
+static uint32 latencyBucket(uint64 micros) {
+    if(micros < 8) {
+        return micros;
+    }
+    uint32 log = 63 - __builtin_clzll(micros);
+    return (log - 2)*8 + ((micros >> (log - 3)) & 7);
+}
+
+// Return the lowest latency above the bucket.
+static uint64 bucketLimit(uint32 bucket) {
+    if(bucket < 8) {
+        return bucket + 1;
+    }
+    return (uint64)(8 + bucket % 8 + 1) << (bucket/8 - 1);
+}
+
+// Return the latency percentile out of 100 of the completed tasks, to within 1/8.  This is
+// the top of the bucket it falls in, but never more than the highest latency we have seen.
+static uint64 latencyPercentile(uint32 percentile) {
+    uint64 total = server.completed + server.failed + server.cancelled;
+    uint64 maxLatency = server.maxLatency/1000;
+    uint64 count = 0;
+    uint32 bucket;
+    for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += server.latencies[bucket];
+        if(count*100 >= total*percentile && count != 0) {
+            uint64 limit = bucketLimit(bucket);
+            return limit < maxLatency? limit : maxLatency;
+        }
+    }
+    return 0;
+}
+
+// Send a reply.  If the client isn't reading them, mark it broken rather than block.
+static void sendReply(Client client, const char *reply) {
+    uint32 length = strlen(reply);
+    if(send(client->fd, reply, length, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)length) {
+        client->broken = true;
+    }
+}
+
+// Reply with the daemon's stats.
+static void sendStats(Client client) {
+    char reply[KEYSTRETCHD_MAX_LINE];
+    uint64 finished = server.completed + server.failed + server.cancelled;
+    snprintf(reply, sizeof(reply), "slots %u\nrunning %u\nwaiting %u\naccepted %llu\nrejected %llu\n"
+        "completed %llu\nfailed %llu\ncancelled %llu\nlatencyMeanUs %llu\nlatencyP50Us %llu\n"
+        "latencyP99Us %llu\nlatencyMaxUs %llu\nqueueTimeMeanUs %llu\nend\n", server.numSlots,
+        server.numRunning, server.numWaiting, server.accepted, server.rejected, server.completed,
+        server.failed, server.cancelled, finished? server.totalLatency/finished/1000 : 0,
+        latencyPercentile(50), latencyPercentile(99), server.maxLatency/1000,
+        finished? server.totalQueueTime/finished/1000 : 0);
+    sendReply(client, reply);
+}
+
+// Find the user with uid, adding it if we haven't seen it.
+static User findUser(uid_t uid) {
+    User user;
+    for(user = server.users; user != NULL; user = user->next) {
+        if(user->uid == uid) {
+            return user;
+        }
+    }
+    user = (User)calloc(1, sizeof(struct userStruct));
+    if(user == NULL) {
+        return NULL;
+    }
+    user->uid = uid;
+    user->next = server.users;
+    server.users = user;
+    return user;
+}
+
+// Wipe and free a task.
+static void freeTask(Task task) {
+    memset(task, '\0', sizeof(struct taskStruct));
+    free(task);
+}
+
+// Take the task off its user's waiting list.
+static void removeWaiting(Task task) {
+    User user = task->user;
+    Task prev = NULL, t;
+    for(t = user->first; t != task; t = t->next) {
+        prev = t;
+    }
+    if(prev == NULL) {
+        user->first = task->next;
+    } else {
+        prev->next = task->next;
+    }
+    if(user->last == task) {
+        user->last = prev;
+    }
+    task->next = NULL;
+    user->numWaiting--;
+    server.numWaiting--;
+    server.waitingWork -= task->workSize;
+}
+
+// Pick the next user to start a task for: the one whose oldest task is oldest, or with
+// fairness, the next one round robin with a task waiting.
+static User nextUser(void) {
+    User user, best = NULL;
+    if(!server.fair) {
+        for(user = server.users; user != NULL; user = user->next) {
+            if(user->first != NULL && (best == NULL || user->first->arrivalTime < best->first->arrivalTime)) {
+                best = user;
+            }
+        }
+        return best;
+    }
+    user = server.nextUser != NULL? server.nextUser : server.users;
+    while(user->first == NULL) {
+        user = user->next != NULL? user->next : server.users;
+    }
+    server.nextUser = user->next;
+    return user;
+}
+
+// Start waiting tasks on free slots.
+static void startTasks(void) {
+    Task task;
+    while(server.numRunning < server.numSlots && server.numWaiting != 0) {
+        task = nextUser()->first;
+        removeWaiting(task);
+        task->startTime = getNanoseconds();
+        task->request = keystretchSubmit(server.queue, &task->job, true, true, NULL, task);
+        if(task->request == NULL) {
+            sendReply(task->client, "error unable to start job\n");
+            task->client->task = NULL;
+            freeTask(task);
+            continue;
+        }
+        server.numRunning++;
+        server.runningWork += task->workSize;
+    }
+}
+
+// Read an unsigned number.  Returns false if field is not one.
+static bool readNumber(const char *field, uint64 *value) {
+    char *end;
+    if(*field < '0' || *field > '9') {
+        return false;
+    }
+    errno = 0;
+    *value = strtoull(field, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
+// Return true if value is a power of 2.
+static bool isPowerOfTwo(uint64 value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Fill in task from the fields of a hash or verify request.  Returns what is wrong with it, or
+// NULL if nothing is.
+static char *readTask(Task task, char **fields, uint32 numFields) {
+    KeystretchJob *job = &task->job;
+    uint64 values[5], keySize;
+    uint32 i, first = 6;
+    if(numFields != 9) {
+        return "wrong number of fields";
+    }
+    for(i = 0; i < 5; i++) {
+        // Only the memory size, the third, may be more than 32 bits
+        if(!readNumber(fields[i + 1], values + i) || (i != 2 && values[i] > 0xffffffffULL)) {
+            return "invalid number";
+        }
+    }
+    if(!task->verify) {
+        if(!readNumber(fields[6], &keySize)) {
+            return "invalid number";
+        }
+        first = 7;
+    } else {
+        keySize = strlen(fields[8])/2;
+    }
+    job->sha256HashRounds = values[0];
+    job->cpuWorkMultiplier = values[1];
+    job->memorySize = values[2];
+    job->pageSize = values[3];
+    job->numThreads = values[4];
+    job->saltSize = strlen(fields[first])/2;
+    job->passwordSize = strlen(fields[first + 1])/2;
+    if(job->sha256HashRounds == 0 || job->cpuWorkMultiplier == 0) {
+        return "invalid work factors";
+    }
+    if(job->memorySize > server.maxJobMemory || job->numThreads == 0 || job->numThreads > server.maxJobThreads) {
+        return "job is larger than the daemon allows";
+    }
+    if(!isPowerOfTwo(job->pageSize) || job->pageSize < 1024 || job->memorySize/job->pageSize <= MAX_THREADS) {
+        return "invalid page size";
+    }
+    if(!isPowerOfTwo(keySize) || keySize > MAX_KEY_SIZE) {
+        return "invalid key size";
+    }
+    job->derivedKeySize = keySize;
+    if(job->saltSize == 0 || job->saltSize > MAX_SALT_SIZE ||
+            !keystretchdReadHex(fields[first], strlen(fields[first]), task->salt, job->saltSize)) {
+        return "invalid salt";
+    }
+    if(job->passwordSize == 0 || job->passwordSize > MAX_PASSWORD_SIZE ||
+            !keystretchdReadHex(fields[first + 1], strlen(fields[first + 1]), task->password, job->passwordSize)) {
+        return "invalid password";
+    }
+    if(task->verify && !keystretchdReadHex(fields[8], strlen(fields[8]), task->expectedKey, keySize)) {
+        return "invalid key";
+    }
+    job->salt = task->salt;
+    job->password = task->password;
+    job->derivedKey = task->key;
+    task->workSize = job->memorySize*job->cpuWorkMultiplier;
+    return NULL;
+}
+
+// Return true if we can take the task: there is room for it to wait, and with a bandwidth
+// budget, we expect it to finish in time.
+static bool admit(Task task) {
+    if(server.numWaiting >= server.maxWaiting || task->user->numWaiting >= server.maxWaitingPerUser) {
+        return false;
+    }
+    if(server.bandwidth != 0 && server.maxWait != 0) {
+        uint64 work = server.waitingWork + server.runningWork + task->workSize;
+        if((double)work/server.bandwidth*1.0e9 > server.maxWait) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Handle one request line from the client.
+static void handleLine(Client client, char *line) {
+    char *fields[MAX_FIELDS], *save = NULL, *field, *problem;
+    uint32 numFields = 0;
+    for(field = strtok_r(line, " \r", &save); field != NULL; field = strtok_r(NULL, " \r", &save)) {
+        if(numFields == MAX_FIELDS) {
+            sendReply(client, "error too many fields\n");
+            return;
+        }
+        fields[numFields++] = field;
+    }
+    if(numFields == 1 && !strcmp(fields[0], "stats")) {
+        sendStats(client);
+        return;
+    }
+    if(numFields == 0 || (strcmp(fields[0], "hash") && strcmp(fields[0], "verify"))) {
+        sendReply(client, "error unknown request\n");
+        return;
+    }
+    Task task = (Task)calloc(1, sizeof(struct taskStruct));
+    if(task == NULL) {
+        sendReply(client, "error out of memory\n");
+        return;
+    }
+    task->verify = !strcmp(fields[0], "verify");
+    task->client = client;
+    task->user = findUser(client->uid);
+    task->arrivalTime = getNanoseconds();
+    problem = readTask(task, fields, numFields);
+    if(problem != NULL || task->user == NULL) {
+        char reply[256];
+        snprintf(reply, sizeof(reply), "error %s\n", problem != NULL? problem : "out of memory");
+        sendReply(client, reply);
+        freeTask(task);
+        return;
+    }
+    if(!admit(task)) {
+        server.rejected++;
+        sendReply(client, "busy\n");
+        freeTask(task);
+        return;
+    }
+    server.accepted++;
+    User user = task->user;
+    if(user->last == NULL) {
+        user->first = task;
+    } else {
+        user->last->next = task;
+    }
+    user->last = task;
+    user->numWaiting++;
+    server.numWaiting++;
+    server.waitingWork += task->workSize;
+    client->task = task;
+    startTasks();
+}
+
+// Handle the complete lines in the client's input, until it has a task running.
+static void handleInput(Client client) {
+    char *newline;
+    uint32 lineLength;
+    while(client->task == NULL && !client->broken && (newline = memchr(client->in, '\n', client->inLength)) != NULL) {
+        *newline = '\0';
+        lineLength = newline - client->in + 1;
+        handleLine(client, client->in);
+        memset(client->in, '\0', lineLength); // It may hold a password
+        memmove(client->in, client->in + lineLength, client->inLength - lineLength);
+        client->inLength -= lineLength;
+        memset(client->in + client->inLength, '\0', lineLength);
+    }
+    if(client->inLength == sizeof(client->in)) {
+        sendReply(client, "error line too long\n");
+        client->broken = true;
+    }
+}
+
+// Free the client once the events epoll_wait returned have all been handled, since later ones
+// may still point to it.
+static void freeClientLater(Client client) {
+    client->nextDead = server.deadClients;
+    server.deadClients = client;
+}
+
+static void freeDeadClients(void) {
+    Client client;
+    while((client = server.deadClients) != NULL) {
+        server.deadClients = client->nextDead;
+        free(client);
+    }
+}
+
+// Close the client's connection.  If its task is running, cancel it, and free the client
+// when the task completes.
+static void dropClient(Client client) {
+    Task task = client->task;
+    epoll_ctl(server.epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    memset(client->in, '\0', sizeof(client->in));
+    client->closed = true;
+    if(task != NULL && task->request != NULL) {
+        keystretchCancel(task->request);
+        return;
+    }
+    if(task != NULL) {
+        removeWaiting(task);
+        freeTask(task);
+    }
+    freeClientLater(client);
+}
+
+// Read from the client, and handle any requests it completes.
+static void readClient(Client client) {
+    if(client->closed) {
+        return; // Dropped while handling an earlier event of this batch
+    }
+    ssize_t n = read(client->fd, client->in + client->inLength, sizeof(client->in) - client->inLength);
+    if(n <= 0) {
+        if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        dropClient(client);
+        return;
+    }
+    client->inLength += n;
+    handleInput(client);
+    if(client->broken) {
+        dropClient(client);
+    }
+}
+
+// Record how long the task took, from when it was read to now.
+static void recordLatency(Task task) {
+    uint64 now = getNanoseconds();
+    uint64 latency = now - task->arrivalTime;
+    uint32 bucket = latencyBucket(latency/1000);
+    server.totalLatency += latency;
+    server.totalQueueTime += task->startTime - task->arrivalTime;
+    if(latency > server.maxLatency) {
+        server.maxLatency = latency;
+    }
+    server.latencies[bucket < LATENCY_BUCKETS? bucket : LATENCY_BUCKETS - 1]++;
+}
+
+// Compare keys in time that does not depend on where they differ.
+static bool keysMatch(const uint8 *a, const uint8 *b, uint32 size) {
+    uint8 difference = 0;
+    uint32 i;
+    for(i = 0; i < size; i++) {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
+// Reply to the client of a task that has completed.
+static void replyToTask(Task task, bool succeeded) {
+    char reply[2*MAX_KEY_SIZE + 8];
+    KeystretchJob *job = &task->job;
+    if(!succeeded) {
+        sendReply(task->client, "error hashing failed\n");
+    } else if(task->verify) {
+        sendReply(task->client, keysMatch(task->key, task->expectedKey, job->derivedKeySize)? "ok\n" : "mismatch\n");
+    } else {
+        strcpy(reply, "ok ");
+        keystretchdWriteHex(task->key, job->derivedKeySize, reply + 3);
+        strcat(reply, "\n");
+        sendReply(task->client, reply);
+        memset(reply, '\0', sizeof(reply));
+    }
+}
+
+// Reply to the tasks that have completed, and start more.
+static void completeTasks(void) {
+    KeystretchRequest request;
+    uint64 count;
+    if(read(server.eventFd, &count, sizeof(count)) != sizeof(count)) {
+        // Nothing new: another wakeup already took them
+    }
+    while((request = keystretchNextCompleted(server.queue)) != NULL) {
+        Task task = (Task)keystretchRequestUserData(request);
+        Client client = task->client;
+        bool cancelled = keystretchCancelled(request);
+        bool succeeded = keystretchFinish(request);
+        server.numRunning--;
+        server.runningWork -= task->workSize;
+        if(cancelled) {
+            server.cancelled++;
+        } else if(succeeded) {
+            server.completed++;
+        } else {
+            server.failed++;
+        }
+        recordLatency(task);
+        client->task = NULL;
+        if(client->closed) {
+            freeClientLater(client);
+        } else {
+            replyToTask(task, succeeded);
+            handleInput(client);
+            if(client->broken) {
+                dropClient(client);
+            }
+        }
+        freeTask(task);
+    }
+    startTasks();
+}
+
+// Accept a new connection, and note whose it is.
+static void acceptClient(void) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    struct epoll_event event;
+    int fd = accept4(server.listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+    Client client = (Client)calloc(1, sizeof(struct clientStruct));
+    if(client == NULL || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+        free(client);
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->uid = credentials.uid;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    if(epoll_ctl(server.epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        free(client);
+        close(fd);
+    }
+}
+
+// Add fd to epoll, with data.ptr pointing at fd itself, so we can tell it from clients.
+static void watch(int *fd) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = fd;
+    if(epoll_ctl(server.epollFd, EPOLL_CTL_ADD, *fd, &event) != 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+// Listen on the socket, replacing any left by an earlier run.
+static int listenOn(const char *socketPath) {
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0 || strlen(socketPath) >= sizeof(address.sun_path)) {
+        usage("Unable to create socket %s", socketPath);
+    }
+    memset(&address, '\0', sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        usage("Unable to listen on %s: %s", socketPath, strerror(errno));
+    }
+    return fd;
+}
+
+// Serve requests until SIGINT or SIGTERM.
+static void serve(void) {
+    struct epoll_event events[MAX_EVENTS];
+    int numEvents, i;
+    while(true) {
+        numEvents = epoll_wait(server.epollFd, events, MAX_EVENTS, -1);
+        if(numEvents < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return;
+        }
+        for(i = 0; i < numEvents; i++) {
+            void *ptr = events[i].data.ptr;
+            if(ptr == &server.signalFd) {
+                return;
+            } else if(ptr == &server.listenFd) {
+                acceptClient();
+            } else if(ptr == &server.eventFd) {
+                completeTasks();
+            } else {
+                readClient((Client)ptr);
+            }
+        }
+        freeDeadClients();
+    }
+}
+
+static uint32 readUint32(char *value, char *name) {
+    uint64 number;
+    if(!readNumber(value, &number) || number > 0xffffffffULL) {
+        usage("Invalid %s: %s", name, value);
+    }
+    return (uint32)number;
+}
+
+int main(int argc, char **argv) {
+    sigset_t signals;
+    int option;
+    keystretchSetLog(keystretchLogStdio, NULL);
+    server.socketPath = KEYSTRETCHD_SOCKET;
+    server.maxWaiting = 64;
+    while((option = getopt(argc, argv, "s:q:u:b:w:f:")) != -1) {
+        switch(option) {
+        case 's': server.socketPath = optarg; break;
+        case 'q': server.maxWaiting = readUint32(optarg, "max waiting"); break;
+        case 'u': server.maxWaitingPerUser = readUint32(optarg, "max per user"); break;
+        case 'b': server.bandwidth = readUint32(optarg, "bandwidth")*(1ULL << 20); break;
+        case 'w': server.maxWait = readUint32(optarg, "max wait")*1000000ULL; break;
+        case 'f':
+            if(strcmp(optarg, "fifo") && strcmp(optarg, "fair")) {
+                usage("Fairness must be fifo or fair");
+            }
+            server.fair = !strcmp(optarg, "fair");
+            break;
+        default: usage("Unknown option");
+        }
+    }
+    if(argc - optind != 4) {
+        usage("Incorrect number of arguments");
+    }
+    if(server.maxWaitingPerUser == 0 || server.maxWaitingPerUser > server.maxWaiting) {
+        server.maxWaitingPerUser = server.maxWaiting;
+    }
+    uint64 memoryBudget = readUint32(argv[optind], "memory budget")*(1ULL << 20);
+    uint32 threads = readUint32(argv[optind + 1], "threads");
+    server.maxJobMemory = readUint32(argv[optind + 2], "max job memory")*(1ULL << 20);
+    server.maxJobThreads = readUint32(argv[optind + 3], "max job threads");
+    // Block the signals before the queue starts its threads, so they inherit the mask, and
+    // the signals only ever come through signalFd.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    server.signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if(server.signalFd < 0) {
+        usage("Unable to create signalfd: %s", strerror(errno));
+    }
+    server.queue = keystretchCreateQueue(memoryBudget, threads, server.maxJobMemory, server.maxJobThreads);
+    if(server.queue == NULL) {
+        usage("Unable to create the job queue");
+    }
+    server.numSlots = keystretchQueueSlots(server.queue);
+    server.eventFd = keystretchQueueEventFd(server.queue);
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(server.epollFd < 0) {
+        usage("Unable to create epoll instance: %s", strerror(errno));
+    }
+    server.listenFd = listenOn(server.socketPath);
+    watch(&server.signalFd);
+    watch(&server.listenFd);
+    watch(&server.eventFd);
+    printf("keystretchd: %u slots of %lluMB and %u threads on %s\n", server.numSlots, server.maxJobMemory >> 20,
+        server.maxJobThreads, server.socketPath);
+    fflush(stdout);
+    serve();
+    unlink(server.socketPath);
+    keystretchDestroyQueue(server.queue);
+    return 0;
+}
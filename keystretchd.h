@@ -0,0 +1,50 @@
+// The client side of keystretchd, the local hashing daemon.  Rather than each process
+// allocating gigabytes to call keystretch() itself, which can run a host out of memory when
+// many logins come at once, processes send hash and verify requests to the daemon over a Unix
+// socket, and it runs them within its memory and bandwidth budget.
+//
+// The protocol is one line per request, and one line per reply, with binary values in hex:
+//
+//     hash <sha256 rounds> <cpu work multiplier> <memory size> <page size> <threads> <key size> <salt> <password>
+//     verify <sha256 rounds> <cpu work multiplier> <memory size> <page size> <threads> <salt> <password> <key>
+//     stats
+//
+// Sizes are in bytes.  hash replies "ok <key>", and verify replies "ok" or "mismatch", so the
+// key never leaves the daemon.  Either may reply "busy" if the daemon won't take the job, or
+// "error <reason>".  stats replies with "name value" lines, then "end".
+
+#ifndef KEYSTRETCHD_H
+#define KEYSTRETCHD_H
+
+#include "keystretch.h"
+
+#define KEYSTRETCHD_SOCKET "/run/keystretchd.sock"
+#define KEYSTRETCHD_MAX_LINE 4096
+
+typedef enum {
+    KEYSTRETCHD_OK,
+    KEYSTRETCHD_MISMATCH, // Only from keystretchdVerify
+    KEYSTRETCHD_BUSY,     // The daemon is over budget, so try again later
+    KEYSTRETCHD_ERROR     // Bad parameters, or we could not talk to the daemon
+} KeystretchdResult;
+
+// Hash like keystretch(), but in the daemon at socketPath.
+KEYSTRETCH_API KeystretchdResult keystretchdHash(const char *socketPath, uint32 sha256HashRounds,
+        uint32 cpuWorkMultiplier, uint64 memorySize, uint32 pageSize, uint32 numThreads, void *derivedKey,
+        uint32 derivedKeySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize,
+        bool clearPassword);
+
+// Have the daemon hash the password, and check it gives expectedKey.
+KEYSTRETCH_API KeystretchdResult keystretchdVerify(const char *socketPath, uint32 sha256HashRounds,
+        uint32 cpuWorkMultiplier, uint64 memorySize, uint32 pageSize, uint32 numThreads, const void *expectedKey,
+        uint32 keySize, const void *salt, uint32 saltSize, void *password, uint32 passwordSize, bool clearPassword);
+
+// Read the daemon's stats into stats, as "name value" lines.
+KEYSTRETCH_API bool keystretchdStats(const char *socketPath, char *stats, uint32 statsSize);
+
+// Hex helpers shared by the daemon and client, and not exported from the library.
+// keystretchdReadHex returns false unless hex is exactly 2*size hex digits.
+void keystretchdWriteHex(const uint8 *data, uint32 size, char *hex);
+bool keystretchdReadHex(const char *hex, uint32 hexLength, uint8 *data, uint32 size);
+
+#endif
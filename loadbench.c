@@ -0,0 +1,318 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// loadbench simulates a login server, to see how keystretch behaves when many hashes overlap
+// and compete for memory bandwidth, which timing one hash at a time hides.  Concurrent client
+// threads call keystretch() or PHS(), either closed loop, where each starts its next hash as
+// soon as the last is done, or open loop, where hashes arrive at random at a set average rate
+// whether or not earlier ones are done.  In open loop mode latency is counted from when the
+// hash arrived, so time spent waiting for a free client counts, as it would for a real login.
+// We report the latency percentiles, throughput and peak RSS.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "keystretch.h"
+
+#define MAX_CLIENTS 1024
+#define KEY_SIZE 32
+#define SALT_SIZE 16
+// Latencies are counted in buckets 1/8 of a power of 2 wide, in microseconds.
+#define LATENCY_BUCKETS (62*8)
+
+// The call each hash goes through.
+typedef enum {
+    API_KEYSTRETCH, // keystretch() with freeMemory set, so each call maps its own memory
+    API_SHARED,     // keystretch() with freeMemory false, so calls share one context
+    API_PHS         // PHS(), which shares that context too
+} Api;
+
+static const char *apiNames[] = {"keystretch", "shared", "phs"};
+
+typedef struct loadStruct *Load;
+
+// The load to generate, and what we measured.
+struct loadStruct {
+    pthread_mutex_t lock;
+    Api api;
+    uint32 sha256Rounds;
+    uint32 cpuWorkMultiplier;
+    uint64 memorySize;
+    uint32 pageSize;
+    uint32 numThreads;
+    uint32 numClients;
+    double rate;          // Hashes per second in open loop mode, or 0 for closed loop
+    uint64 numRequests;   // Stop after this many hashes
+    uint64 endTime;       // Or when this time comes, if not 0
+    uint64 random;        // Xorshift state for arrival times
+    uint64 issued;
+    double nextArrival;   // In nanoseconds, open loop only
+    uint64 completed;
+    uint64 failed;
+    uint64 totalLatency;
+    uint64 maxLatency;
+    uint64 latencies[LATENCY_BUCKETS];
+};
+
+static uint64 getNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+// Sleep until the given time.
+static void sleepUntil(uint64 time) {
+    struct timespec until;
+    until.tv_sec = time/1000000000ULL;
+    until.tv_nsec = time%1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+// Return the bucket for a latency in microseconds.
+static uint32 latencyBucket(uint64 micros) {
+    if(micros < 8) {
+        return micros;
+    }
+    uint32 log = 63 - __builtin_clzll(micros);
+    return (log - 2)*8 + ((micros >> (log - 3)) & 7);
+}
+
+// Return the lowest latency above the bucket.
+static uint64 bucketLimit(uint32 bucket) {
+    if(bucket < 8) {
+        return bucket + 1;
+    }
+    return (uint64)(8 + bucket % 8 + 1) << (bucket/8 - 1);
+}
+
+// Return the latency in microseconds below which perMille out of 1000 hashes finished, to
+// within 1/8.
+static uint64 latencyPercentile(Load load, uint32 perMille) {
+    uint64 total = load->completed + load->failed;
+    uint64 count = 0;
+    uint32 bucket;
+    for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        count += load->latencies[bucket];
+        if(count*1000 >= total*perMille && count != 0) {
+            return bucketLimit(bucket);
+        }
+    }
+    return 0;
+}
+
+// Return a random time until the next arrival, in nanoseconds, exponentially distributed so
+// arrivals form a Poisson process.
+static double nextInterval(Load load) {
+    load->random ^= load->random << 13;
+    load->random ^= load->random >> 7;
+    load->random ^= load->random << 17;
+    double uniform = ((load->random >> 11) + 0.5)/(double)(1ULL << 53);
+    return -log(uniform)*1.0e9/load->rate;
+}
+
+// Take the next hash to do, and the time it arrives.  Returns false when we are done.
+static bool takeRequest(Load load, uint64 *requestNum, uint64 *arrival) {
+    bool taken = false;
+    pthread_mutex_lock(&load->lock);
+    if(load->issued < load->numRequests) {
+        *arrival = load->rate > 0.0? (uint64)load->nextArrival : getNanoseconds();
+        if(load->endTime == 0 || *arrival < load->endTime) {
+            *requestNum = load->issued++;
+            if(load->rate > 0.0) {
+                load->nextArrival += nextInterval(load);
+            }
+            taken = true;
+        }
+    }
+    pthread_mutex_unlock(&load->lock);
+    return taken;
+}
+
+// Record how long a hash took, from when it arrived to now.
+static void recordLatency(Load load, uint64 arrival, bool hashed) {
+    uint64 latency = getNanoseconds() - arrival;
+    uint32 bucket = latencyBucket(latency/1000);
+    pthread_mutex_lock(&load->lock);
+    if(hashed) {
+        load->completed++;
+    } else {
+        load->failed++;
+    }
+    load->totalLatency += latency;
+    if(latency > load->maxLatency) {
+        load->maxLatency = latency;
+    }
+    load->latencies[bucket < LATENCY_BUCKETS? bucket : LATENCY_BUCKETS - 1]++;
+    pthread_mutex_unlock(&load->lock);
+}
+
+// Hash a made up password for request requestNum.
+static bool hashOnce(Load load, uint64 requestNum) {
+    uint8 key[KEY_SIZE];
+    uint8 salt[SALT_SIZE];
+    char password[32];
+    uint32 passwordSize = snprintf(password, sizeof(password), "password%llu", requestNum);
+    memset(salt, 0x5a, SALT_SIZE);
+    switch(load->api) {
+    case API_KEYSTRETCH:
+    case API_SHARED:
+        return keystretch(load->sha256Rounds, load->cpuWorkMultiplier, load->memorySize, load->pageSize,
+            load->numThreads, key, KEY_SIZE, salt, SALT_SIZE, password, passwordSize, true, true,
+            load->api == API_KEYSTRETCH);
+    case API_PHS:
+        return PHS(key, KEY_SIZE, password, passwordSize, salt, SALT_SIZE, load->cpuWorkMultiplier,
+            load->memorySize) != 0;
+    }
+    return false;
+}
+
+// A client thread, which hashes until there are no more requests.
+static void *runClient(void *arg) {
+    Load load = (Load)arg;
+    uint64 requestNum, arrival;
+    while(takeRequest(load, &requestNum, &arrival)) {
+        if(load->rate > 0.0) {
+            sleepUntil(arrival);
+        }
+        recordLatency(load, arrival, hashOnce(load, requestNum));
+    }
+    return NULL;
+}
+
+// Write the results as JSON, with the label the caller gave this run, such as a commit id.
+static bool writeJson(const char *path, const char *label, Load load, double elapsed, uint64 peakRss) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Unable to write %s\n", path);
+        return false;
+    }
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"api\": \"%s\",\n  \"mode\": \"%s\",\n", label, apiNames[load->api],
+        load->rate > 0.0? "open" : "closed");
+    fprintf(file, "  \"rate\": %.3f,\n  \"clients\": %u,\n  \"memorySize\": %llu,\n  \"pageSize\": %u,\n"
+        "  \"threads\": %u,\n", load->rate, load->numClients, load->memorySize, load->pageSize, load->numThreads);
+    fprintf(file, "  \"completed\": %llu,\n  \"failed\": %llu,\n  \"seconds\": %.3f,\n  \"throughput\": %.3f,\n",
+        load->completed, load->failed, elapsed, load->completed/elapsed);
+    fprintf(file, "  \"latencyMs\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f},\n",
+        latencyPercentile(load, 500)/1.0e3, latencyPercentile(load, 900)/1.0e3, latencyPercentile(load, 990)/1.0e3,
+        latencyPercentile(load, 999)/1.0e3, load->maxLatency/1.0e6);
+    fprintf(file, "  \"peakRss\": %llu\n}\n", peakRss);
+    return fclose(file) == 0;
+}
+
+// Show the library's errors and warnings, but not what it logs for each hash.
+static void logProblems(KeystretchLogLevel level, const char *message, void *userData) {
+    if(level != KEYSTRETCH_LOG_INFO) {
+        keystretchLogStdio(level, message, userData);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: loadbench [-a keystretch|shared|phs] [-c clients] [-r hashes per second]\n"
+        "                 [-n hashes] [-d seconds] [-m memory size in MB] [-p page size] [-t threads]\n"
+        "                 [-s sha256 rounds] [-w cpu work multiplier] [-j JSON output file] [-l label]\n"
+        "Without -r, each client starts its next hash as soon as the last is done.\n");
+    exit(1);
+}
+
+static uint64 readNumber(const char *text) {
+    char *end;
+    uint64 value = strtoull(text, &end, 10);
+    if(*text == '\0' || *end != '\0') {
+        usage();
+    }
+    return value;
+}
+
+int main(int argc, char **argv) {
+    static pthread_t clients[MAX_CLIENTS];
+    struct loadStruct load;
+    const char *jsonPath = NULL, *label = "";
+    uint64 seconds = 0;
+    bool countGiven = false;
+    uint32 i;
+    int option;
+    keystretchSetLog(logProblems, NULL);
+    memset(&load, '\0', sizeof(load));
+    pthread_mutex_init(&load.lock, NULL);
+    load.api = API_KEYSTRETCH;
+    load.sha256Rounds = 4096;
+    load.cpuWorkMultiplier = 1;
+    load.memorySize = 16ULL << 20;
+    load.pageSize = 16 << 10;
+    load.numThreads = 1;
+    load.numClients = 16;
+    load.numRequests = 256;
+    load.random = 0x9e3779b97f4a7c15ULL;
+    while((option = getopt(argc, argv, "a:c:r:n:d:m:p:t:s:w:j:l:")) != -1) {
+        switch(option) {
+        case 'a':
+            for(load.api = API_KEYSTRETCH; load.api <= API_PHS && strcmp(optarg, apiNames[load.api]); load.api++);
+            if(load.api > API_PHS) {
+                usage();
+            }
+            break;
+        case 'c': load.numClients = readNumber(optarg); break;
+        case 'r': load.rate = atof(optarg); break;
+        case 'n': load.numRequests = readNumber(optarg); countGiven = true; break;
+        case 'd': seconds = readNumber(optarg); break;
+        case 'm': load.memorySize = readNumber(optarg) << 20; break;
+        case 'p': load.pageSize = readNumber(optarg); break;
+        case 't': load.numThreads = readNumber(optarg); break;
+        case 's': load.sha256Rounds = readNumber(optarg); break;
+        case 'w': load.cpuWorkMultiplier = readNumber(optarg); break;
+        case 'j': jsonPath = optarg; break;
+        case 'l': label = optarg; break;
+        default: usage();
+        }
+    }
+    if(optind != argc || load.numClients == 0 || load.numClients > MAX_CLIENTS || load.rate < 0.0) {
+        usage();
+    }
+    if(seconds != 0 && !countGiven) {
+        load.numRequests = ~0ULL; // A duration alone sets how long we run
+    }
+
+    uint64 start = getNanoseconds();
+    load.nextArrival = start;
+    if(seconds != 0) {
+        load.endTime = start + seconds*1000000000ULL;
+    }
+    uint32 numStarted = 0;
+    for(i = 0; i < load.numClients; i++) {
+        if(pthread_create(clients + i, NULL, runClient, &load) != 0) {
+            fprintf(stderr, "Unable to start client %u, running with %u\n", i, numStarted);
+            break;
+        }
+        numStarted++;
+    }
+    load.numClients = numStarted;
+    for(i = 0; i < numStarted; i++) {
+        pthread_join(clients[i], NULL);
+    }
+    double elapsed = (getNanoseconds() - start)*1.0e-9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64 peakRss = (uint64)usage.ru_maxrss << 10;
+
+    uint64 numHashed = load.completed + load.failed;
+    printf("\napi:%s mode:%s rate:%.1f/s clients:%u memorySize:%llu pageSize:%u numThreads:%u\n",
+        apiNames[load.api], load.rate > 0.0? "open" : "closed", load.rate, load.numClients, load.memorySize,
+        load.pageSize, load.numThreads);
+    printf("completed:%llu failed:%llu seconds:%.3f throughput:%.2f/s\n", load.completed, load.failed, elapsed,
+        load.completed/elapsed);
+    printf("latency p50:%.2fms p90:%.2fms p99:%.2fms p999:%.2fms max:%.2fms mean:%.2fms\n",
+        latencyPercentile(&load, 500)/1.0e3, latencyPercentile(&load, 900)/1.0e3,
+        latencyPercentile(&load, 990)/1.0e3, latencyPercentile(&load, 999)/1.0e3, load.maxLatency/1.0e6,
+        numHashed == 0? 0.0 : load.totalLatency/1.0e6/numHashed);
+    printf("peakRss:%lluMB\n", peakRss >> 20);
+    if(jsonPath != NULL && !writeJson(jsonPath, label, &load, elapsed, peakRss)) {
+        return 1;
+    }
+    return load.failed == 0? 0 : 1;
+}
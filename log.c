@@ -0,0 +1,40 @@
+// This file is released into the public domain, like the rest of keystretch.
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "log.h"
+
+#define MAX_MESSAGE_SIZE 512
+
+// The hook and its user data.  They are meant to be set once, before hashing, but are read
+// atomically, since workers may log at any time.
+static KeystretchLog logHook;
+static void *logUserData;
+
+// Send the library's diagnostics to log, or drop them if log is NULL.
+void keystretchSetLog(KeystretchLog log, void *userData) {
+    __atomic_store_n(&logUserData, userData, __ATOMIC_RELAXED);
+    __atomic_store_n(&logHook, log, __ATOMIC_RELEASE);
+}
+
+// A hook for command line tools: errors and warnings go to stderr, and the rest to stdout.
+void keystretchLogStdio(KeystretchLogLevel level, const char *message, void *userData) {
+    fprintf(level == KEYSTRETCH_LOG_INFO? stdout : stderr, "%s\n", message);
+}
+
+bool keystretchLogEnabled(void) {
+    return __atomic_load_n(&logHook, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void keystretchLogMessage(KeystretchLogLevel level, const char *format, ...) {
+    KeystretchLog log = __atomic_load_n(&logHook, __ATOMIC_ACQUIRE);
+    char message[MAX_MESSAGE_SIZE];
+    va_list ap;
+    if(log == NULL) {
+        return;
+    }
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    log(level, message, __atomic_load_n(&logUserData, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,16 @@
+// Diagnostics from inside the library go through here to the hook set with keystretchSetLog.
+// With no hook set, nothing is formatted or written, so the hashing path never touches stdio.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include "keystretch.h"
+
+// Format a message, printf style, without a trailing newline, and pass it to the hook.
+void keystretchLogMessage(KeystretchLogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Return true if a hook is set, for callers that build a message in pieces.
+bool keystretchLogEnabled(void);
+
+#endif
@@ -0,0 +1,366 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// membench measures how close keystretch gets to the roofline of the machine it runs on.  For
+// each memory size and thread count, it times the raw memory bandwidth: memmove, which reads
+// and writes every byte once like the fill does, streaming non-temporal writes, and reading
+// whole pages at random, as the fill reads its from pages.  For each page size it also times
+// the fill kernel on pages that stay in cache, which is the most the CPU can do.  Then it
+// times keystretch's own fill bandwidth with keystretchSetStats.  The roofline is the lower of
+// memmove and the in-cache fill, and we report what fraction of it keystretch reaches.  Random
+// page reads are not part of it: the fill only reads pages it has already written, and early
+// on those fit in cache, so it can beat reading the whole arena at random.  All rates are bytes
+// of pages written, or read for random reads, per second.  With -j, the results are also
+// written as JSON, for comparing runs across commits.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "fillpage.h"
+#include "pool.h"
+
+#define MIN_SECONDS 0.25
+#define KEYSTRETCH_REPEATS 3
+#define IN_CACHE_FILLS 256
+#define MIN_PAGE_SIZE 1024 // keystretchHash needs 8 words per lane
+#define MAX_LIST 16
+#define DEFAULT_MEMORY_SIZES "64,256,1024"
+#define DEFAULT_PAGE_SIZES "4096,16384,65536"
+
+typedef struct benchStruct *Bench;
+
+// What a pool job needs to measure one thing on numThreads threads.
+struct benchStruct {
+    Arena arena;
+    uint64 size;        // Bytes of the arena to use
+    uint32 numThreads;
+    uint32 pageLength;
+    FillKernel kernel;
+    uint64 sinks[MAX_THREADS]; // Sums of what we read, so the reads are not optimized away
+};
+
+typedef struct resultStruct *Result;
+
+// What we measured for one memory size, page size and thread count, in bytes per second.
+struct resultStruct {
+    uint64 memorySize;
+    uint32 pageSize;
+    uint32 numThreads;
+    ArenaBacking backing;
+    double memmoveRate;
+    double writeRate;
+    double readRate;
+    double inCacheRate;
+    double fillRate;
+    double roofline;
+};
+
+static double getSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1.0e-9;
+}
+
+// Return the byte range of the arena thread index works on, 64 byte aligned.
+static void threadRange(Bench bench, uint32 index, uint64 *start, uint64 *end) {
+    *start = bench->size/bench->numThreads*index & ~63ULL;
+    *end = bench->size/bench->numThreads*(index + 1) & ~63ULL;
+}
+
+// Move each thread's part of the arena down by a cache line.
+static void memmoveJob(void *arg, uint32 index) {
+    Bench bench = (Bench)arg;
+    uint64 start, end;
+    threadRange(bench, index, &start, &end);
+    uint8 *mem = (uint8 *)bench->arena->mem;
+    memmove(mem + start, mem + start + 64, end - start - 64);
+}
+
+// Write each thread's part of the arena with non-temporal stores.
+static void writeJob(void *arg, uint32 index) {
+    Bench bench = (Bench)arg;
+    uint64 start, end;
+    threadRange(bench, index, &start, &end);
+    keystretchArenaWipe(bench->arena, start, end);
+}
+
+// Read the thread's share of the arena as whole pages picked at random from all of it.
+static void readJob(void *arg, uint32 index) {
+    Bench bench = (Bench)arg;
+    uint64 numPages = bench->size/(bench->pageLength*sizeof(uint64));
+    uint64 pagesToRead = numPages/bench->numThreads;
+    uint64 random = 0x9e3779b97f4a7c15ULL*(index + 1);
+    uint64 sum = 0;
+    uint64 i;
+    uint32 j;
+    for(i = 0; i < pagesToRead; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        const uint64 *page = bench->arena->mem + random%numPages*bench->pageLength;
+        for(j = 0; j < bench->pageLength; j++) {
+            sum += page[j];
+        }
+    }
+    bench->sinks[index] = sum;
+}
+
+// Fill a group of pages over and over on each thread, from and to its own few pages, which
+// stay in cache.
+static void inCacheJob(void *arg, uint32 index) {
+    Bench bench = (Bench)arg;
+    uint32 width = bench->kernel->width;
+    uint32 pageLength = bench->pageLength;
+    struct laneStateStruct states[MAX_THREADS];
+    LaneState statePtrs[MAX_THREADS];
+    uint64 *fromPages[MAX_THREADS], *toPages[MAX_THREADS];
+    uint64 *mem;
+    uint32 lane, i;
+    if(posix_memalign((void **)&mem, CACHE_LINE_SIZE, 2ULL*width*pageLength*sizeof(uint64)) != 0) {
+        return;
+    }
+    memset(mem, 0x5a, 2ULL*width*pageLength*sizeof(uint64));
+    for(lane = 0; lane < width; lane++) {
+        memset(states + lane, lane + 1, sizeof(struct laneStateStruct));
+        statePtrs[lane] = states + lane;
+        fromPages[lane] = mem + lane*pageLength;
+        toPages[lane] = mem + (width + lane)*pageLength;
+    }
+    for(i = 0; i < IN_CACHE_FILLS; i++) {
+        bench->kernel->fillPages(statePtrs, fromPages, toPages, width, pageLength, 1);
+    }
+    bench->sinks[index] = states[0].lastPageData;
+    free(mem);
+}
+
+// Run job on the bench's threads until MIN_SECONDS have passed, and return the rate in bytes
+// per second, given the bytes each run moves.
+static double timeJob(Pool pool, PoolJob job, Bench bench, uint64 bytesPerRun) {
+    uint64 bytes = 0;
+    double start = getSeconds();
+    double elapsed;
+    do {
+        keystretchPoolRun(pool, job, bench, bench->numThreads);
+        bytes += bytesPerRun;
+        elapsed = getSeconds() - start;
+    } while(elapsed < MIN_SECONDS);
+    return bytes/elapsed;
+}
+
+// Return keystretch's best fill bandwidth in bytes per second, or 0 if it fails.
+static double timeKeystretch(uint64 memorySize, uint32 pageSize, uint32 numThreads) {
+    KeystretchContext context = keystretchCreateContext(memorySize, numThreads);
+    KeystretchStats stats;
+    uint8 key[32];
+    uint8 password[8] = "password";
+    double best = 0.0;
+    uint32 i;
+    if(context == NULL) {
+        return 0.0;
+    }
+    keystretchSetStats(context, &stats, false);
+    for(i = 0; i < KEYSTRETCH_REPEATS; i++) {
+        if(!keystretchHash(context, 4096, 1, memorySize, pageSize, numThreads, key, sizeof(key), "salt", 4,
+                password, sizeof(password), false, false)) {
+            break;
+        }
+        if(stats.fillBandwidth > best) {
+            best = stats.fillBandwidth;
+        }
+    }
+    keystretchDestroyContext(context);
+    return best;
+}
+
+// Read a comma separated list of numbers, each times scale.  Returns the length of the list,
+// or 0 if it isn't one.
+static uint32 readList(const char *text, uint64 scale, uint64 *values) {
+    uint32 length = 0;
+    char *end;
+    while(length < MAX_LIST) {
+        uint64 value = strtoull(text, &end, 10);
+        if(end == text || value == 0) {
+            return 0;
+        }
+        values[length++] = value*scale;
+        if(*end == '\0') {
+            return length;
+        }
+        if(*end != ',') {
+            return 0;
+        }
+        text = end + 1;
+    }
+    return 0;
+}
+
+// Print a rate in GB/s as a JSON field.
+static void writeRate(FILE *file, const char *name, double rate, const char *separator) {
+    fprintf(file, "\"%s\": %.3f%s", name, rate/1.0e9, separator);
+}
+
+// Write the results as JSON, with the label the caller gave this run, such as a commit id.
+static bool writeJson(const char *path, const char *label, Result results, uint32 numResults) {
+    FILE *file = fopen(path, "w");
+    uint32 i;
+    if(file == NULL) {
+        fprintf(stderr, "Unable to write %s\n", path);
+        return false;
+    }
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"cpus\": %ld,\n  \"kernel\": \"%s\",\n  \"units\": \"GB/s\",\n",
+        label, sysconf(_SC_NPROCESSORS_ONLN), keystretchFillKernelSelect()->name);
+    fprintf(file, "  \"results\": [\n");
+    for(i = 0; i < numResults; i++) {
+        Result r = results + i;
+        fprintf(file, "    {\"memorySize\": %llu, \"pageSize\": %u, \"threads\": %u, \"backing\": \"%s\", ",
+            r->memorySize, r->pageSize, r->numThreads, keystretchArenaBackingName(r->backing));
+        writeRate(file, "memmove", r->memmoveRate, ", ");
+        writeRate(file, "write", r->writeRate, ", ");
+        writeRate(file, "randomRead", r->readRate, ", ");
+        writeRate(file, "inCacheFill", r->inCacheRate, ", ");
+        writeRate(file, "keystretchFill", r->fillRate, ", ");
+        writeRate(file, "roofline", r->roofline, ", ");
+        fprintf(file, "\"fraction\": %.3f}%s\n", r->roofline > 0.0? r->fillRate/r->roofline : 0.0,
+            i + 1 < numResults? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+// Show the library's errors and warnings, but not what it logs for each hash.
+static void logProblems(KeystretchLogLevel level, const char *message, void *userData) {
+    if(level != KEYSTRETCH_LOG_INFO) {
+        keystretchLogStdio(level, message, userData);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: membench [-m memory sizes in MB] [-p page sizes in bytes] [-t thread counts]\n"
+        "                [-j JSON output file] [-l label]\n"
+        "Lists are comma separated.  The defaults are -m " DEFAULT_MEMORY_SIZES " -p " DEFAULT_PAGE_SIZES
+        ",\nand thread counts doubling up to the number of CPUs.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static struct resultStruct results[MAX_LIST*MAX_LIST*MAX_LIST];
+    uint64 memorySizes[MAX_LIST], pageSizes[MAX_LIST], threadCounts[MAX_LIST];
+    uint32 numMemorySizes, numPageSizes, numThreadCounts = 0, numResults = 0;
+    const char *jsonPath = NULL, *label = "";
+    const char *memoryList = DEFAULT_MEMORY_SIZES, *pageList = DEFAULT_PAGE_SIZES, *threadList = NULL;
+    uint64 maxPageSize = 0;
+    uint32 m, p, t, maxThreads = 1;
+    int option;
+    keystretchSetLog(logProblems, NULL);
+    while((option = getopt(argc, argv, "m:p:t:j:l:")) != -1) {
+        switch(option) {
+        case 'm': memoryList = optarg; break;
+        case 'p': pageList = optarg; break;
+        case 't': threadList = optarg; break;
+        case 'j': jsonPath = optarg; break;
+        case 'l': label = optarg; break;
+        default: usage();
+        }
+    }
+    if(optind != argc) {
+        usage();
+    }
+    numMemorySizes = readList(memoryList, 1ULL << 20, memorySizes);
+    numPageSizes = readList(pageList, 1, pageSizes);
+    if(threadList != NULL) {
+        numThreadCounts = readList(threadList, 1, threadCounts);
+    } else {
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        uint32 numThreads;
+        for(numThreads = 1; numThreads < numCpus && numThreads < MAX_THREADS; numThreads <<= 1) {
+            threadCounts[numThreadCounts++] = numThreads;
+        }
+        threadCounts[numThreadCounts++] = numCpus < MAX_THREADS? numCpus : MAX_THREADS;
+    }
+    if(numMemorySizes == 0 || numPageSizes == 0 || numThreadCounts == 0) {
+        usage();
+    }
+    for(p = 0; p < numPageSizes; p++) {
+        if(pageSizes[p] > maxPageSize) {
+            maxPageSize = pageSizes[p];
+        }
+        if(pageSizes[p] < MIN_PAGE_SIZE || (pageSizes[p] & (pageSizes[p] - 1)) || pageSizes[p] > (1 << 30)) {
+            fprintf(stderr, "Page sizes must be powers of 2, at least %u\n", MIN_PAGE_SIZE);
+            return 1;
+        }
+    }
+    for(t = 0; t < numThreadCounts; t++) {
+        if(threadCounts[t] > MAX_THREADS) {
+            fprintf(stderr, "At most %u threads\n", MAX_THREADS);
+            return 1;
+        }
+        if(threadCounts[t] > maxThreads) {
+            maxThreads = threadCounts[t];
+        }
+    }
+
+    // The raw rates use their own arena and pool, set up like keystretch's, and freed before
+    // keystretch allocates its own.
+    struct poolStruct pool;
+    struct benchStruct bench;
+    memset(&bench, '\0', sizeof(bench));
+    bench.kernel = keystretchFillKernelSelect();
+    keystretchPoolStart(&pool, maxThreads, NULL);
+    for(m = 0; m < numMemorySizes; m++) {
+        struct arenaStruct arena;
+        if(memorySizes[m] <= MAX_THREADS*maxPageSize || !keystretchArenaAllocate(&arena, memorySizes[m])) {
+            fprintf(stderr, "Unable to benchmark %llu bytes\n", memorySizes[m]);
+            return 1;
+        }
+        keystretchArenaPrefault(&arena, 0, arena.size);
+        bench.arena = &arena;
+        bench.size = arena.size;
+        for(t = 0; t < numThreadCounts; t++) {
+            bench.numThreads = threadCounts[t] < pool.numThreads? threadCounts[t] : pool.numThreads;
+            double memmoveRate = timeJob(&pool, memmoveJob, &bench, bench.size);
+            double writeRate = timeJob(&pool, writeJob, &bench, bench.size);
+            for(p = 0; p < numPageSizes; p++) {
+                Result r = results + numResults++;
+                r->memorySize = memorySizes[m];
+                r->pageSize = pageSizes[p];
+                r->numThreads = bench.numThreads;
+                r->backing = arena.backing;
+                r->memmoveRate = memmoveRate;
+                r->writeRate = writeRate;
+                bench.pageLength = pageSizes[p]/sizeof(uint64);
+                uint64 numPages = bench.size/pageSizes[p];
+                r->readRate = timeJob(&pool, readJob, &bench, numPages/bench.numThreads*bench.numThreads*pageSizes[p]);
+                r->inCacheRate = timeJob(&pool, inCacheJob, &bench,
+                    (uint64)bench.numThreads*IN_CACHE_FILLS*bench.kernel->width*pageSizes[p]);
+            }
+        }
+        keystretchArenaFree(&arena);
+    }
+    keystretchPoolStop(&pool);
+
+    // keystretch itself.
+    for(m = 0; m < numResults; m++) {
+        Result r = results + m;
+        r->fillRate = timeKeystretch(r->memorySize, r->pageSize, r->numThreads);
+        r->roofline = r->memmoveRate;
+        if(r->inCacheRate < r->roofline) {
+            r->roofline = r->inCacheRate;
+        }
+    }
+    printf("\nkernel %s, rates in GB/s\n", bench.kernel->name);
+    printf("  memory   page threads memmove   write    read   cache    fill roofline fraction\n");
+    for(m = 0; m < numResults; m++) {
+        Result r = results + m;
+        printf("%6lluMB %6u %7u %7.2f %7.2f %7.2f %7.2f %7.2f %8.2f %7.1f%%\n", r->memorySize >> 20,
+            r->pageSize, r->numThreads, r->memmoveRate/1.0e9, r->writeRate/1.0e9, r->readRate/1.0e9,
+            r->inCacheRate/1.0e9, r->fillRate/1.0e9, r->roofline/1.0e9,
+            r->roofline > 0.0? 100.0*r->fillRate/r->roofline : 0.0);
+    }
+    if(jsonPath != NULL && !writeJson(jsonPath, label, results, numResults)) {
+        return 1;
+    }
+    return 0;
+}
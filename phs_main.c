@@ -133,6 +133,7 @@ int main(int argc, char **argv) {
     uint32 cpuWorkMultiplier, derivedKeySize, saltSize, passwordSize;
     uint8 *salt;
     char *password;
+    keystretchSetLog(keystretchLogStdio, NULL);
     readArguments(argc, argv, &derivedKeySize, &password, &passwordSize, &salt, &saltSize, &cpuWorkMultiplier, &memorySize);
     verifyParameters(cpuWorkMultiplier, memorySize, derivedKeySize, saltSize, passwordSize);
     uint8 *derivedKey = (uint8 *)calloc(derivedKeySize, sizeof(uint8));
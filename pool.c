@@ -0,0 +1,180 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// Each worker waits for its own generation to change, and the caller waits for pool->running to
+// reach 0.  Workers a job does not need are left asleep, so they never see a job not meant for
+// them.  Both spin briefly first, since keystretch jobs often come right after one another, and
+// then sleep on the futex, so an idle pool costs no CPU.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "pool.h"
+#include "log.h"
+
+#define SPINS_BEFORE_SLEEP 1024
+
+static void futexWait(uint32 *word, uint32 value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(uint32 *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Wait until *word is no longer value, and return the new value.
+static uint32 waitWhileEqual(uint32 *word, uint32 value) {
+    uint32 spins = 0;
+    uint32 current;
+    while((current = __atomic_load_n(word, __ATOMIC_ACQUIRE)) == value) {
+        if(++spins < SPINS_BEFORE_SLEEP) {
+            __builtin_ia32_pause();
+        } else {
+            futexWait(word, value);
+        }
+    }
+    return current;
+}
+
+// Pin the calling thread to cpu.
+static void pinToCpu(uint32 cpu) {
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    (void)pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+}
+
+// Pin the calling thread to the index'th CPU we are allowed to run on, wrapping around if
+// there are more threads than CPUs.
+static void pinToAllowedCpu(uint32 index) {
+    cpu_set_t allowed;
+    uint32 numAllowed, cpu, n = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    numAllowed = CPU_COUNT(&allowed);
+    if(numAllowed == 0) {
+        return;
+    }
+    index %= numAllowed;
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &allowed) && n++ == index) {
+            pinToCpu(cpu);
+            return;
+        }
+    }
+}
+
+static void *poolWorker(void *threadPtr) {
+    PoolThread t = (PoolThread)threadPtr;
+    Pool pool = t->pool;
+    uint32 generation = 0; // Not loaded, since keystretchPoolRun may already have bumped it
+    if(t->cpu >= 0) {
+        pinToCpu(t->cpu);
+    } else {
+        pinToAllowedCpu(t->index);
+    }
+    while(true) {
+        generation = waitWhileEqual(&t->generation, generation);
+        if(pool->stop) {
+            break;
+        }
+        pool->job(pool->arg, t->index - pool->firstWorker);
+        if(__atomic_sub_fetch(&pool->running, 1, __ATOMIC_RELEASE) == 0) {
+            futexWake(&pool->running);
+        }
+    }
+    return NULL;
+}
+
+// Start numThreads - 1 workers.  Worker i is pinned to cpus[i], or if cpus is NULL, to the i'th
+// CPU we may run on.  If some fail to start, the pool is just smaller, and pool->numThreads
+// says how many jobs it can run at once.
+void keystretchPoolStart(Pool pool, uint32 numThreads, const uint32 *cpus) {
+    uint32 i;
+    memset(pool, '\0', sizeof(struct poolStruct));
+    pool->numThreads = 1;
+    for(i = 1; i < numThreads; i++) {
+        if(!keystretchPoolAddWorker(pool, cpus == NULL? -1 : (int)cpus[i])) {
+            break;
+        }
+    }
+}
+
+// Start one more worker, pinned to cpu, or if cpu is -1, to the CPU its index picks.  The pool
+// must be idle.  Returns false if the worker could not be started.
+bool keystretchPoolAddWorker(Pool pool, int cpu) {
+    if(pool->numThreads == MAX_THREADS) {
+        return false;
+    }
+    PoolThread t = pool->threads + pool->numThreads;
+    t->pool = pool;
+    t->index = pool->numThreads;
+    t->cpu = cpu;
+    t->generation = 0;
+    if(pthread_create(&t->thread, NULL, poolWorker, (void *)t) != 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_WARNING, "Unable to start worker thread");
+        return false;
+    }
+    pool->numThreads++;
+    return true;
+}
+
+// Wake workers 1 to numWorkers to run job, with worker 1 running index firstIndex.
+static void startWorkers(Pool pool, PoolJob job, void *arg, uint32 firstIndex, uint32 numWorkers) {
+    uint32 i;
+    pool->job = job;
+    pool->arg = arg;
+    pool->firstWorker = 1 - firstIndex;
+    __atomic_store_n(&pool->running, numWorkers, __ATOMIC_RELAXED);
+    for(i = 1; i <= numWorkers; i++) {
+        __atomic_add_fetch(&pool->threads[i].generation, 1, __ATOMIC_RELEASE);
+        futexWake(&pool->threads[i].generation);
+    }
+}
+
+// Run job for indexes 0 to numJobs - 1, index 0 on the calling thread, and return when they
+// are all done.  numJobs must be at most pool->numThreads.
+void keystretchPoolRun(Pool pool, PoolJob job, void *arg, uint32 numJobs) {
+    startWorkers(pool, job, arg, 1, numJobs - 1);
+    job(arg, 0);
+    keystretchPoolWait(pool);
+}
+
+// Run job for indexes 0 to numJobs - 1 on the workers alone, and return right away.  numJobs
+// must be less than pool->numThreads.  Call keystretchPoolWait before running anything else on
+// the pool.
+void keystretchPoolRunInBackground(Pool pool, PoolJob job, void *arg, uint32 numJobs) {
+    startWorkers(pool, job, arg, 0, numJobs);
+}
+
+// Return true if the workers are still running jobs.
+bool keystretchPoolBusy(Pool pool) {
+    return __atomic_load_n(&pool->running, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Wait for the workers to finish their jobs.
+void keystretchPoolWait(Pool pool) {
+    uint32 running;
+    while((running = __atomic_load_n(&pool->running, __ATOMIC_ACQUIRE)) != 0) {
+        waitWhileEqual(&pool->running, running);
+    }
+}
+
+// Wait for the workers to finish, then wake them, let them exit, and join them.
+void keystretchPoolStop(Pool pool) {
+    uint32 i;
+    keystretchPoolWait(pool);
+    pool->stop = true;
+    for(i = 1; i < pool->numThreads; i++) {
+        __atomic_add_fetch(&pool->threads[i].generation, 1, __ATOMIC_RELEASE);
+        futexWake(&pool->threads[i].generation);
+    }
+    for(i = 1; i < pool->numThreads; i++) {
+        (void)pthread_join(pool->threads[i].thread, NULL);
+    }
+    pool->numThreads = 1;
+}
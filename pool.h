@@ -0,0 +1,62 @@
+// A pool of long-lived worker threads, so each keystretch call does not pay for creating and
+// joining its threads.  Idle workers sleep on a futex, and each is pinned to its own CPU.
+// Only the workers a job needs are woken for it.
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include "keystretch.h"
+
+// A job is called once per index, from 0 to numJobs - 1, each on its own thread.
+typedef void (*PoolJob)(void *arg, uint32 index);
+
+typedef struct poolStruct *Pool;
+typedef struct poolThreadStruct *PoolThread;
+
+struct poolThreadStruct {
+    Pool pool;
+    pthread_t thread;
+    uint32 index;      // The thread's number in the pool
+    int cpu;           // The CPU to pin to, or -1 to pick by index
+    uint32 generation; // Futex word bumped to start a job, only access with __atomic builtins
+} __attribute__((aligned(64)));
+
+struct poolStruct {
+    struct poolThreadStruct threads[MAX_THREADS]; // Index 0 is the caller, so it is unused
+    uint32 numThreads;  // The caller plus the workers we started
+    PoolJob job;
+    void *arg;
+    uint32 firstWorker; // The thread that runs job index 0: 0 is the caller, 1 in the background
+    uint32 running;     // Futex word counting workers still busy, only access with __atomic builtins
+    bool stop;
+};
+
+// Start numThreads - 1 workers.  Worker i is pinned to cpus[i], or if cpus is NULL, to the i'th
+// CPU we may run on.  If some fail to start, the pool is just smaller, and pool->numThreads
+// says how many jobs it can run at once.
+void keystretchPoolStart(Pool pool, uint32 numThreads, const uint32 *cpus);
+
+// Start one more worker, pinned to cpu, or if cpu is -1, to the CPU its index picks.  The pool
+// must be idle.  Returns false if the worker could not be started.
+bool keystretchPoolAddWorker(Pool pool, int cpu);
+
+// Run job for indexes 0 to numJobs - 1, index 0 on the calling thread, and return when they
+// are all done.  numJobs must be at most pool->numThreads.
+void keystretchPoolRun(Pool pool, PoolJob job, void *arg, uint32 numJobs);
+
+// Run job for indexes 0 to numJobs - 1 on the workers alone, and return right away.  numJobs
+// must be less than pool->numThreads.  Call keystretchPoolWait before running anything else on
+// the pool.
+void keystretchPoolRunInBackground(Pool pool, PoolJob job, void *arg, uint32 numJobs);
+
+// Return true if the workers are still running jobs.
+bool keystretchPoolBusy(Pool pool);
+
+// Wait for the workers to finish their jobs.
+void keystretchPoolWait(Pool pool);
+
+// Wait for the workers to finish, then wake them, let them exit, and join them.
+void keystretchPoolStop(Pool pool);
+
+#endif
@@ -0,0 +1,87 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// A profile is a text file of "name value" lines, so it is easy to read, diff and edit.  Lines
+// starting with # are comments, and names we don't know are skipped, so newer tools can add
+// fields without breaking older readers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keystretch.h"
+#include "log.h"
+
+// Set the profile field called name to value.  Returns false if the value is not a number.
+// Unknown names are ignored.
+static bool setField(KeystretchProfile *profile, const char *name, const char *value) {
+    char *end;
+    uint64 number = strtoull(value, &end, 0);
+    if(end == value || (*end != '\0' && *end != '\n')) {
+        return false;
+    }
+    if(!strcmp(name, "sha256HashRounds")) {
+        profile->sha256HashRounds = (uint32)number;
+    } else if(!strcmp(name, "cpuWorkMultiplier")) {
+        profile->cpuWorkMultiplier = (uint32)number;
+    } else if(!strcmp(name, "memorySize")) {
+        profile->memorySize = number;
+    } else if(!strcmp(name, "pageSize")) {
+        profile->pageSize = (uint32)number;
+    } else if(!strcmp(name, "numThreads")) {
+        profile->numThreads = (uint32)number;
+    } else if(!strcmp(name, "latency")) {
+        profile->latency = number;
+    } else if(!strcmp(name, "fillBandwidth")) {
+        profile->fillBandwidth = number;
+    }
+    return true;
+}
+
+// Read a profile written by keystretch-calibrate.  Returns false if the file can't be read, or
+// is missing one of the hashing parameters.
+bool keystretchLoadProfile(const char *path, KeystretchProfile *profile) {
+    char line[256], name[64], value[64];
+    uint32 lineNum = 0;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to open profile %s", path);
+        return false;
+    }
+    memset(profile, '\0', sizeof(KeystretchProfile));
+    while(fgets(line, sizeof(line), file) != NULL) {
+        lineNum++;
+        if(sscanf(line, "%63s %63s", name, value) != 2 || name[0] == '#') {
+            continue;
+        }
+        if(!setField(profile, name, value)) {
+            keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Invalid value on line %u of profile %s", lineNum, path);
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    if(profile->sha256HashRounds == 0 || profile->cpuWorkMultiplier == 0 || profile->memorySize == 0 ||
+            profile->pageSize == 0 || profile->numThreads == 0) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Profile %s is missing hashing parameters", path);
+        return false;
+    }
+    return true;
+}
+
+// Write profile to path, in the format keystretchLoadProfile reads.
+bool keystretchSaveProfile(const char *path, const KeystretchProfile *profile) {
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        keystretchLogMessage(KEYSTRETCH_LOG_ERROR, "Unable to write profile %s", path);
+        return false;
+    }
+    fprintf(file, "# keystretch profile\n");
+    fprintf(file, "sha256HashRounds %u\n", profile->sha256HashRounds);
+    fprintf(file, "cpuWorkMultiplier %u\n", profile->cpuWorkMultiplier);
+    fprintf(file, "memorySize %llu\n", profile->memorySize);
+    fprintf(file, "pageSize %u\n", profile->pageSize);
+    fprintf(file, "numThreads %u\n", profile->numThreads);
+    fprintf(file, "# Measured on the host that wrote the profile\n");
+    fprintf(file, "latency %llu\n", profile->latency);
+    fprintf(file, "fillBandwidth %llu\n", profile->fillBandwidth);
+    return fclose(file) == 0;
+}
@@ -27,9 +27,17 @@
 #include <sys/types.h>
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "sha256.h"
+#include "log.h"
 
 static inline void
 be32enc(void *pp, uint32_t x)
@@ -103,22 +111,16 @@ be32dec_vect(uint32_t *dst, const unsigned char *src, size_t len)
 	    W[i] + k)
 
 /*
- * SHA256 block compression function.  The 256-bit state is transformed via
- * the 512-bit input block to produce a new state.
+ * Mix a prepared message schedule W into the state.  This is inlined into each of the
+ * compression functions below, so it is compiled for the instructions each one may use.
  */
-static void
-SHA256_Transform(uint32_t * state, const unsigned char block[64])
+static inline __attribute__((always_inline)) void
+SHA256_Mix(uint32_t * state, uint32_t W[64])
 {
-	uint32_t W[64];
 	uint32_t S[8];
 	uint32_t t0, t1;
 	int i;
 
-	/* 1. Prepare message schedule W. */
-	be32dec_vect(W, block, 64);
-	for (i = 16; i < 64; i++)
-		W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
-
 	/* 2. Initialize working variables. */
 	memcpy(S, state, 32);
 
@@ -198,6 +200,234 @@ SHA256_Transform(uint32_t * state, const unsigned char block[64])
 	t0 = t1 = 0;
 }
 
+/*
+ * SHA256 block compression function.  The 256-bit state is transformed via
+ * the 512-bit input block to produce a new state.
+ */
+static void
+SHA256_Transform_portable(uint32_t * state, const unsigned char block[64])
+{
+	uint32_t W[64];
+	int i;
+
+	/* 1. Prepare message schedule W. */
+	be32dec_vect(W, block, 64);
+	for (i = 16; i < 64; i++)
+		W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+
+	SHA256_Mix(state, W);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SSSE3 __attribute__((target("ssse3")))
+#define SHANI __attribute__((target("sha,sse4.1")))
+
+/* Vector versions of the message schedule functions. */
+#define ROTRv(x, n)	_mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n))
+#define s0v(x)		_mm_xor_si128(_mm_xor_si128(ROTRv(x, 7), ROTRv(x, 18)), _mm_srli_epi32(x, 3))
+#define s1v(x)		_mm_xor_si128(_mm_xor_si128(ROTRv(x, 17), ROTRv(x, 19)), _mm_srli_epi32(x, 10))
+
+/*
+ * Prepare the message schedule 4 words at a time.  M0..M3 hold W[i - 16] to W[i - 1].  The
+ * s1 term for W[i + 2] and W[i + 3] needs W[i] and W[i + 1], so it is added in a second step,
+ * with zeros (for which s1 is 0) in the other lanes.
+ */
+static inline SSSE3 __attribute__((always_inline)) void
+SHA256_Schedule_vector(uint32_t W[64], const unsigned char block[64])
+{
+	const __m128i BSWAP = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+	    4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i M0, M1, M2, M3, X;
+	int i;
+
+	M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)block), BSWAP);
+	M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 16)), BSWAP);
+	M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 32)), BSWAP);
+	M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 48)), BSWAP);
+	_mm_storeu_si128((__m128i *)W, M0);
+	_mm_storeu_si128((__m128i *)(W + 4), M1);
+	_mm_storeu_si128((__m128i *)(W + 8), M2);
+	_mm_storeu_si128((__m128i *)(W + 12), M3);
+	for (i = 16; i < 64; i += 4) {
+		X = _mm_add_epi32(M0, _mm_add_epi32(s0v(_mm_alignr_epi8(M1, M0, 4)),
+		    _mm_alignr_epi8(M3, M2, 4)));
+		X = _mm_add_epi32(X, s1v(_mm_srli_si128(M3, 8)));
+		X = _mm_add_epi32(X, s1v(_mm_slli_si128(X, 8)));
+		_mm_storeu_si128((__m128i *)(W + i), X);
+		M0 = M1;
+		M1 = M2;
+		M2 = M3;
+		M3 = X;
+	}
+}
+
+/* Compression with the message schedule computed in SSE registers. */
+static SSSE3 void
+SHA256_Transform_ssse3(uint32_t * state, const unsigned char block[64])
+{
+	uint32_t W[64];
+
+	SHA256_Schedule_vector(W, block);
+	SHA256_Mix(state, W);
+}
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * Compression with the x86 SHA extensions.  sha256rnds2 does two rounds and wants the state
+ * as ABEF and CDGH, and sha256msg1/sha256msg2 compute the message schedule 4 words at a time.
+ */
+static SHANI void
+SHA256_Transform_shani(uint32_t * state, const unsigned char block[64])
+{
+	const __m128i BSWAP = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+	    4, 5, 6, 7, 0, 1, 2, 3);
+	__m128i STATE0, STATE1, ABEF, CDGH, T;
+	__m128i M[4];
+	int i;
+
+	/* Shuffle the state from ABCD EFGH into ABEF CDGH. */
+	T = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xB1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1B);
+	STATE0 = _mm_alignr_epi8(T, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, T, 0xF0);
+	ABEF = STATE0;
+	CDGH = STATE1;
+
+#pragma GCC unroll 16
+	for (i = 0; i < 16; i++) {
+		if (i < 4)
+			M[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+			    (const __m128i *)(block + 16 * i)), BSWAP);
+		else
+			M[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+			    _mm_sha256msg1_epu32(M[i & 3], M[(i + 1) & 3]),
+			    _mm_alignr_epi8(M[(i + 3) & 3], M[(i + 2) & 3], 4)),
+			    M[(i + 3) & 3]);
+		T = _mm_add_epi32(M[i & 3],
+		    _mm_loadu_si128((const __m128i *)(K256 + 4 * i)));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, T);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1,
+		    _mm_shuffle_epi32(T, 0x0E));
+	}
+
+	STATE0 = _mm_add_epi32(STATE0, ABEF);
+	STATE1 = _mm_add_epi32(STATE1, CDGH);
+
+	/* Shuffle back to ABCD EFGH. */
+	T = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	_mm_storeu_si128((__m128i *)state, _mm_blend_epi16(T, STATE1, 0xF0));
+	_mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(STATE1, T, 8));
+}
+
+static int
+SHA256_ssse3_supported(void)
+{
+
+	return (__builtin_cpu_supports("ssse3"));
+}
+
+/* __builtin_cpu_supports does not know about SHA in older compilers, so ask cpuid. */
+static int
+SHA256_shani_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return (0);
+	return ((ebx & (1 << 29)) != 0 && __builtin_cpu_supports("sse4.1"));
+}
+#endif
+
+static int
+SHA256_portable_supported(void)
+{
+
+	return (1);
+}
+
+/* The compression functions, fastest first. */
+const SHA256_BACKEND SHA256_Backends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "shani", SHA256_shani_supported, SHA256_Transform_shani },
+	{ "ssse3", SHA256_ssse3_supported, SHA256_Transform_ssse3 },
+#endif
+	{ "portable", SHA256_portable_supported, SHA256_Transform_portable },
+	{ NULL, NULL, NULL }
+};
+
+static const SHA256_BACKEND * SHA256_Backend = NULL;
+
+/*
+ * Pick the fastest compression function this CPU supports, unless the KEYSTRETCH_SHA256
+ * environment variable names another one.
+ */
+static const SHA256_BACKEND *
+SHA256_Default_Backend(void)
+{
+	const SHA256_BACKEND * backend;
+	const char * name = getenv("KEYSTRETCH_SHA256");
+
+	if (name != NULL) {
+		for (backend = SHA256_Backends; backend->name != NULL; backend++) {
+			if (!strcmp(backend->name, name) && backend->supported())
+				return (backend);
+		}
+		keystretchLogMessage(KEYSTRETCH_LOG_WARNING, "SHA-256 backend %s is not "
+		    "available, so using the default", name);
+	}
+	for (backend = SHA256_Backends; !backend->supported(); backend++)
+		;
+	return (backend);
+}
+
+/* Return the compression function in use, choosing it on first use. */
+const SHA256_BACKEND *
+SHA256_Get_Backend(void)
+{
+	const SHA256_BACKEND * backend;
+
+	backend = __atomic_load_n(&SHA256_Backend, __ATOMIC_ACQUIRE);
+	if (backend == NULL) {
+		backend = SHA256_Default_Backend();
+		__atomic_store_n(&SHA256_Backend, backend, __ATOMIC_RELEASE);
+	}
+	return (backend);
+}
+
+/* Use the named compression function.  Returns 0 if it is unknown or unsupported. */
+int
+SHA256_Set_Backend(const char * name)
+{
+	const SHA256_BACKEND * backend;
+
+	for (backend = SHA256_Backends; backend->name != NULL; backend++) {
+		if (!strcmp(backend->name, name) && backend->supported()) {
+			__atomic_store_n(&SHA256_Backend, backend,
+			    __ATOMIC_RELEASE);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static inline void
+SHA256_Transform(uint32_t * state, const unsigned char block[64])
+{
+
+	SHA256_Get_Backend()->transform(state, block);
+}
+
 static unsigned char PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -371,50 +601,97 @@ HMAC_SHA256_Final(unsigned char digest[32], HMAC_SHA256_CTX * ctx)
 	memset(ihash, 0, 32);
 }
 
+/*
+ * Once the key pads are hashed, each PBKDF2 iteration is HMAC-SHA256 of a 32-byte U_j, which
+ * is exactly one padded block for the inner hash and one for the outer hash.  These blocks
+ * carry the message length after the 64-byte key pad: (64 + 32) * 8 = 768 bits.
+ */
+static void
+HMAC_SHA256_32_InitBlock(unsigned char block[64])
+{
+
+	memset(block + 32, 0, 32);
+	block[32] = 0x80;
+	block[62] = 0x03;
+	block[63] = 0x00;
+}
+
+/*
+ * Compute HMAC-SHA256 of the 32 bytes at the start of ublock, given the inner and outer
+ * states after the key pads, and write the result back to the start of ublock.  Both blocks
+ * must have been set up with HMAC_SHA256_32_InitBlock.
+ */
+static void
+HMAC_SHA256_32(const uint32_t istate[8], const uint32_t ostate[8],
+    unsigned char ublock[64], unsigned char oblock[64])
+{
+	uint32_t state[8];
+
+	/* Inner hash of the key pad and U. */
+	memcpy(state, istate, 32);
+	SHA256_Transform(state, ublock);
+	be32enc_vect(oblock, state, 32);
+
+	/* Outer hash of the key pad and the inner hash. */
+	memcpy(state, ostate, 32);
+	SHA256_Transform(state, oblock);
+	be32enc_vect(ublock, state, 32);
+}
+
 /**
- * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
- * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
- * write the output to buf.  The value dkLen must be at most 32 * (2^32 - 1).
+ * PBKDF2_SHA256_Blocks(passwd, passwdlen, salt, saltlen, c, buf, dkLen,
+ *     firstBlock, numBlocks):
+ * Compute only the 32 byte blocks firstBlock to firstBlock + numBlocks - 1 of
+ * PBKDF2(passwd, salt, c, dkLen), and write them to where they go in buf.
+ * Each block is independent, so threads can compute different ranges.
  */
 void
-PBKDF2_SHA256(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
-    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen)
+PBKDF2_SHA256_Blocks(const uint8_t * passwd, size_t passwdlen,
+    const uint8_t * salt, size_t saltlen, uint64_t c, uint8_t * buf,
+    size_t dkLen, size_t firstBlock, size_t numBlocks)
 {
 	HMAC_SHA256_CTX PShctx, hctx;
+	uint32_t istate[8], ostate[8];
 	size_t i;
 	uint8_t ivec[4];
-	uint8_t U[32];
+	uint8_t ublock[64];
+	uint8_t oblock[64];
 	uint8_t T[32];
 	uint64_t j;
 	int k;
 	size_t clen;
 
-	/* Compute HMAC state after processing P and S. */
+	/* Compute HMAC state after processing P, and save the key pad states. */
 	HMAC_SHA256_Init(&PShctx, passwd, passwdlen);
+	memcpy(istate, PShctx.ictx.state, 32);
+	memcpy(ostate, PShctx.octx.state, 32);
+
+	/* Compute HMAC state after processing P and S. */
 	HMAC_SHA256_Update(&PShctx, salt, saltlen);
 
+	HMAC_SHA256_32_InitBlock(ublock);
+	HMAC_SHA256_32_InitBlock(oblock);
+
 	/* Iterate through the blocks. */
-	for (i = 0; i * 32 < dkLen; i++) {
+	for (i = firstBlock; i < firstBlock + numBlocks && i * 32 < dkLen; i++) {
 		/* Generate INT(i + 1). */
 		be32enc(ivec, (uint32_t)(i + 1));
 
 		/* Compute U_1 = PRF(P, S || INT(i)). */
 		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
 		HMAC_SHA256_Update(&hctx, ivec, 4);
-		HMAC_SHA256_Final(U, &hctx);
+		HMAC_SHA256_Final(ublock, &hctx);
 
 		/* T_i = U_1 ... */
-		memcpy(T, U, 32);
+		memcpy(T, ublock, 32);
 
 		for (j = 2; j <= c; j++) {
 			/* Compute U_j. */
-			HMAC_SHA256_Init(&hctx, passwd, passwdlen);
-			HMAC_SHA256_Update(&hctx, U, 32);
-			HMAC_SHA256_Final(U, &hctx);
+			HMAC_SHA256_32(istate, ostate, ublock, oblock);
 
 			/* ... xor U_j ... */
 			for (k = 0; k < 32; k++)
-				T[k] ^= U[k];
+				T[k] ^= ublock[k];
 		}
 
 		/* Copy as many bytes as necessary into buf. */
@@ -426,4 +703,25 @@ PBKDF2_SHA256(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
 
 	/* Clean PShctx, since we never called _Final on it. */
 	memset(&PShctx, 0, sizeof(HMAC_SHA256_CTX));
+
+	/* Clean the stack. */
+	memset(istate, 0, 32);
+	memset(ostate, 0, 32);
+	memset(ublock, 0, 64);
+	memset(oblock, 0, 64);
+	memset(T, 0, 32);
+}
+
+/**
+ * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
+ * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
+ * write the output to buf.  The value dkLen must be at most 32 * (2^32 - 1).
+ */
+void
+PBKDF2_SHA256(const uint8_t * passwd, size_t passwdlen, const uint8_t * salt,
+    size_t saltlen, uint64_t c, uint8_t * buf, size_t dkLen)
+{
+
+	PBKDF2_SHA256_Blocks(passwd, passwdlen, salt, saltlen, c, buf, dkLen,
+	    0, (dkLen + 31) / 32);
 }
@@ -33,6 +33,25 @@
 
 #include <stdint.h>
 
+/*
+ * libkeystretch.a is linked into programs that may have their own SHA256_Init,
+ * such as OpenSSL's, so give these a keystretch_ prefix at link time.
+ */
+#define SHA256_Backends keystretch_SHA256_Backends
+#define SHA256_Get_Backend keystretch_SHA256_Get_Backend
+#define SHA256_Set_Backend keystretch_SHA256_Set_Backend
+#define SHA256_Init keystretch_SHA256_Init
+#define SHA256_Update keystretch_SHA256_Update
+#define SHA256_Final keystretch_SHA256_Final
+#define HMAC_SHA256_Init keystretch_HMAC_SHA256_Init
+#define HMAC_SHA256_Update keystretch_HMAC_SHA256_Update
+#define HMAC_SHA256_Final keystretch_HMAC_SHA256_Final
+#define PBKDF2_SHA256 keystretch_PBKDF2_SHA256
+#define PBKDF2_SHA256_Blocks keystretch_PBKDF2_SHA256_Blocks
+#define PBKDF2_SHA256_Multi keystretch_PBKDF2_SHA256_Multi
+#define PBKDF2_SHA256_Multi_Lanes keystretch_PBKDF2_SHA256_Multi_Lanes
+#define PBKDF2_SHA256_Multi_Set_Lanes keystretch_PBKDF2_SHA256_Multi_Set_Lanes
+
 typedef struct SHA256Context {
 	uint32_t state[8];
 	uint32_t count[2];
@@ -44,6 +63,21 @@ typedef struct HMAC_SHA256Context {
 	SHA256_CTX octx;
 } HMAC_SHA256_CTX;
 
+/*
+ * A SHA-256 block compression function.  The fastest one the CPU supports is
+ * used, and SHA256_Set_Backend picks another by name, for testing and
+ * benchmarking.  The list ends with a NULL name.
+ */
+typedef struct SHA256Backend {
+	const char *name;
+	int (*supported)(void);
+	void (*transform)(uint32_t *, const unsigned char *);
+} SHA256_BACKEND;
+
+extern const SHA256_BACKEND SHA256_Backends[];
+const SHA256_BACKEND *SHA256_Get_Backend(void);
+int	SHA256_Set_Backend(const char *);
+
 void	SHA256_Init(SHA256_CTX *);
 void	SHA256_Update(SHA256_CTX *, const void *, size_t);
 void	SHA256_Final(unsigned char [32], SHA256_CTX *);
@@ -59,4 +93,26 @@ void	HMAC_SHA256_Final(unsigned char [32], HMAC_SHA256_CTX *);
 void	PBKDF2_SHA256(const uint8_t *, size_t, const uint8_t *, size_t,
     uint64_t, uint8_t *, size_t);
 
+/**
+ * PBKDF2_SHA256_Blocks(passwd, passwdlen, salt, saltlen, c, buf, dkLen,
+ *     firstBlock, numBlocks):
+ * Compute only the 32 byte blocks firstBlock to firstBlock + numBlocks - 1 of
+ * PBKDF2(passwd, salt, c, dkLen), and write them to where they go in buf.
+ */
+void	PBKDF2_SHA256_Blocks(const uint8_t *, size_t, const uint8_t *, size_t,
+    uint64_t, uint8_t *, size_t, size_t, size_t);
+
+/**
+ * PBKDF2_SHA256_Multi(n, passwds, passwdlens, salts, saltlens, c, bufs, dkLen):
+ * Compute PBKDF2(passwds[i], salts[i], c, dkLen) for each i < n, writing the
+ * output to bufs[i].  Up to PBKDF2_SHA256_Multi_Lanes() of the chains run
+ * side by side in SIMD lanes, or one at a time with PBKDF2_SHA256 when that
+ * is faster.  This lives in sha256mb.c.
+ */
+void	PBKDF2_SHA256_Multi(size_t, const uint8_t * const *, const size_t *,
+    const uint8_t * const *, const size_t *, uint64_t, uint8_t * const *,
+    size_t);
+int	PBKDF2_SHA256_Multi_Lanes(void);
+int	PBKDF2_SHA256_Multi_Set_Lanes(int);
+
 #endif /* !_SHA256_H_ */
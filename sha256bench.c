@@ -0,0 +1,177 @@
+// This file benchmarks the SHA-256 compression functions in sha256.c, and the PBKDF2 work
+// keystretch does with each.  Each one is first checked against the portable version.  Then it
+// checks the multi-buffer PBKDF2 in sha256mb.c against PBKDF2_SHA256, at each vector width.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sha256.h"
+#include "keystretch.h"
+
+#define MIN_SECONDS 0.5
+#define NUM_BLOCKS 64
+#define NUM_PASSWORDS 64
+#define MULTI_KEY_SIZE 80
+
+static double getSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1.0e-9;
+}
+
+// Hash random blocks with the backend and the portable version, and compare the states.
+static int checkBackend(const SHA256_BACKEND *backend, const SHA256_BACKEND *portable) {
+    unsigned char block[64];
+    uint32_t state[8], expected[8];
+    int i, j;
+    srand(1);
+    for(j = 0; j < 8; j++) {
+        state[j] = expected[j] = rand();
+    }
+    for(i = 0; i < 1000; i++) {
+        for(j = 0; j < 64; j++) {
+            block[j] = rand();
+        }
+        backend->transform(state, block);
+        portable->transform(expected, block);
+    }
+    return !memcmp(state, expected, sizeof(state));
+}
+
+// Return millions of compressions per second.
+static double timeTransform(const SHA256_BACKEND *backend) {
+    unsigned char blocks[NUM_BLOCKS][64];
+    uint32_t state[8] = {0};
+    uint64_t count = 0;
+    double start = getSeconds(), elapsed;
+    memset(blocks, 0x5a, sizeof(blocks));
+    do {
+        int i;
+        for(i = 0; i < NUM_BLOCKS; i++) {
+            backend->transform(state, blocks[i]);
+        }
+        count += NUM_BLOCKS;
+        elapsed = getSeconds() - start;
+    } while(elapsed < MIN_SECONDS);
+    return count/elapsed/1.0e6;
+}
+
+// Return the milliseconds keystretch's initial 4096 round PBKDF2_SHA256 stretch takes.
+static double timePBKDF2(void) {
+    uint8_t key[32];
+    int count = 0;
+    double start = getSeconds(), elapsed;
+    do {
+        PBKDF2_SHA256((const uint8_t *)"password", 8, (const uint8_t *)"saltsalt", 8, 4096, key, sizeof(key));
+        count++;
+        elapsed = getSeconds() - start;
+    } while(elapsed < MIN_SECONDS);
+    return elapsed*1000.0/count;
+}
+
+static uint8_t passwords[NUM_PASSWORDS][16], salts[NUM_PASSWORDS][16];
+static uint8_t keys[NUM_PASSWORDS][MULTI_KEY_SIZE];
+static const uint8_t *passwordPtrs[NUM_PASSWORDS], *saltPtrs[NUM_PASSWORDS];
+static uint8_t *keyPtrs[NUM_PASSWORDS];
+static size_t passwordLens[NUM_PASSWORDS], saltLens[NUM_PASSWORDS];
+
+// Make up passwords and salts of varying lengths.
+static void initPasswords(void) {
+    int i, j;
+    srand(2);
+    for(i = 0; i < NUM_PASSWORDS; i++) {
+        for(j = 0; j < 16; j++) {
+            passwords[i][j] = rand();
+            salts[i][j] = rand();
+        }
+        passwordPtrs[i] = passwords[i];
+        saltPtrs[i] = salts[i];
+        keyPtrs[i] = keys[i];
+        passwordLens[i] = 1 + i % 16;
+        saltLens[i] = i % 17;
+    }
+}
+
+// Hash an odd number of passwords, so the last group is short, into keys of several blocks,
+// and compare them to PBKDF2_SHA256.
+static int checkMulti(void) {
+    uint8_t expected[MULTI_KEY_SIZE];
+    int n = NUM_PASSWORDS - 3, i;
+    memset(keys, 0, sizeof(keys));
+    PBKDF2_SHA256_Multi(n, passwordPtrs, passwordLens, saltPtrs, saltLens, 5, keyPtrs,
+        MULTI_KEY_SIZE);
+    for(i = 0; i < n; i++) {
+        PBKDF2_SHA256(passwordPtrs[i], passwordLens[i], saltPtrs[i], saltLens[i], 5, expected,
+            MULTI_KEY_SIZE);
+        if(memcmp(keys[i], expected, MULTI_KEY_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Return how many 4096 round PBKDF2_SHA256 stretches per second we get for a batch of
+// passwords.
+static double timeMulti(void) {
+    uint64_t count = 0;
+    double start = getSeconds(), elapsed;
+    do {
+        PBKDF2_SHA256_Multi(NUM_PASSWORDS, passwordPtrs, passwordLens, saltPtrs, saltLens, 4096,
+            keyPtrs, 32);
+        count += NUM_PASSWORDS;
+        elapsed = getSeconds() - start;
+    } while(elapsed < MIN_SECONDS);
+    return count/elapsed;
+}
+
+int main(void) {
+    const SHA256_BACKEND *backend, *portable = NULL;
+    const SHA256_BACKEND *defaultBackend = SHA256_Get_Backend();
+    int passed = 1;
+    keystretchSetLog(keystretchLogStdio, NULL);
+    printf("default backend: %s\n", defaultBackend->name);
+    for(backend = SHA256_Backends; backend->name != NULL; backend++) {
+        if(!strcmp(backend->name, "portable")) {
+            portable = backend;
+        }
+    }
+    for(backend = SHA256_Backends; backend->name != NULL; backend++) {
+        if(!backend->supported()) {
+            printf("%-9s not supported\n", backend->name);
+            continue;
+        }
+        if(!checkBackend(backend, portable)) {
+            printf("%-9s FAILED: output differs from portable\n", backend->name);
+            passed = 0;
+            continue;
+        }
+        SHA256_Set_Backend(backend->name);
+        printf("%-9s %6.2f M compressions/s, 4096 round PBKDF2 in %.3f ms\n", backend->name,
+            timeTransform(backend), timePBKDF2());
+    }
+    // Put the default backend back for the multi-buffer U_1 computations.
+    SHA256_Set_Backend(defaultBackend->name);
+    initPasswords();
+    // First as keystretch runs it, with each group where it is fastest, then each engine forced.
+    int lanes = PBKDF2_SHA256_Multi_Lanes(), usedLanes;
+    if(!checkMulti()) {
+        printf("default   FAILED: output differs from PBKDF2_SHA256\n");
+        passed = 0;
+    } else {
+        printf("default   %8.1f 4096 round PBKDF2s/s, %d at a time\n", timeMulti(), lanes);
+    }
+    for(lanes = 16; lanes >= 4; lanes /= 2) {
+        usedLanes = PBKDF2_SHA256_Multi_Set_Lanes(lanes);
+        if(usedLanes != lanes) {
+            printf("%2d lanes  not supported\n", lanes);
+            continue;
+        }
+        if(!checkMulti()) {
+            printf("%2d lanes  FAILED: output differs from PBKDF2_SHA256\n", lanes);
+            passed = 0;
+            continue;
+        }
+        printf("%2d lanes  %8.1f 4096 round PBKDF2s/s\n", lanes, timeMulti());
+    }
+    return passed? 0 : 1;
+}
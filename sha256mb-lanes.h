@@ -0,0 +1,108 @@
+/*
+ * This file is released into the public domain, like the rest of keystretch.
+ *
+ * Multi-buffer PBKDF2_SHA256 iterations for LANES independent chains, one per
+ * 32-bit vector lane.  sha256mb.c includes this once per vector width, with
+ * LANES and FUNC defined and the matching target pragma in effect.
+ *
+ * Vectors hold the same word of every lane, so state word j of lane l is
+ * S[j][l], and all lanes run the same instructions.
+ */
+
+typedef uint32_t FUNC(vec) __attribute__((vector_size(4 * LANES)));
+
+/* Compress one block W into the state S, for every lane. */
+static inline __attribute__((always_inline)) void
+FUNC(SHA256_Transform)(FUNC(vec) S[8], FUNC(vec) W[16])
+{
+	FUNC(vec) a = S[0], b = S[1], c = S[2], d = S[3];
+	FUNC(vec) e = S[4], f = S[5], g = S[6], h = S[7];
+	FUNC(vec) t0, t1;
+	int i;
+
+#pragma GCC unroll 64
+	for (i = 0; i < 64; i++) {
+		if (i >= 16)
+			W[i & 15] += s1(W[(i - 2) & 15]) + W[(i - 7) & 15] +
+			    s0(W[(i - 15) & 15]);
+		t0 = h + S1(e) + Ch(e, f, g) + K256[i] + W[i & 15];
+		t1 = S0(a) + Maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t0;
+		d = c;
+		c = b;
+		b = a;
+		a = t0 + t1;
+	}
+	S[0] += a;
+	S[1] += b;
+	S[2] += c;
+	S[3] += d;
+	S[4] += e;
+	S[5] += f;
+	S[6] += g;
+	S[7] += h;
+}
+
+/*
+ * Run iterations 2 to c of PBKDF2 for LANES chains.  istate and ostate are the
+ * HMAC key pad states, U holds U_1 on entry, and T (which starts as U_1) gets
+ * the xor of all the U_j.  Each is 8 words by LANES lanes.
+ */
+static void
+FUNC(PBKDF2_SHA256_Iterate)(const uint32_t * istate, const uint32_t * ostate,
+    uint32_t * U, uint32_t * T, uint64_t c)
+{
+	FUNC(vec) I[8], O[8], Uv[8], Tv[8], S[8], W[16], pad[8];
+	uint64_t j;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		memcpy(&I[i], istate + i * LANES, sizeof(FUNC(vec)));
+		memcpy(&O[i], ostate + i * LANES, sizeof(FUNC(vec)));
+		memcpy(&Uv[i], U + i * LANES, sizeof(FUNC(vec)));
+		memcpy(&Tv[i], T + i * LANES, sizeof(FUNC(vec)));
+		pad[i] = (FUNC(vec)){ 0 };
+	}
+
+	/* Both hashes are of 64 + 32 bytes, so each is one padded block. */
+	pad[0] += 0x80000000;
+	pad[7] += 768;
+
+	for (j = 2; j <= c; j++) {
+		/* Inner hash of the key pad and U_(j-1). */
+		for (i = 0; i < 8; i++) {
+			S[i] = I[i];
+			W[i] = Uv[i];
+			W[i + 8] = pad[i];
+		}
+		FUNC(SHA256_Transform)(S, W);
+
+		/* Outer hash of the key pad and the inner hash. */
+		for (i = 0; i < 8; i++) {
+			Uv[i] = O[i];
+			W[i] = S[i];
+			W[i + 8] = pad[i];
+		}
+		FUNC(SHA256_Transform)(Uv, W);
+
+		/* ... xor U_j ... */
+		for (i = 0; i < 8; i++)
+			Tv[i] ^= Uv[i];
+	}
+
+	for (i = 0; i < 8; i++) {
+		memcpy(U + i * LANES, &Uv[i], sizeof(FUNC(vec)));
+		memcpy(T + i * LANES, &Tv[i], sizeof(FUNC(vec)));
+	}
+
+	/* Clean the stack. */
+	memset(I, 0, sizeof(I));
+	memset(O, 0, sizeof(O));
+	memset(Uv, 0, sizeof(Uv));
+	memset(Tv, 0, sizeof(Tv));
+	memset(S, 0, sizeof(S));
+	memset(W, 0, sizeof(W));
+}
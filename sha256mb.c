@@ -0,0 +1,384 @@
+/*
+ * This file is released into the public domain, like the rest of keystretch.
+ *
+ * Multi-buffer PBKDF2_SHA256: many independent password/salt pairs with the
+ * same round count, with one HMAC-SHA256 chain in each 32-bit lane of a
+ * vector register.  SHA-256 has no cross-lane dependencies, so 16 chains in
+ * AVX-512 take about as many instructions as one chain does in scalar code.
+ *
+ * Only the iterations run in the vector lanes.  The key pad states and U_1
+ * are computed per lane with the ordinary HMAC code, since they cost a few
+ * compressions against the thousands the iterations take.
+ *
+ * A vector engine is not always faster than PBKDF2_SHA256: the scalar code
+ * has the SHA extensions where the CPU does, and lanes left empty in a short
+ * group are wasted.  So the first call times each engine and the scalar code
+ * for a few rounds, and every group of chains then goes wherever it will
+ * finish soonest.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha256.h"
+
+#define MAX_LANES	16
+#define CALIBRATION_ROUNDS	256
+#define CALIBRATION_TRIES	3
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Elementary functions used by SHA256, on scalars or vectors alike. */
+#define Ch(x, y, z)	((x & (y ^ z)) ^ z)
+#define Maj(x, y, z)	((x & (y | z)) | (y & z))
+#define SHR(x, n)	(x >> n)
+#define ROTR(x, n)	((x >> n) | (x << (32 - n)))
+#define S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ SHR(x, 3))
+#define s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ SHR(x, 10))
+
+/* 4 lanes need only SSE2, which every x86-64 has, or the generic vectors. */
+#define LANES	4
+#define FUNC(name)	name##_4
+#include "sha256mb-lanes.h"
+#undef LANES
+#undef FUNC
+
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define LANES	8
+#define FUNC(name)	name##_8
+#include "sha256mb-lanes.h"
+#undef LANES
+#undef FUNC
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define LANES	16
+#define FUNC(name)	name##_16
+#include "sha256mb-lanes.h"
+#undef LANES
+#undef FUNC
+#pragma GCC pop_options
+
+static int
+PBKDF2_avx2_supported(void)
+{
+
+	return (__builtin_cpu_supports("avx2"));
+}
+
+static int
+PBKDF2_avx512_supported(void)
+{
+
+	return (__builtin_cpu_supports("avx512f"));
+}
+#endif
+
+static int
+PBKDF2_generic_supported(void)
+{
+
+	return (1);
+}
+
+typedef struct PBKDF2MultiEngine {
+	int lanes;
+	int (*supported)(void);
+	void (*iterate)(const uint32_t *, const uint32_t *, uint32_t *,
+	    uint32_t *, uint64_t);
+} PBKDF2_MULTI_ENGINE;
+
+/* Widest first.  The last one is always supported. */
+static const PBKDF2_MULTI_ENGINE PBKDF2_Multi_Engines[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ 16, PBKDF2_avx512_supported, PBKDF2_SHA256_Iterate_16 },
+	{ 8, PBKDF2_avx2_supported, PBKDF2_SHA256_Iterate_8 },
+#endif
+	{ 4, PBKDF2_generic_supported, PBKDF2_SHA256_Iterate_4 }
+};
+
+#define NUM_ENGINES \
+    (sizeof(PBKDF2_Multi_Engines) / sizeof(PBKDF2_Multi_Engines[0]))
+
+static int PBKDF2_Multi_Max_Lanes = MAX_LANES;
+static int PBKDF2_Multi_Forced = 0;
+
+/*
+ * Chains per second each engine does with all its lanes full, and the scalar
+ * code does, measured on first use.  Only access with __atomic builtins.
+ */
+static uint64_t PBKDF2_Multi_Rates[NUM_ENGINES];
+static uint64_t PBKDF2_Scalar_Rate;
+static int PBKDF2_Multi_Calibrated = 0;
+
+static inline void
+be32enc(void *pp, uint32_t x)
+{
+	uint8_t * p = (uint8_t *)pp;
+
+	p[3] = x & 0xff;
+	p[2] = (x >> 8) & 0xff;
+	p[1] = (x >> 16) & 0xff;
+	p[0] = (x >> 24) & 0xff;
+}
+
+static inline uint32_t
+be32dec(const void *pp)
+{
+	const uint8_t *p = (uint8_t const *)pp;
+
+	return ((uint32_t)(p[3]) + ((uint32_t)(p[2]) << 8) +
+	    ((uint32_t)(p[1]) << 16) + ((uint32_t)(p[0]) << 24));
+}
+
+static double
+PBKDF2_Seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec + now.tv_nsec * 1.0e-9);
+}
+
+/* Time CALIBRATION_ROUNDS iterations of the engine, or the scalar code. */
+static double
+PBKDF2_Time_Engine(const PBKDF2_MULTI_ENGINE * engine)
+{
+	uint32_t istate[8 * MAX_LANES], ostate[8 * MAX_LANES];
+	uint32_t U[8 * MAX_LANES], T[8 * MAX_LANES];
+	uint8_t key[32];
+	double start, elapsed, best = 0;
+	int i;
+
+	memset(istate, 0, sizeof(istate));
+	memset(ostate, 0, sizeof(ostate));
+	memset(U, 0, sizeof(U));
+	memset(T, 0, sizeof(T));
+	for (i = 0; i < CALIBRATION_TRIES; i++) {
+		start = PBKDF2_Seconds();
+		if (engine != NULL)
+			engine->iterate(istate, ostate, U, T,
+			    CALIBRATION_ROUNDS);
+		else
+			PBKDF2_SHA256((const uint8_t *)"", 0,
+			    (const uint8_t *)"", 0, CALIBRATION_ROUNDS, key,
+			    sizeof(key));
+		elapsed = PBKDF2_Seconds() - start;
+		if (i == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return (best > 0 ? best : 1.0e-9);
+}
+
+/* Measure the engines and the scalar code, unless we have already. */
+static void
+PBKDF2_Multi_Calibrate(void)
+{
+	const PBKDF2_MULTI_ENGINE * engine;
+	size_t i;
+
+	if (__atomic_load_n(&PBKDF2_Multi_Calibrated, __ATOMIC_ACQUIRE))
+		return;
+	for (i = 0; i < NUM_ENGINES; i++) {
+		engine = &PBKDF2_Multi_Engines[i];
+		if (engine->supported())
+			__atomic_store_n(&PBKDF2_Multi_Rates[i],
+			    (uint64_t)(engine->lanes /
+			    PBKDF2_Time_Engine(engine)), __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&PBKDF2_Scalar_Rate,
+	    (uint64_t)(1 / PBKDF2_Time_Engine(NULL)), __ATOMIC_RELAXED);
+	__atomic_store_n(&PBKDF2_Multi_Calibrated, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pick where the next of the n chains we have left should run: the engine
+ * that finishes the most of them per second, counting its empty lanes as
+ * wasted, or NULL if PBKDF2_SHA256 one at a time is faster.  After
+ * PBKDF2_SHA256_Multi_Set_Lanes, always use the widest engine allowed.
+ */
+static const PBKDF2_MULTI_ENGINE *
+PBKDF2_Multi_Engine(size_t n)
+{
+	const PBKDF2_MULTI_ENGINE * engine, * best = NULL;
+	uint64_t rate, bestRate;
+	size_t i, chains;
+
+	if (PBKDF2_Multi_Forced) {
+		for (i = 0; i < NUM_ENGINES; i++) {
+			engine = &PBKDF2_Multi_Engines[i];
+			if (engine->lanes <= PBKDF2_Multi_Max_Lanes &&
+			    engine->supported())
+				return (engine);
+		}
+		return (&PBKDF2_Multi_Engines[NUM_ENGINES - 1]);
+	}
+	PBKDF2_Multi_Calibrate();
+	bestRate = __atomic_load_n(&PBKDF2_Scalar_Rate, __ATOMIC_RELAXED);
+	for (i = 0; i < NUM_ENGINES; i++) {
+		engine = &PBKDF2_Multi_Engines[i];
+		if (!engine->supported())
+			continue;
+		chains = n < (size_t)engine->lanes ? n : (size_t)engine->lanes;
+		rate = __atomic_load_n(&PBKDF2_Multi_Rates[i],
+		    __ATOMIC_RELAXED) * chains / engine->lanes;
+		if (rate > bestRate) {
+			best = engine;
+			bestRate = rate;
+		}
+	}
+	return (best);
+}
+
+/**
+ * PBKDF2_SHA256_Multi_Lanes(void):
+ * Return how many chains PBKDF2_SHA256_Multi runs side by side on this CPU,
+ * or 1 if it runs them one at a time.  Batches that are a multiple of this
+ * waste no lanes.
+ */
+int
+PBKDF2_SHA256_Multi_Lanes(void)
+{
+	const PBKDF2_MULTI_ENGINE * engine = PBKDF2_Multi_Engine(MAX_LANES);
+
+	return (engine != NULL ? engine->lanes : 1);
+}
+
+/**
+ * PBKDF2_SHA256_Multi_Set_Lanes(lanes):
+ * Always use the widest engine of at most lanes chains, even where the scalar
+ * code is faster, for testing and benchmarking the engines.  Returns the
+ * number of lanes now in use.
+ */
+int
+PBKDF2_SHA256_Multi_Set_Lanes(int lanes)
+{
+	PBKDF2_Multi_Max_Lanes = lanes;
+	PBKDF2_Multi_Forced = 1;
+	return (PBKDF2_SHA256_Multi_Lanes());
+}
+
+/*
+ * Run PBKDF2 for the count chains starting at first, in an engine with at
+ * least count lanes.  Unused lanes repeat the first chain, and are dropped.
+ */
+static void
+PBKDF2_SHA256_Multi_Group(const PBKDF2_MULTI_ENGINE * engine, size_t count,
+    const uint8_t * const * passwds, const size_t * passwdlens,
+    const uint8_t * const * salts, const size_t * saltlens, uint64_t c,
+    uint8_t * const * bufs, size_t dkLen)
+{
+	HMAC_SHA256_CTX PShctx[MAX_LANES], hctx;
+	uint32_t istate[8 * MAX_LANES], ostate[8 * MAX_LANES];
+	uint32_t U[8 * MAX_LANES], T[8 * MAX_LANES];
+	int lanes = engine->lanes;
+	size_t i, l, src;
+	uint8_t ivec[4];
+	uint8_t ublock[32];
+	int k;
+	size_t clen;
+
+	/* Compute each lane's HMAC state after processing P and S. */
+	for (l = 0; l < (size_t)lanes; l++) {
+		src = l < count ? l : 0;
+		HMAC_SHA256_Init(&PShctx[l], passwds[src], passwdlens[src]);
+		for (k = 0; k < 8; k++) {
+			istate[k * lanes + l] = PShctx[l].ictx.state[k];
+			ostate[k * lanes + l] = PShctx[l].octx.state[k];
+		}
+		HMAC_SHA256_Update(&PShctx[l], salts[src], saltlens[src]);
+	}
+
+	/* Iterate through the blocks. */
+	for (i = 0; i * 32 < dkLen; i++) {
+		/* Generate INT(i + 1). */
+		be32enc(ivec, (uint32_t)(i + 1));
+
+		/* Compute U_1 = PRF(P, S || INT(i)) and T_i = U_1 per lane. */
+		for (l = 0; l < (size_t)lanes; l++) {
+			memcpy(&hctx, &PShctx[l], sizeof(HMAC_SHA256_CTX));
+			HMAC_SHA256_Update(&hctx, ivec, 4);
+			HMAC_SHA256_Final(ublock, &hctx);
+			for (k = 0; k < 8; k++)
+				U[k * lanes + l] = T[k * lanes + l] =
+				    be32dec(ublock + k * 4);
+		}
+
+		/* ... xor U_2 ... xor U_c, in all lanes at once. */
+		engine->iterate(istate, ostate, U, T, c);
+
+		/* Copy as many bytes as necessary into each buf. */
+		clen = dkLen - i * 32;
+		if (clen > 32)
+			clen = 32;
+		for (l = 0; l < count; l++) {
+			for (k = 0; k < 8; k++)
+				be32enc(ublock + k * 4, T[k * lanes + l]);
+			memcpy(&bufs[l][i * 32], ublock, clen);
+		}
+	}
+
+	/* Clean the stack. */
+	memset(PShctx, 0, sizeof(PShctx));
+	memset(istate, 0, sizeof(istate));
+	memset(ostate, 0, sizeof(ostate));
+	memset(U, 0, sizeof(U));
+	memset(T, 0, sizeof(T));
+	memset(ublock, 0, sizeof(ublock));
+}
+
+/**
+ * PBKDF2_SHA256_Multi(n, passwds, passwdlens, salts, saltlens, c, bufs, dkLen):
+ * Compute PBKDF2(passwds[i], salts[i], c, dkLen) for each i < n, writing the
+ * output to bufs[i], the same as n calls to PBKDF2_SHA256 would.
+ */
+void
+PBKDF2_SHA256_Multi(size_t n, const uint8_t * const * passwds,
+    const size_t * passwdlens, const uint8_t * const * salts,
+    const size_t * saltlens, uint64_t c, uint8_t * const * bufs, size_t dkLen)
+{
+	const PBKDF2_MULTI_ENGINE * engine;
+	size_t first, count;
+
+	for (first = 0; first < n; first += count) {
+		engine = PBKDF2_Multi_Engine(n - first);
+		if (engine == NULL) {
+			count = 1;
+			PBKDF2_SHA256(passwds[first], passwdlens[first],
+			    salts[first], saltlens[first], c, bufs[first],
+			    dkLen);
+			continue;
+		}
+		count = n - first;
+		if (count > (size_t)engine->lanes)
+			count = engine->lanes;
+		PBKDF2_SHA256_Multi_Group(engine, count, passwds + first,
+		    passwdlens + first, salts + first, saltlens + first, c,
+		    bufs + first, dkLen);
+	}
+}
@@ -0,0 +1,248 @@
+// This file is released into the public domain, like the rest of keystretch.
+//
+// Everything comes from sysfs and the syscalls directly, so there is no dependency on libnuma.
+// On a machine without NUMA, every CPU is on node 0, and memory is left alone.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "topology.h"
+#include "log.h"
+
+#ifndef SYSFS_ROOT
+#define SYSFS_ROOT "/sys/devices/system"
+#endif
+#define MAX_REPORT_SIZE 512
+
+// Read a sysfs CPU list like "0-3,8-11" into set.  Returns false if the file can't be read.
+static bool readCpuList(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    char *p = buf, *end;
+    long first, last;
+    FILE *file = fopen(path, "r");
+    CPU_ZERO(set);
+    if(file == NULL) {
+        return false;
+    }
+    bool readOk = fgets(buf, sizeof(buf), file) != NULL;
+    fclose(file);
+    if(!readOk) {
+        return false;
+    }
+    while(*p != '\0' && *p != '\n') {
+        first = strtol(p, &end, 10);
+        if(end == p || first < 0) {
+            return false;
+        }
+        last = first;
+        p = end;
+        if(*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for(; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        if(*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+// Return the lowest CPU on the same physical core as cpu, which names the core.
+static uint32 coreOf(uint32 cpu) {
+    char path[256];
+    cpu_set_t siblings;
+    uint32 c;
+    snprintf(path, sizeof(path), SYSFS_ROOT "/cpu/cpu%u/topology/thread_siblings_list", cpu);
+    if(readCpuList(path, &siblings)) {
+        for(c = 0; c < CPU_SETSIZE; c++) {
+            if(CPU_ISSET(c, &siblings)) {
+                return c;
+            }
+        }
+    }
+    return cpu;
+}
+
+// Fill in the NUMA node of every CPU, and return how many nodes there are.
+static uint32 readNodes(uint8 *nodeOfCpu) {
+    char path[256];
+    cpu_set_t cpus;
+    uint32 node, cpu, numNodes = 1;
+    memset(nodeOfCpu, 0, CPU_SETSIZE);
+    for(node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), SYSFS_ROOT "/node/node%u/cpulist", node);
+        if(!readCpuList(path, &cpus)) {
+            continue; // Node numbers can have gaps
+        }
+        numNodes = node + 1;
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &cpus)) {
+                nodeOfCpu[cpu] = node;
+            }
+        }
+    }
+    return numNodes;
+}
+
+// Return the index of the first CPU in candidates not yet used, on node, or on any node if
+// anyNode.  Returns -1 if there are none.
+static int findUnusedCpu(uint32 *candidates, uint32 numCandidates, const uint8 *nodeOfCpu, uint32 node,
+        bool anyNode, cpu_set_t *used) {
+    uint32 i;
+    for(i = 0; i < numCandidates; i++) {
+        if(!CPU_ISSET(candidates[i], used) && (anyNode || nodeOfCpu[candidates[i]] == node)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Make the plan from the CPUs we may run on.  They are ordered with one CPU of each physical
+// core first, then the SMT siblings, so we only share a core's L1 once every core has a thread.
+// If the caller's node has a core per thread, we use only that node.  Otherwise, cores are
+// taken from each node in turn, and the arena is interleaved over them.
+static bool planFromCpus(Topology topology, cpu_set_t *allowed, uint32 numThreads, uint32 callerCpu,
+        const uint8 *nodeOfCpu, uint32 numNodes) {
+    uint32 coreOfCpu[CPU_SETSIZE], rankOfCpu[CPU_SETSIZE], candidates[CPU_SETSIZE];
+    cpu_set_t used;
+    uint32 numCores = 0, numCpus = 0, coresOnCallerNode = 0;
+    uint32 cpu, other, rank, callerNode, node, i, n;
+    int next;
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, allowed)) {
+            coreOfCpu[cpu] = coreOf(cpu);
+            rankOfCpu[cpu] = 0;
+            for(other = 0; other < cpu; other++) {
+                if(CPU_ISSET(other, allowed) && coreOfCpu[other] == coreOfCpu[cpu]) {
+                    rankOfCpu[cpu]++;
+                }
+            }
+            numCores += rankOfCpu[cpu] == 0;
+        }
+    }
+    if(numCores == 0) {
+        return false;
+    }
+    for(rank = 0; numCpus < (uint32)CPU_COUNT(allowed); rank++) {
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, allowed) && rankOfCpu[cpu] == rank) {
+                candidates[numCpus++] = cpu;
+            }
+        }
+    }
+    // The caller's core goes first.  If the caller may not run where it is now, the first
+    // allowed core stands in for it.
+    uint32 first = candidates[0];
+    if(CPU_ISSET(callerCpu, allowed)) {
+        for(i = 0; i < numCores; i++) {
+            if(coreOfCpu[candidates[i]] == coreOfCpu[callerCpu]) {
+                first = candidates[i];
+            }
+        }
+    }
+    callerNode = nodeOfCpu[first];
+    for(i = 0; i < numCores; i++) {
+        if(nodeOfCpu[candidates[i]] == callerNode) {
+            coresOnCallerNode++;
+        }
+    }
+    topology->numNodes = numNodes;
+    topology->interleave = numNodes > 1 && numThreads > coresOnCallerNode;
+    CPU_ZERO(&used);
+    CPU_SET(first, &used);
+    topology->cpus[0] = first;
+    topology->numCpus = 1;
+    node = callerNode;
+    while(topology->numCpus < numThreads) {
+        next = -1;
+        if(topology->interleave) {
+            for(n = 1; n <= numNodes && next < 0; n++) {
+                next = findUnusedCpu(candidates, numCpus, nodeOfCpu, (node + n) % numNodes, false, &used);
+                if(next >= 0) {
+                    node = (node + n) % numNodes;
+                }
+            }
+        } else {
+            next = findUnusedCpu(candidates, numCpus, nodeOfCpu, callerNode, numNodes == 1, &used);
+        }
+        if(next < 0) {
+            CPU_ZERO(&used); // Every CPU has a thread, so start doubling up
+            continue;
+        }
+        CPU_SET(candidates[next], &used);
+        topology->cpus[topology->numCpus++] = candidates[next];
+    }
+    topology->nodeMask = 0;
+    for(i = 0; i < topology->numCpus; i++) {
+        topology->nodeMask |= 1ULL << nodeOfCpu[topology->cpus[i]];
+    }
+    return true;
+}
+
+// Pick a physical core for each of numThreads threads, starting with the caller's core, and
+// staying on the caller's NUMA node if it has enough cores.  Returns false if the topology
+// could not be read.
+bool keystretchTopologyPlan(Topology topology, uint32 numThreads) {
+    uint8 nodeOfCpu[CPU_SETSIZE];
+    cpu_set_t allowed;
+    int callerCpu = sched_getcpu();
+    if(numThreads == 0 || numThreads > MAX_THREADS || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+    uint32 numNodes = readNodes(nodeOfCpu);
+    return planFromCpus(topology, &allowed, numThreads, callerCpu < 0? 0 : callerCpu, nodeOfCpu, numNodes);
+}
+
+// Set the NUMA policy of the arena's memory to match the plan.  A single node is only
+// preferred, not bound, so a full node spills over rather than failing.  This must be called
+// before the memory is faulted in.  Returns false if the kernel refused.
+bool keystretchTopologyPlaceMemory(Topology topology, void *mem, uint64 size) {
+    unsigned long nodeMask = topology->nodeMask;
+    if(topology->numNodes <= 1) {
+        return true;
+    }
+    int mode = topology->interleave? MPOL_INTERLEAVE : MPOL_PREFERRED;
+    return syscall(SYS_mbind, mem, size, mode, &nodeMask, MAX_NUMA_NODES + 1, 0) == 0;
+}
+
+// Append a list of the nodes in mask to line.
+static uint32 appendNodes(char *line, uint32 length, uint32 size, uint64 mask) {
+    uint32 node;
+    bool first = true;
+    for(node = 0; node < MAX_NUMA_NODES && length < size; node++) {
+        if(mask & (1ULL << node)) {
+            length += snprintf(line + length, size - length, first? "%u" : ",%u", node);
+            first = false;
+        }
+    }
+    return length;
+}
+
+// Log the plan on one line, for reporting.
+void keystretchTopologyReport(Topology topology) {
+    char line[MAX_REPORT_SIZE];
+    uint32 i, length;
+    if(!keystretchLogEnabled()) {
+        return;
+    }
+    length = snprintf(line, sizeof(line), "placement:cpus ");
+    for(i = 0; i < topology->numCpus && length < sizeof(line); i++) {
+        length += snprintf(line + length, sizeof(line) - length, i == 0? "%u" : ",%u", topology->cpus[i]);
+    }
+    if(length < sizeof(line) && topology->numNodes <= 1) {
+        snprintf(line + length, sizeof(line) - length, " memory:first-touch");
+    } else if(length < sizeof(line)) {
+        length += snprintf(line + length, sizeof(line) - length,
+            topology->interleave? " memory:interleaved nodes " : " memory:preferred node ");
+        appendNodes(line, length, sizeof(line), topology->nodeMask);
+    }
+    keystretchLogMessage(KEYSTRETCH_LOG_INFO, "%s", line);
+}
@@ -0,0 +1,36 @@
+// Placement of keystretch's threads and memory, from the CPU and NUMA topology in sysfs.  Pages
+// are sized to fit in L1, so two workers on SMT siblings of one core fight over its L1, and
+// fromPage reads are spread evenly over the arena, so memory on another socket costs a trip
+// over the interconnect on every page.  We pin one worker per physical core, and keep the arena
+// on the NUMA nodes the workers run on.
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "keystretch.h"
+
+#define MAX_NUMA_NODES 64
+
+typedef struct topologyStruct *Topology;
+
+struct topologyStruct {
+    uint32 cpus[MAX_THREADS]; // The CPU for each thread.  cpus[0] is the caller's core.
+    uint32 numCpus;
+    uint64 nodeMask;          // NUMA nodes those CPUs are on
+    uint32 numNodes;          // NUMA nodes in the system
+    bool interleave;          // Interleave the arena over nodeMask, rather than prefer one node
+};
+
+// Pick a physical core for each of numThreads threads, starting with the caller's core, and
+// staying on the caller's NUMA node if it has enough cores.  Returns false if the topology
+// could not be read.
+bool keystretchTopologyPlan(Topology topology, uint32 numThreads);
+
+// Set the NUMA policy of the arena's memory to match the plan.  This must be called before the
+// memory is faulted in.  Returns false if the kernel refused.
+bool keystretchTopologyPlaceMemory(Topology topology, void *mem, uint64 size);
+
+// Log the plan on one line, for reporting.
+void keystretchTopologyReport(Topology topology);
+
+#endif